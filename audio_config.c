@@ -26,14 +26,22 @@ typedef struct effect_interface_s **effect_handle_t;
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <cutils/properties.h>
 #include <cutils/compiler.h>
 #include <expat.h>
 #include <hardware/audio.h>
 #include <log/log.h>
+#include <sound/asound.h>
 #include <system/audio.h>
 #include <tinyalsa/asoundlib.h>
 
@@ -53,15 +61,31 @@ typedef struct effect_interface_s **effect_handle_t;
 
 #define INVALID_CTL_INDEX 0xFFFFFFFFUL
 
+/* Maximum number of streams synthesized at runtime for hotplugged cards */
+#define MAX_DYNAMIC_STREAMS 4
+
+/* Period geometry of synthesized streams */
+#define DYNAMIC_STREAM_PERIOD_MS 5
+#define DYNAMIC_STREAM_PERIOD_COUNT 4
+
 #define BIT_CLEAR(val, mask)            ((val) & ~(mask))
 #define BIT_EQUAL(mask, val1, val2)     (((val1) & (mask)) == ((val2) & (mask)))
 
+#define NSEC_PER_MSEC                   1000000LL
+#define NSEC_PER_SEC                    1000000000LL
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(a)                   (sizeof(a) / sizeof((a)[0]))
+#endif
+
 struct config_mgr;
 struct stream;
 struct path;
 struct device;
 struct usecase;
 struct scase;
+struct jack;
+struct shadow_ctl;
 
 /* Dynamically extended array of fixed-size objects */
 struct dyn_array {
@@ -76,6 +100,8 @@ struct dyn_array {
     struct usecase     *usecases;
     struct scase       *cases;
     struct ctl         *ctls;
+    struct jack        *jacks;
+    struct shadow_ctl  *shadows;
     const char         **path_names;
   };
 };
@@ -93,6 +119,7 @@ struct ctl {
   uint32_t            index;
   uint32_t            array_count;
   enum mixer_ctl_type type;
+  uint32_t            shadow;     /* index + 1 in the shadow, 0 if unknown */
 
   /* If the control couldn't be opened during boot the value will hold
    * a pointer to the original value string from the config file and will
@@ -154,14 +181,125 @@ struct stream {
 
   uint32_t current_devices;   /* devices currently active for this stream */
 
+  /* Input profiles: a stream declaring sources or input flags is only
+   * chosen for captures of those sources that have those flags
+   */
+  uint32_t sources;           /* BIT() of audio_source_t, 0 if generic */
+  uint32_t input_flags;       /* audio_input_flags_t required */
+
+  /* Routing requests within route_debounce_ms of the first one are
+   * collapsed into a single change to the last requested devices
+   */
+  uint32_t route_debounce_ms;
+  uint32_t pending_devices;
+  int64_t  route_deadline_ns;   /* 0 if no routing change is pending */
+
+  /* Streams synthesized for a hotplugged card are not part of stream_array.
+   * They serve dynamic_devices and are freed on release once removed
+   */
+  uint32_t dynamic_devices;
+  bool     removed;
+
   struct {
     struct stream_control volume_left;
     struct stream_control volume_right;
+    struct stream_control eld;      /* ELD of the connected sink */
+    struct stream_control chmap;    /* PCM channel map */
   } controls;
 
+  /* Control the trigger hardware of this stream changes when it fires,
+   * watched on the event mixer
+   */
+  struct {
+    const char        *name;
+    uint              index;
+    struct mixer_ctl  *handle;
+    int               value;
+    uint32_t          count;
+  } trigger;
+
   struct dyn_array    usecase_array;
 };
 
+/* Deferred switch-off of the global device. Short sounds in quick
+ * succession keep the codec powered instead of cycling it for each one
+ */
+struct idle_mgr {
+  uint32_t        base_delay_ms;  /* 0 switches off immediately */
+  uint32_t        max_delay_ms;
+  uint32_t        delay_ms;       /* doubles each time an off is cancelled */
+  int64_t         off_deadline_ns;    /* 0 if no off is pending */
+  struct path     *off_path;
+  bool            powered;        /* global "on" path is in effect */
+
+  uint32_t        on_count;
+  uint32_t        off_count;
+  uint32_t        cancel_count;
+};
+
+/* What we believe a mixer control holds, all values of it */
+struct shadow_ctl {
+  const char          *name;
+  enum mixer_ctl_type type;
+  uint32_t            count;
+  bool                valid;
+  bool                inherited;  /* restored and not written since */
+  union {
+    void            *data;
+    int             *values;      /* also the item of enums */
+    uint8_t         *bytes;
+  };
+};
+
+/* Shadow of the mixer persisted across HAL restarts. The codec keeps its
+ * state when the audio server dies so the restarted HAL can skip writing
+ * values that are still in effect
+ */
+struct mixer_snapshot {
+  const char          *path;      /* NULL if disabled */
+  struct dyn_array    shadow_array;
+  int64_t             save_deadline_ns;   /* 0 if saved */
+  bool                restored;
+  uint32_t            skipped;
+  uint32_t            saves;
+};
+
+/* Jack or status control watched for plug events. When the device is
+ * unplugged its streams are moved to fallback without waiting for the
+ * framework to reroute them
+ */
+struct jack {
+  const char          *name;          /* boolean control of the jack */
+  struct mixer_ctl    *handle;        /* on the event mixer */
+  uint32_t            device;
+  uint32_t            fallback;       /* 0 disconnects the streams */
+  int                 removed_path;   /* -1 if none */
+  int                 inserted_path;
+  bool                inserted;
+  uint32_t            events;
+};
+
+/* Thread blocking on control events of the jacks and triggers */
+struct event_watcher {
+  struct mixer        *mixer;         /* separate from the routing mixer */
+  int                 ctl_fd;         /* control device subscribed to events */
+  int                 wake_fd[2];     /* pipe waking the thread to exit */
+  pthread_t           thread;
+  bool                wanted;
+  bool                started;
+  config_event_fn     callback;
+  void                *cookie;
+};
+
+/* Thread running deferred config work, waits on cond with lock held */
+struct config_worker {
+  pthread_t       thread;
+  pthread_cond_t  cond;
+  bool            wanted;         /* config has something to defer */
+  bool            started;
+  bool            exit;
+};
+
 struct config_mgr {
   pthread_mutex_t lock;
 
@@ -173,6 +311,20 @@ struct config_mgr {
 
   struct dyn_array device_array;
   struct dyn_array stream_array;
+
+  struct stream   *dynamic_streams[MAX_DYNAMIC_STREAMS];
+
+  struct idle_mgr idle;
+  struct config_worker worker;
+
+  struct dyn_array jack_array;
+  struct event_watcher events;
+
+  struct mixer_snapshot snapshot;
+
+  uint32_t        route_requests;
+  uint32_t        routes_applied;
+  uint32_t        routes_coalesced;   /* requests that never hit the mixer */
 };
 
 /*********************************************************************
@@ -193,6 +345,7 @@ enum element_index {
   e_elem_usecase,
   e_elem_stream_ctl,
   e_elem_init,
+  e_elem_jack,
   e_elem_mixer,
   e_elem_audiohal,
 
@@ -217,19 +370,29 @@ enum attrib_index {
   e_attrib_min,
   e_attrib_max,
   e_attrib_default,
+  e_attrib_idle_delay,
+  e_attrib_idle_delay_max,
+  e_attrib_route_debounce,
+  e_attrib_removed,
+  e_attrib_inserted,
+  e_attrib_fallback,
+  e_attrib_snapshot,
+  e_attrib_keep_alive,
+  e_attrib_source,
+  e_attrib_flags,
 
   e_attrib_count
 };
 
-#define BIT(x)     (1<<(x))
+#define BIT(x)     (1u<<(x))
 
 struct parse_state;
 typedef int(*elem_fn)(struct parse_state *state);
 
 struct parse_element {
   const char *name;
-  uint16_t   valid_attribs;  /* bitflags of valid attribs for this element */
-  uint16_t   required_attribs;   /* bitflags of attribs that must be present */
+  uint32_t   valid_attribs;  /* bitflags of valid attribs for this element */
+  uint32_t   required_attribs;   /* bitflags of attribs that must be present */
   uint16_t   valid_subelem;  /* bitflags of valid sub-elements */
   elem_fn    start_fn;
   elem_fn    end_fn;
@@ -244,6 +407,11 @@ struct parse_device {
   uint32_t        device;
 };
 
+struct parse_flag {
+  const char      *name;
+  uint32_t        value;
+};
+
 struct parse_stack_entry {
   uint16_t            elem_index;
   uint16_t            valid_subelem;
@@ -294,6 +462,18 @@ struct parse_state {
 static int string_to_uint(uint32_t *result, const char *str);
 static int make_byte_array(struct ctl *c, struct mixer_ctl *ctl);
 static const char *debug_device_to_name(uint32_t device);
+static void start_worker_l(struct config_mgr *cm);
+static struct mixer_ctl *find_ctl_instance(struct mixer *mixer,
+                                           const char *name,
+                                           unsigned int instance);
+static int dyn_array_extend(struct dyn_array *array);
+static struct shadow_ctl *shadow_lookup_l(struct config_mgr *cm,
+                                          struct ctl *pctl);
+static bool shadow_matches(const struct shadow_ctl *sh,
+                           const struct ctl *pctl);
+static void shadow_written_l(struct config_mgr *cm, struct shadow_ctl *sh,
+                             const struct ctl *pctl, int err);
+static int64_t run_snapshot_save_l(struct config_mgr *cm, int64_t now);
 
 /*********************************************************************
  * Routing control
@@ -387,6 +567,7 @@ static int ctl_open(struct config_mgr *cm, struct ctl *pctl)
 static void apply_ctls_l(struct config_mgr *cm, struct ctl *pctl,
                          const int ctl_count)
 {
+  struct shadow_ctl *sh = NULL;
   struct mixer_ctl *ctl = NULL;
   unsigned int vnum = 0;
   unsigned int value_count = 0;
@@ -402,6 +583,15 @@ static void apply_ctls_l(struct config_mgr *cm, struct ctl *pctl,
 
     ctl = pctl->handle;
 
+    sh = (cm->snapshot.path != NULL) ? shadow_lookup_l(cm, pctl) : NULL;
+    if ((sh != NULL) && sh->inherited && shadow_matches(sh, pctl)) {
+      ALOGV("ctl '%s' still set from before restart", pctl->name);
+      ++cm->snapshot.skipped;
+      /* Only the first write can rely on the restored state */
+      sh->inherited = false;
+      continue;
+    }
+
     switch (mixer_ctl_get_type(ctl)) {
       case MIXER_CTL_TYPE_BOOL:
       case MIXER_CTL_TYPE_INT:
@@ -463,6 +653,10 @@ static void apply_ctls_l(struct config_mgr *cm, struct ctl *pctl,
       default:
         break;
     }
+
+    if (sh != NULL) {
+      shadow_written_l(cm, sh, pctl, err);
+    }
   }
 
   ALOGV("-apply_ctls_l");
@@ -477,6 +671,84 @@ static void apply_path_l(struct config_mgr *cm, struct path *path)
   ALOGV("-apply_path_l(%p)", path);
 }
 
+/*********************************************************************
+ * Deferred work
+ *********************************************************************/
+
+static int64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec;
+}
+
+static void wake_worker_l(struct config_mgr *cm)
+{
+  pthread_cond_signal(&cm->worker.cond);
+}
+
+/* Returns true if the off path of the global device will run later */
+static bool defer_global_off_l(struct config_mgr *cm, struct path *path)
+{
+  struct idle_mgr *idle = &cm->idle;
+
+  if ((idle->base_delay_ms == 0) || !cm->worker.started) {
+    return false;
+  }
+
+  idle->off_path = path;
+  idle->off_deadline_ns = now_ns() + (idle->delay_ms * NSEC_PER_MSEC);
+  ALOGV("Global off deferred by %u ms", idle->delay_ms);
+  wake_worker_l(cm);
+  return true;
+}
+
+/* Returns true if a pending off was cancelled so the device is still on */
+static bool cancel_global_off_l(struct config_mgr *cm)
+{
+  struct idle_mgr *idle = &cm->idle;
+
+  if (idle->off_deadline_ns == 0) {
+    return false;
+  }
+
+  /* The device was wanted again before it was switched off, wait longer
+   * next time
+   */
+  idle->off_deadline_ns = 0;
+  ++idle->cancel_count;
+  idle->delay_ms *= 2;
+  if (idle->delay_ms > idle->max_delay_ms) {
+    idle->delay_ms = idle->max_delay_ms;
+  }
+  ALOGV("Global off cancelled, delay now %u ms", idle->delay_ms);
+  return idle->powered;
+}
+
+/* Returns the time of the next pending off, 0 if none */
+static int64_t run_global_off_l(struct config_mgr *cm, int64_t now)
+{
+  struct idle_mgr *idle = &cm->idle;
+
+  if ((idle->off_deadline_ns == 0) || (now < idle->off_deadline_ns)) {
+    return idle->off_deadline_ns;
+  }
+
+  ALOGV("Global idle, applying off path");
+  idle->off_deadline_ns = 0;
+  apply_path_l(cm, idle->off_path);
+  idle->powered = false;
+  ++idle->off_count;
+
+  /* The delay was long enough, relax it back towards the base delay */
+  idle->delay_ms /= 2;
+  if (idle->delay_ms < idle->base_delay_ms) {
+    idle->delay_ms = idle->base_delay_ms;
+  }
+  return 0;
+}
+
 static void apply_device_path_l(struct config_mgr *cm, struct device *pdev,
                                 struct path *path)
 {
@@ -489,6 +761,9 @@ static void apply_device_path_l(struct config_mgr *cm, struct device *pdev,
         ALOGV("Device still in use - not applying 'off' path");
         return;
       }
+      if ((pdev->type == 0) && defer_global_off_l(cm, path)) {
+        return;
+      }
       break;
 
     case e_path_id_on:
@@ -496,6 +771,9 @@ static void apply_device_path_l(struct config_mgr *cm, struct device *pdev,
         ALOGV("Device already enabled - not applying 'on' path");
         return;
       }
+      if ((pdev->type == 0) && cancel_global_off_l(cm)) {
+        return;
+      }
       break;
 
     default:
@@ -504,6 +782,16 @@ static void apply_device_path_l(struct config_mgr *cm, struct device *pdev,
 
   apply_path_l(cm, path);
 
+  if (pdev->type == 0) {
+    if (path->id == e_path_id_on) {
+      cm->idle.powered = true;
+      ++cm->idle.on_count;
+    } else if (path->id == e_path_id_off) {
+      cm->idle.powered = false;
+      ++cm->idle.off_count;
+    }
+  }
+
   ALOGV("-apply_device_path_l(%p)", path);
 }
 
@@ -593,15 +881,27 @@ uint32_t get_current_routes(const struct hw_stream *stream)
   return s->current_devices;
 }
 
-void apply_route(const struct hw_stream *stream, uint32_t devices)
+static void apply_route_l(struct stream *s, uint32_t devices)
 {
-  struct stream *s = (struct stream *)stream;
   struct config_mgr *cm = s->cm;
 
   /* Only apply routes to devices that have changed state on this stream */
   uint32_t enabling = devices & ~s->current_devices;
   uint32_t disabling = ~devices & s->current_devices;
 
+  apply_paths_to_devices_l(cm, disabling, s->disable_path, e_path_id_off);
+  apply_paths_to_devices_l(cm, enabling, e_path_id_on, s->enable_path);
+
+  /* Save new set of devices for this stream */
+  s->current_devices = devices;
+  ++cm->routes_applied;
+}
+
+void apply_route(const struct hw_stream *stream, uint32_t devices)
+{
+  struct stream *s = (struct stream *)stream;
+  struct config_mgr *cm = s->cm;
+
   ALOGV("apply_route(%p) devices=0x%x", stream, devices);
 
   if (devices != 0) {
@@ -625,11 +925,25 @@ void apply_route(const struct hw_stream *stream, uint32_t devices)
 
   pthread_mutex_lock(&cm->lock);
 
-  apply_paths_to_devices_l(cm, disabling, s->disable_path, e_path_id_off);
-  apply_paths_to_devices_l(cm, enabling, e_path_id_on, s->enable_path);
-
-  /* Save new set of devices for this stream */
-  s->current_devices = devices;
+  ++cm->route_requests;
+  /* Only changes to a live route are debounced, the first route of a
+   * stream is applied at once so it can start playing
+   */
+  if ((s->route_debounce_ms != 0) && cm->worker.started
+      && ((s->current_devices != 0) || (s->route_deadline_ns != 0))) {
+    /* The window starts with the first request, later ones only change
+     * where the route ends up
+     */
+    if (s->route_deadline_ns == 0) {
+      s->route_deadline_ns = now_ns() + (s->route_debounce_ms * NSEC_PER_MSEC);
+      wake_worker_l(cm);
+    } else {
+      ++cm->routes_coalesced;
+    }
+    s->pending_devices = devices;
+  } else {
+    apply_route_l(s, devices);
+  }
 
   pthread_mutex_unlock(&cm->lock);
 }
@@ -640,169 +954,1343 @@ uint32_t get_routed_devices(const struct hw_stream *stream)
   return s->current_devices;
 }
 
-/*********************************************************************
- * Stream control
- *********************************************************************/
-
-static int set_vol_ctl(struct stream *stream,
-                       const struct stream_control *volctl, uint percent)
+void schedule_route(const struct hw_stream *stream, uint32_t devices,
+                    uint32_t delay_us)
 {
-  struct mixer_ctl *ctl = volctl->handle;
-  uint val = 0;
-  uint range = 0;
+  struct stream *s = (struct stream *)stream;
+  struct config_mgr *cm = s->cm;
 
-  UNUSED(stream);
+  ALOGV("schedule_route(%p) devices=0x%x in %u us", stream, devices, delay_us);
 
-  switch (percent) {
-    case 0:
-      val = volctl->min;
-      break;
+  /* A running stream still gets the debounce of its route changes */
+  if (delay_us < (s->route_debounce_ms * 1000)) {
+    delay_us = s->route_debounce_ms * 1000;
+  }
 
-    case 100:
-      val = volctl->max;
-      break;
+  pthread_mutex_lock(&cm->lock);
 
-    default:
-      range = volctl->max - volctl->min;
-      val = volctl->min + ((percent * range)/100);
-      break;
+  ++cm->route_requests;
+  if (!cm->worker.started) {
+    start_worker_l(cm);
   }
 
-  mixer_ctl_set_value(ctl, volctl->index, val);
-  return 0;
+  if (!cm->worker.started) {
+    apply_route_l(s, devices);
+  } else {
+    /* Keep the deadline of a change already on its way */
+    if (s->route_deadline_ns == 0) {
+      s->route_deadline_ns = now_ns() + (delay_us * 1000LL);
+      wake_worker_l(cm);
+    } else {
+      ++cm->routes_coalesced;
+    }
+    s->pending_devices = devices;
+  }
+
+  pthread_mutex_unlock(&cm->lock);
 }
 
-int set_hw_volume(const struct hw_stream *stream, int left_pc, int right_pc)
+bool is_route_pending(const struct hw_stream *stream)
 {
   struct stream *s = (struct stream *)stream;
-  int ret = -ENOSYS;
+  bool pending = false;
 
-  if (s->controls.volume_left.handle != NULL) {
-    if (s->controls.volume_right.handle == NULL) {
-      /* Control is mono so average left and right */
-      left_pc = (left_pc + right_pc) / 2;
-    }
+  pthread_mutex_lock(&s->cm->lock);
+  pending = (s->route_deadline_ns != 0);
+  pthread_mutex_unlock(&s->cm->lock);
+  return pending;
+}
 
-    ret = set_vol_ctl(s, &s->controls.volume_left, left_pc);
-  }
+void settle_route(const struct hw_stream *stream)
+{
+  struct stream *s = (struct stream *)stream;
 
-  if (s->controls.volume_right.handle != NULL) {
-    ret = set_vol_ctl(s, &s->controls.volume_right, right_pc);
+  pthread_mutex_lock(&s->cm->lock);
+  if (s->route_deadline_ns != 0) {
+    s->route_deadline_ns = 0;
+    apply_route_l(s, s->pending_devices);
   }
+  pthread_mutex_unlock(&s->cm->lock);
+}
 
-  ALOGV_IF(ret == 0, "set_hw_volume: L=%d%% R=%d%%", left_pc, right_pc);
+static int64_t run_pending_route_l(struct stream *s, int64_t now)
+{
+  if ((s->route_deadline_ns == 0) || (now < s->route_deadline_ns)) {
+    return s->route_deadline_ns;
+  }
 
-  return ret;
+  ALOGV("Debounced route of stream %p to 0x%x", s, s->pending_devices);
+  s->route_deadline_ns = 0;
+  apply_route_l(s, s->pending_devices);
+  return 0;
 }
 
-static struct stream *find_named_stream(struct config_mgr *cm, const char *name)
+/* Returns the time of the next pending routing change, 0 if none */
+static int64_t run_pending_routes_l(struct config_mgr *cm, int64_t now)
 {
   struct stream *s = cm->stream_array.streams;
+  int64_t next = 0;
+  int64_t t = 0;
 
-  for (int i = cm->stream_array.count - 1; i >= 0; --i) {
-    if (s->name) {
-      if (strcmp(s->name, name) == 0) {
-        return s;
+  for (unsigned int i = 0; i < cm->stream_array.count; ++i, ++s) {
+    t = run_pending_route_l(s, now);
+    if ((t != 0) && ((next == 0) || (t < next))) {
+      next = t;
+    }
+  }
+
+  for (int i = 0; i < MAX_DYNAMIC_STREAMS; ++i) {
+    if (cm->dynamic_streams[i] != NULL) {
+      t = run_pending_route_l(cm->dynamic_streams[i], now);
+      if ((t != 0) && ((next == 0) || (t < next))) {
+        next = t;
       }
     }
-    s++;
   }
-  return NULL;
+
+  return next;
 }
 
-static bool open_stream_l(struct config_mgr *cm, struct stream *s)
+/*********************************************************************
+ * Config worker
+ *********************************************************************/
+
+static void *config_worker_thread(void *param)
 {
-  if (s->ref_count < s->max_ref_count) {
-    ++s->ref_count;
-    if (s->ref_count == 1) {
-      apply_paths_to_global_l(cm, e_path_id_on, s->enable_path);
+  struct config_mgr *cm = (struct config_mgr *)param;
+  struct timespec ts;
+  int64_t now = 0;
+  int64_t next = 0;
+  int64_t t = 0;
+
+  pthread_mutex_lock(&cm->lock);
+  while (!cm->worker.exit) {
+    now = now_ns();
+    next = run_global_off_l(cm, now);
+    t = run_pending_routes_l(cm, now);
+    if ((t != 0) && ((next == 0) || (t < next))) {
+      next = t;
     }
-    return true;
-  } else {
-    ALOGV("stream at maximum refcount %d", s->ref_count);
-    return false;
+    t = run_snapshot_save_l(cm, now);
+    if ((t != 0) && ((next == 0) || (t < next))) {
+      next = t;
+    }
+
+    if (next == 0) {
+      pthread_cond_wait(&cm->worker.cond, &cm->lock);
+    } else {
+      ts.tv_sec = next / NSEC_PER_SEC;
+      ts.tv_nsec = next % NSEC_PER_SEC;
+      pthread_cond_timedwait(&cm->worker.cond, &cm->lock, &ts);
+    }
+  }
+
+  /* don't leave the codec powered after we've gone */
+  if (cm->idle.off_deadline_ns != 0) {
+    run_global_off_l(cm, cm->idle.off_deadline_ns);
+  }
+  if (cm->snapshot.save_deadline_ns != 0) {
+    run_snapshot_save_l(cm, cm->snapshot.save_deadline_ns);
   }
+  pthread_mutex_unlock(&cm->lock);
+  return NULL;
 }
 
-static struct device *hal_device_to_alsa(const struct config_mgr *cm,
-                                         const audio_devices_t devices)
+/* Called with cm->lock held, or before the config is shared */
+static void start_worker_l(struct config_mgr *cm)
 {
-  struct device *alsa_device = NULL;
-  struct device *aux = NULL;
+  pthread_condattr_t attr;
 
-  /* find an alsa device matching the one requested */
-  for (size_t i = 0; i < cm->device_array.count; ++i) {
-    aux = cm->device_array.devices + i;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cm->worker.cond, &attr);
+  pthread_condattr_destroy(&attr);
 
-    /* Try to find a matching device type (in / out) and a default device if
-     * requested or the matching requested device.
-     **/
-    if (aux->type != 0 &&
-        BIT_EQUAL(AUDIO_DEVICE_BIT_IN, aux->type, devices) &&
-          ((AUDIO_DEVICE_BIT_DEFAULT & aux->type & devices) ||
-           BIT_EQUAL(~(AUDIO_DEVICE_BIT_IN | AUDIO_DEVICE_BIT_DEFAULT),
-                     aux->type, devices))) {
-      ALOGV("get_stream found a matching device: %x", aux->type);
-      if (alsa_device) {
-        ALOGE("get_stream found multiple devices for %x", devices);
-        return NULL;
-      }
-      alsa_device = aux;
-    }
+  if (pthread_create(&cm->worker.thread, NULL, config_worker_thread, cm) != 0) {
+    ALOGE("Failed to start config worker, deferred work disabled");
+    pthread_cond_destroy(&cm->worker.cond);
+    return;
   }
+  cm->worker.started = true;
+}
 
-  return alsa_device;
+static void stop_worker(struct config_mgr *cm)
+{
+  if (!cm->worker.started) {
+    return;
+  }
+
+  pthread_mutex_lock(&cm->lock);
+  cm->worker.exit = true;
+  wake_worker_l(cm);
+  pthread_mutex_unlock(&cm->lock);
+
+  pthread_join(cm->worker.thread, NULL);
+  pthread_cond_destroy(&cm->worker.cond);
+  cm->worker.started = false;
 }
 
-const struct hw_stream *get_stream(struct config_mgr *cm,
-                                   const audio_devices_t devices,
-                                   const audio_output_flags_t flags,
-                                   const struct audio_config *config)
+void dump_audio_config(struct config_mgr *cm, int fd)
 {
-  int i = 0;
-  struct stream *s = cm->stream_array.streams;
-  const bool pcm = audio_is_linear_pcm(config->format);
-  enum stream_type type;
-  struct device *d = NULL;
+  const struct idle_mgr *idle = &cm->idle;
+
+  pthread_mutex_lock(&cm->lock);
+  dprintf(fd, "  Global device: %s%s\n", idle->powered ? "on" : "off",
+          (idle->off_deadline_ns != 0) ? " (off pending)" : "");
+  dprintf(fd, "    idle delay: %u ms (base %u ms, max %u ms)\n",
+          idle->delay_ms, idle->base_delay_ms, idle->max_delay_ms);
+  dprintf(fd, "    on: %u off: %u cancelled offs: %u\n",
+          idle->on_count, idle->off_count, idle->cancel_count);
+  dprintf(fd, "  Routing: requests: %u applied: %u coalesced: %u\n",
+          cm->route_requests, cm->routes_applied, cm->routes_coalesced);
+  if (cm->snapshot.path != NULL) {
+    dprintf(fd, "  Mixer snapshot %s: %s, %u ctls, skipped writes: %u"
+            " saves: %u\n", cm->snapshot.path,
+            cm->snapshot.restored ? "restored" : "not restored",
+            cm->snapshot.shadow_array.count, cm->snapshot.skipped,
+            cm->snapshot.saves);
+  }
+  for (unsigned int i = 0; i < cm->jack_array.count; ++i) {
+    const struct jack *j = &cm->jack_array.jacks[i];
+    dprintf(fd, "  Jack '%s' (%s): %s events: %u\n", j->name,
+            debug_device_to_name(j->device),
+            (j->handle == NULL) ? "missing"
+                                : (j->inserted ? "inserted" : "removed"),
+            j->events);
+  }
+  for (unsigned int i = 0; i < cm->stream_array.count; ++i) {
+    const struct stream *s = &cm->stream_array.streams[i];
+    if (s->trigger.name != NULL) {
+      dprintf(fd, "  Trigger '%s' of stream '%s': %s fired: %u\n",
+              s->trigger.name, s->name ? s->name : "",
+              (s->trigger.handle == NULL) ? "missing"
+                                          : (s->ref_count ? "armed" : "idle"),
+              s->trigger.count);
+    }
+  }
+  pthread_mutex_unlock(&cm->lock);
+}
+
+/*********************************************************************
+ * Mixer state snapshot
+ *********************************************************************/
 
-  ALOGV("+get_stream devices=0x%x flags=0x%x format=0x%x",
-      devices, flags, config->format);
+#define SNAPSHOT_MAGIC          "tinyhal-mixer 1"
+/* Collect changes before rewriting the snapshot */
+#define SNAPSHOT_SAVE_DELAY_MS  500
+/* Controls read back to check that the codec kept its state */
+#define SNAPSHOT_SENTINELS      4
+#define SNAPSHOT_LINE_MAX       ((BYTE_ARRAY_MAX_SIZE * 5) + 256)
 
-  d = hal_device_to_alsa(cm, devices);
+static struct shadow_ctl *new_shadow(struct dyn_array *array,
+                                     const char *name,
+                                     enum mixer_ctl_type type, uint32_t count)
+{
+  struct shadow_ctl *sh = NULL;
+  const size_t elem_size = (type == MIXER_CTL_TYPE_BYTE) ? 1 : sizeof(int);
 
-  if (!d) {
-    ALOGE("get_stream didn't find any device for %x", devices);
+  if ((count == 0) || (count > BYTE_ARRAY_MAX_SIZE)) {
     return NULL;
   }
 
+  if (dyn_array_extend(array) < 0) {
+    return NULL;
+  }
+
+  sh = &array->shadows[array->count - 1];
+  sh->name = strdup(name);
+  sh->data = calloc(count, elem_size);
+  if (!sh->name || !sh->data) {
+    free((void *)sh->name);
+    free(sh->data);
+    --array->count;
+    return NULL;
+  }
+  sh->type = type;
+  sh->count = count;
+  return sh;
+}
+
+static void shadows_free(struct dyn_array *array)
+{
+  for (unsigned int i = 0; i < array->count; ++i) {
+    free((void *)array->shadows[i].name);
+    free(array->shadows[i].data);
+  }
+  free(array->data);
+  array->data = NULL;
+  array->count = 0;
+  array->max_count = 0;
+}
+
+static int shadow_read(struct shadow_ctl *sh, const struct mixer_ctl *ctl)
+{
+  if (sh->type == MIXER_CTL_TYPE_BYTE) {
+    return mixer_ctl_get_array(ctl, sh->bytes, sh->count);
+  }
+
+  for (uint32_t i = 0; i < sh->count; ++i) {
+    sh->values[i] = mixer_ctl_get_value(ctl, i);
+  }
+  return 0;
+}
+
+static int shadow_enum_item(const struct ctl *pctl)
+{
+  const unsigned int count = mixer_ctl_get_num_enums(pctl->handle);
+  const char *item = NULL;
+
+  for (unsigned int i = 0; i < count; ++i) {
+    item = mixer_ctl_get_enum_string(pctl->handle, i);
+    if ((item != NULL) && (0 == strcmp(item, pctl->value.string))) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static struct shadow_ctl *shadow_lookup_l(struct config_mgr *cm,
+                                          struct ctl *pctl)
+{
+  struct dyn_array *array = &cm->snapshot.shadow_array;
+  struct shadow_ctl *sh = NULL;
+
+  if (pctl->shadow != 0) {
+    return &array->shadows[pctl->shadow - 1];
+  }
+
+  for (unsigned int i = 0; i < array->count; ++i) {
+    if (0 == strcmp(array->shadows[i].name, pctl->name)) {
+      pctl->shadow = i + 1;
+      return &array->shadows[i];
+    }
+  }
+
+  /* First write to this control, start from what the hardware holds */
+  sh = new_shadow(array, pctl->name, mixer_ctl_get_type(pctl->handle),
+                  mixer_ctl_get_num_values(pctl->handle));
+  if (sh == NULL) {
+    return NULL;
+  }
+  sh->valid = (shadow_read(sh, pctl->handle) >= 0);
+  pctl->shadow = array->count;
+  return sh;
+}
+
+static bool shadow_matches(const struct shadow_ctl *sh,
+                           const struct ctl *pctl)
+{
+  int item = 0;
+
+  switch (sh->type) {
+    case MIXER_CTL_TYPE_BOOL:
+    case MIXER_CTL_TYPE_INT:
+      if (pctl->index != INVALID_CTL_INDEX) {
+        return (pctl->index < sh->count) &&
+               (sh->values[pctl->index] == (int)pctl->value.uinteger);
+      }
+      for (uint32_t i = 0; i < sh->count; ++i) {
+        if (sh->values[i] != (int)pctl->value.uinteger) {
+          return false;
+        }
+      }
+      return true;
+
+    case MIXER_CTL_TYPE_BYTE:
+      return ((pctl->index + pctl->array_count) <= sh->count) &&
+             (0 == memcmp(&sh->bytes[pctl->index], pctl->value.data,
+                          pctl->array_count));
+
+    case MIXER_CTL_TYPE_ENUM:
+      /* Setting an enum by name sets every value of the control */
+      item = shadow_enum_item(pctl);
+      for (uint32_t i = 0; i < sh->count; ++i) {
+        if (sh->values[i] != item) {
+          return false;
+        }
+      }
+      return (item >= 0);
+
+    default:
+      return false;
+  }
+}
+
+/* Returns false if the written value can't be represented */
+static bool shadow_store(struct shadow_ctl *sh, const struct ctl *pctl)
+{
+  int item = 0;
+
+  switch (sh->type) {
+    case MIXER_CTL_TYPE_BOOL:
+    case MIXER_CTL_TYPE_INT:
+      if (pctl->index == INVALID_CTL_INDEX) {
+        for (uint32_t i = 0; i < sh->count; ++i) {
+          sh->values[i] = (int)pctl->value.uinteger;
+        }
+      } else if (pctl->index < sh->count) {
+        sh->values[pctl->index] = (int)pctl->value.uinteger;
+      } else {
+        return false;
+      }
+      return true;
+
+    case MIXER_CTL_TYPE_BYTE:
+      if ((pctl->index + pctl->array_count) > sh->count) {
+        return false;
+      }
+      memcpy(&sh->bytes[pctl->index], pctl->value.data, pctl->array_count);
+      return true;
+
+    case MIXER_CTL_TYPE_ENUM:
+      item = shadow_enum_item(pctl);
+      if (item < 0) {
+        return false;
+      }
+      for (uint32_t i = 0; i < sh->count; ++i) {
+        sh->values[i] = item;
+      }
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+static void shadow_written_l(struct config_mgr *cm, struct shadow_ctl *sh,
+                             const struct ctl *pctl, int err)
+{
+  sh->inherited = false;
+
+  if ((err < 0) || !sh->valid || !shadow_store(sh, pctl)) {
+    /* Don't know what the write left behind */
+    sh->valid = (shadow_read(sh, pctl->handle) >= 0);
+  }
+
+  if (cm->snapshot.save_deadline_ns == 0) {
+    cm->snapshot.save_deadline_ns = now_ns() +
+                                    (SNAPSHOT_SAVE_DELAY_MS * NSEC_PER_MSEC);
+    if (cm->worker.started) {
+      wake_worker_l(cm);
+    }
+  }
+}
+
+static void format_shadow(FILE *f, const struct shadow_ctl *sh)
+{
+  fprintf(f, "%d %u", sh->type, sh->count);
+  for (uint32_t i = 0; i < sh->count; ++i) {
+    if (sh->type == MIXER_CTL_TYPE_BYTE) {
+      fprintf(f, " 0x%02x", sh->bytes[i]);
+    } else {
+      fprintf(f, " %d", sh->values[i]);
+    }
+  }
+  fprintf(f, "\t%s\n", sh->name);
+}
+
+static int write_snapshot(const char *path, const char *buf, size_t len)
+{
+  char tmp_path[PATH_MAX];
+  FILE *f = NULL;
+  int ret = 0;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  f = fopen(tmp_path, "we");
+  if (!f) {
+    return -errno;
+  }
+
+  if (fwrite(buf, 1, len, f) != len) {
+    ret = -EIO;
+  }
+  if (fclose(f) != 0) {
+    ret = -EIO;
+  }
+
+  /* rename so that a crash while saving leaves the previous snapshot */
+  if ((ret == 0) && (rename(tmp_path, path) != 0)) {
+    ret = -errno;
+  }
+  if (ret != 0) {
+    unlink(tmp_path);
+  }
+  return ret;
+}
+
+/* Returns the time of the next pending save, 0 if none. Drops the lock
+ * while writing the file
+ */
+static int64_t run_snapshot_save_l(struct config_mgr *cm, int64_t now)
+{
+  struct mixer_snapshot *snap = &cm->snapshot;
+  const char *path = snap->path;
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *f = NULL;
+  int ret = 0;
+
+  if ((snap->save_deadline_ns == 0) || (now < snap->save_deadline_ns)) {
+    return snap->save_deadline_ns;
+  }
+  snap->save_deadline_ns = 0;
+
+  f = open_memstream(&buf, &len);
+  if (!f) {
+    ALOGE("Failed to save mixer snapshot");
+    return 0;
+  }
+
+  fprintf(f, "%s %u\n", SNAPSHOT_MAGIC, cm->mixer_card_number);
+  for (unsigned int i = 0; i < snap->shadow_array.count; ++i) {
+    if (snap->shadow_array.shadows[i].valid) {
+      format_shadow(f, &snap->shadow_array.shadows[i]);
+    }
+  }
+  fclose(f);
+
+  pthread_mutex_unlock(&cm->lock);
+  ret = write_snapshot(path, buf, len);
+  pthread_mutex_lock(&cm->lock);
+
+  free(buf);
+  if (ret != 0) {
+    ALOGE("Failed to write mixer snapshot %s (%d)", path, ret);
+  } else {
+    ++snap->saves;
+  }
+  return snap->save_deadline_ns;
+}
+
+static int parse_shadow(struct dyn_array *array, char *line)
+{
+  char *name = strchr(line, '\t');
+  char *p = line;
+  char *end = NULL;
+  struct shadow_ctl *sh = NULL;
+  enum mixer_ctl_type type = MIXER_CTL_TYPE_UNKNOWN;
+  uint32_t count = 0;
+
+  if (name == NULL) {
+    return -EINVAL;
+  }
+  *name++ = '\0';
+  name[strcspn(name, "\n")] = '\0';
+
+  type = (enum mixer_ctl_type)strtol(p, &end, 0);
+  count = strtoul(end, &end, 0);
+
+  sh = new_shadow(array, name, type, count);
+  if (sh == NULL) {
+    return -EINVAL;
+  }
+
+  for (uint32_t i = 0; i < count; ++i) {
+    p = end;
+    if (type == MIXER_CTL_TYPE_BYTE) {
+      sh->bytes[i] = (uint8_t)strtoul(p, &end, 0);
+    } else {
+      sh->values[i] = (int)strtol(p, &end, 0);
+    }
+    if (end == p) {
+      return -EINVAL;
+    }
+  }
+
+  sh->valid = true;
+  sh->inherited = true;
+  return 0;
+}
+
+static bool check_sentinel(struct config_mgr *cm, const struct shadow_ctl *sh)
+{
+  struct mixer_ctl *ctl = mixer_get_ctl_by_name(cm->mixer, sh->name);
+  const size_t elem_size = (sh->type == MIXER_CTL_TYPE_BYTE) ? 1 : sizeof(int);
+  struct shadow_ctl hw = *sh;
+  bool same = false;
+
+  if ((ctl == NULL) || (mixer_ctl_get_type(ctl) != sh->type) ||
+      (mixer_ctl_get_num_values(ctl) != sh->count)) {
+    return false;
+  }
+
+  hw.data = calloc(sh->count, elem_size);
+  if (!hw.data) {
+    return false;
+  }
+  same = (shadow_read(&hw, ctl) >= 0) &&
+         (0 == memcmp(hw.data, sh->data, sh->count * elem_size));
+  free(hw.data);
+  return same;
+}
+
+/* Called while parsing <mixer>, before the <init> path is applied */
+static void load_snapshot(struct config_mgr *cm)
+{
+  struct dyn_array *array = &cm->snapshot.shadow_array;
+  char *line = NULL;
+  char magic[64];
+  FILE *f = NULL;
+  unsigned int step = 0;
+  bool ok = false;
+
+  f = fopen(cm->snapshot.path, "re");
+  if (!f) {
+    ALOGV("No mixer snapshot");
+    return;
+  }
+
+  line = malloc(SNAPSHOT_LINE_MAX);
+  if (line == NULL) {
+    fclose(f);
+    return;
+  }
+
+  snprintf(magic, sizeof(magic), "%s %u\n", SNAPSHOT_MAGIC,
+           cm->mixer_card_number);
+  ok = (fgets(line, SNAPSHOT_LINE_MAX, f) != NULL) &&
+       (0 == strcmp(line, magic));
+
+  while (ok && (fgets(line, SNAPSHOT_LINE_MAX, f) != NULL)) {
+    ok = (parse_shadow(array, line) == 0);
+  }
+  free(line);
+  fclose(f);
+
+  /* A codec that was reset has lost its state, spot check a few controls
+   * spread over the snapshot
+   */
+  step = (array->count / SNAPSHOT_SENTINELS) + 1;
+  for (unsigned int i = 0; ok && (i < array->count); i += step) {
+    ok = check_sentinel(cm, &array->shadows[i]);
+  }
+
+  if (!ok) {
+    ALOGW("Mixer snapshot %s is stale, applying full state",
+          cm->snapshot.path);
+    shadows_free(array);
+    return;
+  }
+
+  ALOGV("Restored mixer snapshot of %u ctls", array->count);
+  cm->snapshot.restored = true;
+}
+
+/*********************************************************************
+ * Control events
+ *********************************************************************/
+
+/* Devices a stream keeps when the jack device is unplugged */
+static uint32_t jack_fallback_route(const struct jack *j, uint32_t devices)
+{
+  devices &= ~(j->device & ~AUDIO_DEVICE_BIT_IN);
+
+  if ((devices & ~AUDIO_DEVICE_BIT_IN) == 0) {
+    devices = j->fallback;
+  }
+  return devices;
+}
+
+static void jack_reroute_l(struct stream *s, const struct jack *j)
+{
+  const uint32_t gone = j->device & ~AUDIO_DEVICE_BIT_IN;
+
+  if (s->current_devices == 0) {
+    return;
+  }
+
+  if (!BIT_EQUAL(AUDIO_DEVICE_BIT_IN, s->current_devices, j->device)) {
+    return;
+  }
+
+  /* A debounced change must not bring the unplugged device back */
+  if ((s->route_deadline_ns != 0) && ((s->pending_devices & gone) != 0)) {
+    s->pending_devices = jack_fallback_route(j, s->pending_devices);
+  }
+
+  if ((s->current_devices & gone) != 0) {
+    ALOGV("Jack '%s' moves stream %p to 0x%x", j->name, s,
+          jack_fallback_route(j, s->current_devices));
+    apply_route_l(s, jack_fallback_route(j, s->current_devices));
+  }
+}
+
+static void jack_changed_l(struct config_mgr *cm, struct jack *j)
+{
+  struct stream *s = cm->stream_array.streams;
+
+  ++j->events;
+
+  if (j->inserted) {
+    if (j->inserted_path >= 0) {
+      apply_paths_to_devices_l(cm, j->device, j->inserted_path,
+                               j->inserted_path);
+    }
+    return;
+  }
+
+  /* Mute first, the reroute can take several control writes */
+  if (j->removed_path >= 0) {
+    apply_paths_to_devices_l(cm, j->device, j->removed_path, j->removed_path);
+  }
+
+  for (unsigned int i = 0; i < cm->stream_array.count; ++i, ++s) {
+    jack_reroute_l(s, j);
+  }
+
+  for (int i = 0; i < MAX_DYNAMIC_STREAMS; ++i) {
+    if (cm->dynamic_streams[i] != NULL) {
+      jack_reroute_l(cm->dynamic_streams[i], j);
+    }
+  }
+}
+
+static void read_jacks(struct config_mgr *cm)
+{
+  struct jack *j = cm->jack_array.jacks;
+  config_event_fn callback = NULL;
+  void *cookie = NULL;
+  int64_t timestamp = now_ns();
+  bool inserted = false;
+
+  for (unsigned int i = 0; i < cm->jack_array.count; ++i, ++j) {
+    if (j->handle == NULL) {
+      continue;
+    }
+
+    inserted = (mixer_ctl_get_value(j->handle, 0) > 0);
+
+    pthread_mutex_lock(&cm->lock);
+    if (inserted == j->inserted) {
+      pthread_mutex_unlock(&cm->lock);
+      continue;
+    }
+    j->inserted = inserted;
+    jack_changed_l(cm, j);
+    callback = cm->events.callback;
+    cookie = cm->events.cookie;
+    pthread_mutex_unlock(&cm->lock);
+
+    ALOGV("Jack '%s' %s", j->name, inserted ? "inserted" : "removed");
+
+    if (callback != NULL) {
+      callback(cookie,
+               inserted ? e_config_event_jack_inserted
+                        : e_config_event_jack_removed,
+               j->device, timestamp);
+    }
+  }
+}
+
+static void read_trigger(struct config_mgr *cm, struct stream *s)
+{
+  config_event_fn callback = NULL;
+  void *cookie = NULL;
+  int64_t timestamp = now_ns();
+  int value = mixer_ctl_get_value(s->trigger.handle, 0);
+  bool fired = false;
+
+  pthread_mutex_lock(&cm->lock);
+  if (value != s->trigger.value) {
+    s->trigger.value = value;
+
+    /* Only a stream that is in use has armed its trigger */
+    fired = (value != 0) && (s->ref_count > 0);
+    if (fired) {
+      ++s->trigger.count;
+      callback = cm->events.callback;
+      cookie = cm->events.cookie;
+    }
+  }
+  pthread_mutex_unlock(&cm->lock);
+
+  if (fired) {
+    ALOGV("Trigger '%s' of stream %p fired (%d)", s->trigger.name, s, value);
+    if (callback != NULL) {
+      callback(cookie, e_config_event_trigger, (uint32_t)value, timestamp);
+    }
+  }
+}
+
+static void read_triggers(struct config_mgr *cm)
+{
+  struct stream *s = cm->stream_array.streams;
+
+  for (unsigned int i = 0; i < cm->stream_array.count; ++i, ++s) {
+    if (s->trigger.handle != NULL) {
+      read_trigger(cm, s);
+    }
+  }
+}
+
+/*
+ * Waits on the control device for events and on the wake pipe, which
+ * stop_events() writes to so that closing doesn't wait for an event
+ */
+static void *event_thread(void *param)
+{
+  struct config_mgr *cm = (struct config_mgr *)param;
+  struct pollfd fds[2];
+  struct snd_ctl_event event;
+  int ret = 0;
+
+  fds[0].fd = cm->events.ctl_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = cm->events.wake_fd[0];
+  fds[1].events = POLLIN;
+
+  for (;;) {
+    ret = poll(fds, 2, -1);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ALOGE("Failed waiting for control events (%d)", errno);
+      break;
+    }
+
+    if (fds[1].revents != 0) {
+      break;
+    }
+
+    if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+      ALOGE("Control device failed, no more control events");
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      /* Only jacks and triggers are of interest and there are few of
+       * them, so the events themselves are dropped and they are all read
+       * again
+       */
+      while (read(cm->events.ctl_fd, &event, sizeof(event)) > 0) {
+      }
+      read_triggers(cm);
+      read_jacks(cm);
+    }
+  }
+
+  return NULL;
+}
+
+static int open_event_fds(struct config_mgr *cm)
+{
+  char path[32];
+  int subscribe = 1;
+
+  snprintf(path, sizeof(path), "/dev/snd/controlC%u", cm->mixer_card_number);
+  cm->events.ctl_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (cm->events.ctl_fd < 0) {
+    return -errno;
+  }
+
+  if ((ioctl(cm->events.ctl_fd, SNDRV_CTL_IOCTL_SUBSCRIBE_EVENTS,
+             &subscribe) < 0) ||
+      (pipe2(cm->events.wake_fd, O_CLOEXEC | O_NONBLOCK) < 0)) {
+    close(cm->events.ctl_fd);
+    cm->events.ctl_fd = -1;
+    return -errno;
+  }
+  return 0;
+}
+
+static void close_event_fds(struct config_mgr *cm)
+{
+  close(cm->events.ctl_fd);
+  close(cm->events.wake_fd[0]);
+  close(cm->events.wake_fd[1]);
+  cm->events.ctl_fd = -1;
+}
+
+static void start_events(struct config_mgr *cm)
+{
+  struct jack *j = cm->jack_array.jacks;
+  struct stream *s = cm->stream_array.streams;
+  int ret = 0;
+
+  cm->events.mixer = mixer_open(cm->mixer_card_number);
+  if (!cm->events.mixer) {
+    ALOGE("Failed to open mixer card %u for events", cm->mixer_card_number);
+    return;
+  }
+
+  for (unsigned int i = 0; i < cm->jack_array.count; ++i, ++j) {
+    j->handle = mixer_get_ctl_by_name(cm->events.mixer, j->name);
+    if (j->handle == NULL) {
+      ALOGW("Jack control '%s' not found", j->name);
+      continue;
+    }
+    j->inserted = (mixer_ctl_get_value(j->handle, 0) > 0);
+  }
+
+  for (unsigned int i = 0; i < cm->stream_array.count; ++i, ++s) {
+    if (s->trigger.name == NULL) {
+      continue;
+    }
+    s->trigger.handle = find_ctl_instance(cm->events.mixer, s->trigger.name,
+                                          s->trigger.index);
+    if (s->trigger.handle == NULL) {
+      ALOGW("Trigger control '%s' not found", s->trigger.name);
+      continue;
+    }
+    s->trigger.value = mixer_ctl_get_value(s->trigger.handle, 0);
+  }
+
+  ret = open_event_fds(cm);
+  if (ret == 0) {
+    ret = pthread_create(&cm->events.thread, NULL, event_thread, cm);
+    if (ret == 0) {
+      cm->events.started = true;
+      return;
+    }
+    close_event_fds(cm);
+  }
+
+  ALOGE("Failed to start control events (%d)", ret);
+  mixer_close(cm->events.mixer);
+  cm->events.mixer = NULL;
+}
+
+static void stop_events(struct config_mgr *cm)
+{
+  if (!cm->events.started) {
+    return;
+  }
+
+  if (write(cm->events.wake_fd[1], "", 1) != 1) {
+    ALOGE("Failed to wake the event thread (%d)", errno);
+  }
+
+  pthread_join(cm->events.thread, NULL);
+  cm->events.started = false;
+
+  close_event_fds(cm);
+  mixer_close(cm->events.mixer);
+  cm->events.mixer = NULL;
+}
+
+void set_config_event_callback(struct config_mgr *cm, config_event_fn callback,
+                               void *cookie)
+{
+  pthread_mutex_lock(&cm->lock);
+  cm->events.callback = callback;
+  cm->events.cookie = cookie;
+  pthread_mutex_unlock(&cm->lock);
+}
+
+uint32_t get_jack_devices(struct config_mgr *cm, bool input)
+{
+  const struct jack *j = cm->jack_array.jacks;
+  uint32_t devices = 0;
+
+  pthread_mutex_lock(&cm->lock);
+  for (unsigned int i = 0; i < cm->jack_array.count; ++i, ++j) {
+    if (j->inserted && (input == ((j->device & AUDIO_DEVICE_BIT_IN) != 0))) {
+      devices |= j->device;
+    }
+  }
+  pthread_mutex_unlock(&cm->lock);
+
+  return devices;
+}
+
+/*********************************************************************
+ * Stream control
+ *********************************************************************/
+
+static int set_vol_ctl(struct stream *stream,
+                       const struct stream_control *volctl, uint percent)
+{
+  struct mixer_ctl *ctl = volctl->handle;
+  uint val = 0;
+  uint range = 0;
+
+  UNUSED(stream);
+
+  switch (percent) {
+    case 0:
+      val = volctl->min;
+      break;
+
+    case 100:
+      val = volctl->max;
+      break;
+
+    default:
+      range = volctl->max - volctl->min;
+      val = volctl->min + ((percent * range)/100);
+      break;
+  }
+
+  mixer_ctl_set_value(ctl, volctl->index, val);
+  return 0;
+}
+
+int set_hw_volume(const struct hw_stream *stream, int left_pc, int right_pc)
+{
+  struct stream *s = (struct stream *)stream;
+  int ret = -ENOSYS;
+
+  if (s->controls.volume_left.handle != NULL) {
+    if (s->controls.volume_right.handle == NULL) {
+      /* Control is mono so average left and right */
+      left_pc = (left_pc + right_pc) / 2;
+    }
+
+    ret = set_vol_ctl(s, &s->controls.volume_left, left_pc);
+  }
+
+  if (s->controls.volume_right.handle != NULL) {
+    ret = set_vol_ctl(s, &s->controls.volume_right, right_pc);
+  }
+
+  ALOGV_IF(ret == 0, "set_hw_volume: L=%d%% R=%d%%", left_pc, right_pc);
+
+  return ret;
+}
+
+int get_hw_eld(const struct hw_stream *stream, uint8_t *eld, size_t size)
+{
+  struct stream *s = (struct stream *)stream;
+  struct mixer_ctl *ctl = s->controls.eld.handle;
+  unsigned int count = 0;
+  unsigned int len = 0;
+  int ret = 0;
+
+  if (ctl == NULL) {
+    return -ENOSYS;
+  }
+
+  count = mixer_ctl_get_num_values(ctl);
+  if (count > size) {
+    count = size;
+  }
+
+  ret = mixer_ctl_get_array(ctl, eld, count);
+  if (ret < 0) {
+    ALOGE("Failed to read ELD (%d)", ret);
+    return ret;
+  }
+
+  /* The control always has its full size, with the ELD zeroed when no
+   * sink is connected. A valid ELD has a version in the top bits of the
+   * first header byte and the baseline block length, in dwords, in the
+   * third.
+   */
+  if ((count < 4) || ((eld[0] >> 3) == 0) || (eld[2] == 0)) {
+    return -ENODEV;
+  }
+
+  len = 4 + (eld[2] * 4);
+  if (len > count) {
+    len = count;
+  }
+
+  ALOGV("get_hw_eld(%p) %u bytes", stream, len);
+  return (int)len;
+}
+
+int set_hw_channel_map(const struct hw_stream *stream,
+                       const unsigned int *map, unsigned int count)
+{
+  struct stream *s = (struct stream *)stream;
+  struct mixer_ctl *ctl = s->controls.chmap.handle;
+  long values[SNDRV_CHMAP_LAST + 1] = { 0 };
+  unsigned int i = 0;
+
+  if (ctl == NULL) {
+    return -ENOSYS;
+  }
+
+  if ((count > mixer_ctl_get_num_values(ctl)) || (count > ARRAY_SIZE(values))) {
+    return -EINVAL;
+  }
+
+  for (i = 0; i < count; ++i) {
+    values[i] = map[i];
+  }
+
+  /* Controls that only report the map chosen by the driver reject this */
+  return mixer_ctl_set_array(ctl, values, count);
+}
+
+int get_hw_channel_map(const struct hw_stream *stream, unsigned int *map,
+                       unsigned int count)
+{
+  struct stream *s = (struct stream *)stream;
+  struct mixer_ctl *ctl = s->controls.chmap.handle;
+  long values[SNDRV_CHMAP_LAST + 1] = { 0 };
+  unsigned int n = 0;
+  unsigned int i = 0;
+  int ret = 0;
+
+  if (ctl == NULL) {
+    return -ENOSYS;
+  }
+
+  n = mixer_ctl_get_num_values(ctl);
+  if (n > ARRAY_SIZE(values)) {
+    n = ARRAY_SIZE(values);
+  }
+
+  ret = mixer_ctl_get_array(ctl, values, n);
+  if (ret < 0) {
+    return ret;
+  }
+
+  for (i = 0; (i < n) && (i < count); ++i) {
+    map[i] = (unsigned int)values[i];
+  }
+  return (int)i;
+}
+
+static struct stream *find_named_stream(struct config_mgr *cm, const char *name)
+{
+  struct stream *s = cm->stream_array.streams;
+
+  for (int i = cm->stream_array.count - 1; i >= 0; --i) {
+    if (s->name) {
+      if (strcmp(s->name, name) == 0) {
+        return s;
+      }
+    }
+    s++;
+  }
+  return NULL;
+}
+
+static bool open_stream_l(struct config_mgr *cm, struct stream *s)
+{
+  if (s->ref_count < s->max_ref_count) {
+    ++s->ref_count;
+    if (s->ref_count == 1) {
+      apply_paths_to_global_l(cm, e_path_id_on, s->enable_path);
+    }
+    return true;
+  } else {
+    ALOGV("stream at maximum refcount %d", s->ref_count);
+    return false;
+  }
+}
+
+static struct stream *find_dynamic_stream_l(struct config_mgr *cm,
+                                            const audio_devices_t devices,
+                                            enum stream_type type)
+{
+  const uint32_t input_flag = devices & AUDIO_DEVICE_BIT_IN;
+  struct stream *s = NULL;
+
+  for (int i = 0; i < MAX_DYNAMIC_STREAMS; ++i) {
+    s = cm->dynamic_streams[i];
+    if ((s != NULL) && !s->removed && (s->info.type == type)
+        && ((s->dynamic_devices & AUDIO_DEVICE_BIT_IN) == input_flag)
+        && ((s->dynamic_devices & devices & ~AUDIO_DEVICE_BIT_IN) != 0)) {
+      return s;
+    }
+  }
+
+  return NULL;
+}
+
+static struct device *hal_device_to_alsa(const struct config_mgr *cm,
+                                         const audio_devices_t devices)
+{
+  struct device *alsa_device = NULL;
+  struct device *aux = NULL;
+
+  /* find an alsa device matching the one requested */
+  for (size_t i = 0; i < cm->device_array.count; ++i) {
+    aux = cm->device_array.devices + i;
+
+    /* Try to find a matching device type (in / out) and a default device if
+     * requested or the matching requested device.
+     **/
+    if (aux->type != 0 &&
+        BIT_EQUAL(AUDIO_DEVICE_BIT_IN, aux->type, devices) &&
+          ((AUDIO_DEVICE_BIT_DEFAULT & aux->type & devices) ||
+           BIT_EQUAL(~(AUDIO_DEVICE_BIT_IN | AUDIO_DEVICE_BIT_DEFAULT),
+                     aux->type, devices))) {
+      ALOGV("get_stream found a matching device: %x", aux->type);
+      if (alsa_device) {
+        ALOGE("get_stream found multiple devices for %x", devices);
+        return NULL;
+      }
+      alsa_device = aux;
+    }
+  }
+
+  return alsa_device;
+}
+
+/* How well a stream suits a capture of source with input flags, 0 if it
+ * must not be used. A stream declaring the source or the flags wins over
+ * a generic one. Output streams are all equal
+ */
+static int stream_rank(const struct stream *s, int source, uint32_t flags)
+{
+  int rank = 1;
+
+  if (s->sources != 0) {
+    if ((source < 0) || (source >= 32) || !(s->sources & BIT(source))) {
+      return 0;
+    }
+    rank += 2;
+  }
+
+  if (s->input_flags != 0) {
+    if ((s->input_flags & flags) != s->input_flags) {
+      return 0;
+    }
+    rank += 1;
+  }
+
+  return rank;
+}
+
+/* Best stream on the device of alsa device d, or NULL */
+static struct stream *find_stream_l(struct config_mgr *cm,
+                                    const struct device *d,
+                                    enum stream_type type,
+                                    int source, uint32_t flags,
+                                    bool available)
+{
+  struct stream *s = cm->stream_array.streams;
+  struct stream *best = NULL;
+  int best_rank = 0;
+  int rank = 0;
+  int i = 0;
+
+  for (i = cm->stream_array.count - 1; i >= 0; --i) {
+    ALOGV("find_stream: require type=%d, device=%d; try type=%d device=%d"
+            " refcount=%d refmax=%d", type, d->device_number, s[i].info.type,
+            s[i].info.device_number, s[i].ref_count, s[i].max_ref_count);
+
+    if ((d->device_number != s[i].info.device_number) ||
+        (s[i].info.type != type)) {
+      continue;
+    }
+    if (available && (s[i].ref_count >= s[i].max_ref_count)) {
+      continue;
+    }
+
+    rank = stream_rank(&s[i], source, flags);
+    if (rank > best_rank) {
+      best = &s[i];
+      best_rank = rank;
+    }
+  }
+
+  return best;
+}
+
+static const struct hw_stream *select_stream(struct config_mgr *cm,
+                                             const audio_devices_t devices,
+                                             int source, uint32_t flags,
+                                             const struct audio_config *config)
+{
+  struct stream *s = NULL;
+  const bool pcm = audio_is_linear_pcm(config->format);
+  enum stream_type type;
+  struct device *d = NULL;
+
+  ALOGV("+get_stream devices=0x%x source=%d flags=0x%x format=0x%x",
+      devices, source, flags, config->format);
+
+  if (devices & AUDIO_DEVICE_BIT_IN) {
+    type = pcm ? e_stream_in_pcm : e_stream_in_compress;
+  } else {
+    type = pcm ? e_stream_out_pcm : e_stream_out_compress;
+  }
+
+  /* A card probed at runtime takes precedence over the static config */
+  pthread_mutex_lock(&cm->lock);
+  s = find_dynamic_stream_l(cm, devices, type);
+  if ((s != NULL) && open_stream_l(cm, s)) {
+    pthread_mutex_unlock(&cm->lock);
+    ALOGV("-get_stream =%p (dynamic, refcount=%d)", &s->info, s->ref_count);
+    return &s->info;
+  }
+  pthread_mutex_unlock(&cm->lock);
+
+  d = hal_device_to_alsa(cm, devices);
+
+  if (!d) {
+    ALOGE("get_stream didn't find any device for %x", devices);
+    return NULL;
+  }
+
+  /* look for stream associated to the device found */
+  pthread_mutex_lock(&cm->lock);
+  s = find_stream_l(cm, d, type, source, flags, true);
+  if (s != NULL) {
+    open_stream_l(cm, s);
+  }
+  pthread_mutex_unlock(&cm->lock);
+
+  if (s != NULL) {
+    ALOGV("-get_stream =%p (refcount=%d)", &s->info, s->ref_count);
+    return &s->info;
+  }
+
+  ALOGE("-get_stream no suitable stream");
+  return NULL;
+}
+
+const struct hw_stream *get_stream(struct config_mgr *cm,
+                                   const audio_devices_t devices,
+                                   const audio_output_flags_t flags,
+                                   const struct audio_config *config)
+{
+  UNUSED(flags);
+  return select_stream(cm, devices, AUDIO_SOURCE_DEFAULT, 0, config);
+}
+
+const struct hw_stream *get_input_stream(struct config_mgr *cm,
+                                         const audio_devices_t devices,
+                                         audio_source_t source,
+                                         audio_input_flags_t flags,
+                                         const struct audio_config *config)
+{
+  return select_stream(cm, devices | AUDIO_DEVICE_BIT_IN, source, flags,
+                       config);
+}
+
+int peek_stream(struct config_mgr *cm,
+                const audio_devices_t devices,
+                audio_source_t source,
+                audio_input_flags_t flags,
+                const struct audio_config *config,
+                struct hw_stream *info)
+{
+  struct stream *s = NULL;
+  const bool pcm = audio_is_linear_pcm(config->format);
+  enum stream_type type;
+  struct device *d = NULL;
+  int ret = -ENOENT;
+
   if (devices & AUDIO_DEVICE_BIT_IN) {
     type = pcm ? e_stream_in_pcm : e_stream_in_compress;
   } else {
     type = pcm ? e_stream_out_pcm : e_stream_out_compress;
   }
 
-  /* look for stream associated to the device found */
-  pthread_mutex_lock(&cm->lock);
-  for (i = cm->stream_array.count - 1; i >= 0; --i) {
-    ALOGV("get_stream: require type=%d, device=%d; try type=%d device=%d"
-            " refcount=%d refmax=%d", type, d->device_number, s[i].info.type,
-            s[i].info.device_number, s[i].ref_count, s[i].max_ref_count);
+  d = hal_device_to_alsa(cm, devices);
 
-    if (d->device_number == s[i].info.device_number && s[i].info.type == type) {
-      if (open_stream_l(cm, &s[i])) {
-        break;
-      }
-    }
+  /* Same choice as get_stream() but ignoring how many users it has */
+  pthread_mutex_lock(&cm->lock);
+  s = find_dynamic_stream_l(cm, devices, type);
+  if ((s == NULL) && (d != NULL)) {
+    s = find_stream_l(cm, d, type, source, flags, false);
   }
-  pthread_mutex_unlock(&cm->lock);
 
-  if (i >= 0) {
-    ALOGV("-get_stream =%p (refcount=%d)", &s[i].info, s[i].ref_count);
-    return &s[i].info;
+  if (s != NULL) {
+    *info = s->info;
+    ret = 0;
   }
+  pthread_mutex_unlock(&cm->lock);
 
-  ALOGE("-get_stream no suitable stream");
-  return NULL;
+  ALOGV("peek_stream devices=0x%x: %d", devices, ret);
+  return ret;
 }
 
 const struct hw_stream *get_named_stream(struct config_mgr *cm,
@@ -830,6 +2318,19 @@ const struct hw_stream *get_named_stream(struct config_mgr *cm,
   }
 }
 
+const struct hw_stream *share_stream(const struct hw_stream *stream)
+{
+  struct stream *s = (struct stream *)stream;
+
+  pthread_mutex_lock(&s->cm->lock);
+  /* Not limited by max_ref_count, it is the same user of the hardware */
+  ++s->ref_count;
+  ALOGV("share_stream %p (refcount=%d)", stream, s->ref_count);
+  pthread_mutex_unlock(&s->cm->lock);
+
+  return stream;
+}
+
 bool is_named_stream_defined(struct config_mgr *cm, const char *name)
 {
   /* Streams can't be deleted so don't need to hold the lock during search */
@@ -846,16 +2347,209 @@ void release_stream( const struct hw_stream* stream )
   ALOGV("release_stream %p", stream );
 
   if (s) {
-    pthread_mutex_lock(&s->cm->lock);
+    struct config_mgr *cm = s->cm;
+
+    pthread_mutex_lock(&cm->lock);
     if (--s->ref_count == 0) {
+      /* A routing change still pending is moot */
+      s->route_deadline_ns = 0;
+
       /* Ensure all paths it was using are disabled */
-      apply_paths_to_devices_l(s->cm, s->current_devices,
+      apply_paths_to_devices_l(cm, s->current_devices,
                                e_path_id_off, s->disable_path);
-      apply_paths_to_global_l(s->cm, s->disable_path, e_path_id_off);
+      apply_paths_to_global_l(cm, s->disable_path, e_path_id_off);
       s->current_devices = 0;
+
+      if (s->removed) {
+        /* card was unplugged while the stream was open */
+        ALOGV("release_stream freeing removed stream %p", stream);
+        free(s);
+      }
+    }
+    pthread_mutex_unlock(&cm->lock);
+  }
+}
+
+/*********************************************************************
+ * Runtime streams for hotplugged cards
+ *********************************************************************/
+
+/* In order of preference */
+static const unsigned int dynamic_stream_rates[] = {
+  48000, 44100, 96000, 88200, 192000, 176400, 32000, 24000, 16000, 8000
+};
+
+/* In order of preference, highest resolution first */
+static const struct {
+  enum pcm_format pcm;
+  audio_format_t  audio;
+} dynamic_stream_formats[] = {
+  { PCM_FORMAT_S32_LE,  AUDIO_FORMAT_PCM_32_BIT },
+  { PCM_FORMAT_S24_3LE, AUDIO_FORMAT_PCM_24_BIT_PACKED },
+  { PCM_FORMAT_S24_LE,  AUDIO_FORMAT_PCM_8_24_BIT },
+  { PCM_FORMAT_S16_LE,  AUDIO_FORMAT_PCM_16_BIT }
+};
+
+static unsigned int clamp_param(struct pcm_params *params,
+                                enum pcm_param param, unsigned int val)
+{
+  const unsigned int min = pcm_params_get_min(params, param);
+  const unsigned int max = pcm_params_get_max(params, param);
+
+  if ((min != 0) && (val < min)) {
+    return min;
+  }
+  if ((max != 0) && (val > max)) {
+    return max;
+  }
+  return val;
+}
+
+static int probe_dynamic_stream(struct stream *s, unsigned int card,
+                                unsigned int device, bool out)
+{
+  struct pcm_params *params = NULL;
+  unsigned int min = 0;
+  unsigned int max = 0;
+  size_t i = 0;
+
+  params = pcm_params_get(card, device, out ? PCM_OUT : PCM_IN);
+  if (params == NULL) {
+    ALOGE("Failed to get params of card %u device %u", card, device);
+    return -ENODEV;
+  }
+
+  min = pcm_params_get_min(params, PCM_PARAM_RATE);
+  max = pcm_params_get_max(params, PCM_PARAM_RATE);
+  for (i = 0; i < ARRAY_SIZE(dynamic_stream_rates); ++i) {
+    if ((dynamic_stream_rates[i] >= min) && (dynamic_stream_rates[i] <= max)) {
+      s->info.rate = dynamic_stream_rates[i];
+      break;
+    }
+  }
+
+  for (i = 0; i < ARRAY_SIZE(dynamic_stream_formats); ++i) {
+    if (pcm_params_format_test(params, dynamic_stream_formats[i].pcm)) {
+      s->info.format = dynamic_stream_formats[i].audio;
+      break;
+    }
+  }
+
+  /* Prefer stereo, otherwise the nearest supported channel count */
+  s->info.channels = clamp_param(params, PCM_PARAM_CHANNELS, 2);
+
+  if ((s->info.rate == 0) || (s->info.format == AUDIO_FORMAT_DEFAULT)) {
+    ALOGE("No usable rate/format on card %u device %u (rate %u-%u)",
+              card, device, min, max);
+    pcm_params_free(params);
+    return -ENODEV;
+  }
+
+  s->info.period_size = clamp_param(params, PCM_PARAM_PERIOD_SIZE,
+                          (s->info.rate * DYNAMIC_STREAM_PERIOD_MS) / 1000);
+  s->info.period_count = clamp_param(params, PCM_PARAM_PERIODS,
+                                     DYNAMIC_STREAM_PERIOD_COUNT);
+
+  pcm_params_free(params);
+  return 0;
+}
+
+int add_dynamic_stream(struct config_mgr *cm, audio_devices_t devices,
+                       unsigned int card, unsigned int device)
+{
+  const bool out = ((devices & AUDIO_DEVICE_BIT_IN) == 0);
+  struct stream *s = NULL;
+  int slot = -1;
+  int ret = 0;
+
+  ALOGV("+add_dynamic_stream devices=0x%x card=%u device=%u",
+            devices, card, device);
+
+  pthread_mutex_lock(&cm->lock);
+  for (int i = 0; i < MAX_DYNAMIC_STREAMS; ++i) {
+    s = cm->dynamic_streams[i];
+    if (s == NULL) {
+      if (slot < 0) {
+        slot = i;
+      }
+    } else if (!s->removed && (s->info.card_number == card)
+               && (s->info.device_number == device)
+               && (stream_is_input(&s->info) == !out)) {
+      ALOGW("Card %u device %u already added", card, device);
+      pthread_mutex_unlock(&cm->lock);
+      return -EEXIST;
+    }
+  }
+  pthread_mutex_unlock(&cm->lock);
+
+  if (slot < 0) {
+    ALOGE("Too many dynamic streams");
+    return -ENOMEM;
+  }
+
+  s = calloc(1, sizeof(struct stream));
+  if (s == NULL) {
+    return -ENOMEM;
+  }
+
+  /* Probing opens the pcm node so is done without holding the lock */
+  ret = probe_dynamic_stream(s, card, device, out);
+  if (ret < 0) {
+    free(s);
+    return ret;
+  }
+
+  s->info.type = out ? e_stream_out_pcm : e_stream_in_pcm;
+  s->info.card_number = card;
+  s->info.device_number = device;
+  s->usecase_array.elem_size = sizeof(struct usecase);
+  s->cm = cm;
+  s->enable_path = -1;
+  s->disable_path = -1;
+  s->max_ref_count = 1;   /* a card pcm can only be opened once */
+  s->dynamic_devices = devices;
+
+  pthread_mutex_lock(&cm->lock);
+  if (cm->dynamic_streams[slot] != NULL) {
+    /* raced with another add, not expected from AudioPolicy */
+    pthread_mutex_unlock(&cm->lock);
+    free(s);
+    return -EBUSY;
+  }
+  cm->dynamic_streams[slot] = s;
+  pthread_mutex_unlock(&cm->lock);
+
+  ALOGV("-add_dynamic_stream %p rate=%u format=0x%x channels=%u"
+        " period_size=%u period_count=%u", s, s->info.rate, s->info.format,
+        s->info.channels, s->info.period_size, s->info.period_count);
+  return 0;
+}
+
+void remove_dynamic_streams(struct config_mgr *cm, audio_devices_t devices,
+                            unsigned int card)
+{
+  const uint32_t input_flag = devices & AUDIO_DEVICE_BIT_IN;
+  struct stream *s = NULL;
+
+  ALOGV("remove_dynamic_streams devices=0x%x card=%u", devices, card);
+
+  pthread_mutex_lock(&cm->lock);
+  for (int i = 0; i < MAX_DYNAMIC_STREAMS; ++i) {
+    s = cm->dynamic_streams[i];
+    if ((s == NULL) || (s->info.card_number != card)
+        || ((s->dynamic_devices & AUDIO_DEVICE_BIT_IN) != input_flag)) {
+      continue;
+    }
+
+    cm->dynamic_streams[i] = NULL;
+    if (s->ref_count > 0) {
+      /* still open, it will be freed when it is released */
+      s->removed = true;
+    } else {
+      free(s);
     }
-    pthread_mutex_unlock(&s->cm->lock);
   }
+  pthread_mutex_unlock(&cm->lock);
 }
 
 uint32_t get_supported_output_devices( struct config_mgr *cm )
@@ -936,6 +2630,7 @@ static int parse_enable_start(struct parse_state *state);
 static int parse_disable_start(struct parse_state *state);
 static int parse_ctl_start(struct parse_state *state);
 static int parse_init_start(struct parse_state *state);
+static int parse_jack_start(struct parse_state *state);
 
 static const struct parse_element elem_table[e_elem_count] = {
   [e_elem_ctl] =    {
@@ -960,7 +2655,8 @@ static const struct parse_element elem_table[e_elem_count] = {
   [e_elem_device] =    {
     .name = "device",
     .valid_attribs = BIT(e_attrib_name) | BIT(e_attrib_device) |
-                     BIT(e_attrib_default),
+                     BIT(e_attrib_default) | BIT(e_attrib_idle_delay) |
+                     BIT(e_attrib_idle_delay_max),
     .required_attribs = BIT(e_attrib_name),
     .valid_subelem = BIT(e_elem_path),
     .start_fn = parse_device_start,
@@ -973,7 +2669,9 @@ static const struct parse_element elem_table[e_elem_count] = {
       | BIT(e_attrib_dir) | BIT(e_attrib_card)
       | BIT(e_attrib_device) | BIT(e_attrib_instances)
       | BIT(e_attrib_rate) | BIT(e_attrib_period_size)
-      | BIT(e_attrib_period_count),
+      | BIT(e_attrib_period_count) | BIT(e_attrib_route_debounce)
+      | BIT(e_attrib_keep_alive) | BIT(e_attrib_source)
+      | BIT(e_attrib_flags),
     .required_attribs = BIT(e_attrib_type),
     .valid_subelem = BIT(e_elem_stream_ctl)
       | BIT(e_elem_enable) | BIT(e_elem_disable)
@@ -1038,9 +2736,20 @@ static const struct parse_element elem_table[e_elem_count] = {
     .end_fn = NULL
   },
 
+  [e_elem_jack] =     {
+    .name = "jack",
+    .valid_attribs = BIT(e_attrib_name) | BIT(e_attrib_device) |
+                     BIT(e_attrib_removed) | BIT(e_attrib_inserted) |
+                     BIT(e_attrib_fallback),
+    .required_attribs = BIT(e_attrib_name) | BIT(e_attrib_device),
+    .valid_subelem = 0,
+    .start_fn = parse_jack_start,
+    .end_fn = NULL
+  },
+
   [e_elem_mixer] =    {
     .name = "mixer",
-    .valid_attribs = BIT(e_attrib_card),
+    .valid_attribs = BIT(e_attrib_card) | BIT(e_attrib_snapshot),
     .required_attribs = 0,
     .valid_subelem = BIT(e_elem_init),
     .start_fn = parse_mixer_start,
@@ -1073,7 +2782,17 @@ static const struct parse_attrib attrib_table[e_attrib_count] = {
   [e_attrib_period_count] = {"period_count"},
   [e_attrib_min] = {"min"},
   [e_attrib_max] = {"max"},
-  [e_attrib_default] = {"default"}
+  [e_attrib_default] = {"default"},
+  [e_attrib_idle_delay] = {"idle_delay"},
+  [e_attrib_idle_delay_max] = {"idle_delay_max"},
+  [e_attrib_removed] =    {"removed"},
+  [e_attrib_inserted] =   {"inserted"},
+  [e_attrib_fallback] =   {"fallback"},
+  [e_attrib_snapshot] =   {"snapshot"},
+  [e_attrib_keep_alive] = {"keep_alive"},
+  [e_attrib_source] =     {"source"},
+  [e_attrib_flags] =      {"flags"},
+  [e_attrib_route_debounce] = {"route_debounce"}
 };
 
 static const struct parse_device device_table[] = {
@@ -1095,6 +2814,26 @@ static const struct parse_device device_table[] = {
   {"spdif",       AUDIO_DEVICE_OUT_SPDIF}
 };
 
+static const struct parse_flag source_table[] = {
+  {"mic",                 BIT(AUDIO_SOURCE_MIC)},
+  {"voice_uplink",        BIT(AUDIO_SOURCE_VOICE_UPLINK)},
+  {"voice_downlink",      BIT(AUDIO_SOURCE_VOICE_DOWNLINK)},
+  {"voice_call",          BIT(AUDIO_SOURCE_VOICE_CALL)},
+  {"camcorder",           BIT(AUDIO_SOURCE_CAMCORDER)},
+  {"voice_recognition",   BIT(AUDIO_SOURCE_VOICE_RECOGNITION)},
+  {"voice_communication", BIT(AUDIO_SOURCE_VOICE_COMMUNICATION)},
+  {"remote_submix",       BIT(AUDIO_SOURCE_REMOTE_SUBMIX)},
+  {"unprocessed",         BIT(AUDIO_SOURCE_UNPROCESSED)},
+  {"voice_performance",   BIT(AUDIO_SOURCE_VOICE_PERFORMANCE)}
+};
+
+static const struct parse_flag input_flag_table[] = {
+  {"fast",        AUDIO_INPUT_FLAG_FAST},
+  {"raw",         AUDIO_INPUT_FLAG_RAW},
+  {"mmap_noirq",  AUDIO_INPUT_FLAG_MMAP_NOIRQ},
+  {"voip_tx",     AUDIO_INPUT_FLAG_VOIP_TX}
+};
+
 static const char *predefined_path_name_table[] = {
   [e_path_id_off] = "off",
   [e_path_id_on] = "on"
@@ -1228,6 +2967,21 @@ static struct usecase* new_usecase(struct dyn_array *array, const char *name)
   return puc;
 }
 
+static struct jack* new_jack(struct dyn_array *array, const char *name)
+{
+  struct jack *j = NULL;
+
+  if (dyn_array_extend(array) < 0) {
+    return NULL;
+  }
+
+  j = &array->jacks[array->count - 1];
+  j->name = name;
+  j->removed_path = -1;
+  j->inserted_path = -1;
+  return j;
+}
+
 static void compress_usecase(struct usecase *puc)
 {
   dyn_array_fix(&puc->case_array);
@@ -1298,6 +3052,8 @@ static struct config_mgr* new_config_mgr()
   }
   mgr->device_array.elem_size = sizeof(struct device);
   mgr->stream_array.elem_size = sizeof(struct stream);
+  mgr->jack_array.elem_size = sizeof(struct jack);
+  mgr->snapshot.shadow_array.elem_size = sizeof(struct shadow_ctl);
   pthread_mutex_init(&mgr->lock, NULL);
   return mgr;
 }
@@ -1306,6 +3062,7 @@ static void compress_config_mgr(struct config_mgr *mgr)
 {
   dyn_array_fix(&mgr->device_array);
   dyn_array_fix(&mgr->stream_array);
+  dyn_array_fix(&mgr->jack_array);
 }
 
 static int find_path_name(struct parse_state *state, const char *name)
@@ -1382,6 +3139,47 @@ static int attrib_to_uint(uint32_t *result, struct parse_state *state,
   return string_to_uint(result, str);
 }
 
+/* Parses a comma-separated list of names from table into a mask */
+static int attrib_to_flags(uint32_t *result, struct parse_state *state,
+                           enum attrib_index index,
+                           const struct parse_flag *table, size_t count)
+{
+  const char *str = state->attribs.value[index];
+  char *list = NULL;
+  char *token = NULL;
+  char *save = NULL;
+  size_t i = 0;
+  int ret = 0;
+
+  if (!str) {
+    return -ENOENT;
+  }
+
+  list = strdup(str);
+  if (!list) {
+    return -ENOMEM;
+  }
+
+  *result = 0;
+  for (token = strtok_r(list, ", ", &save); token != NULL;
+       token = strtok_r(NULL, ", ", &save)) {
+    for (i = 0; i < count; ++i) {
+      if (strcmp(token, table[i].name) == 0) {
+        *result |= table[i].value;
+        break;
+      }
+    }
+    if (i == count) {
+      ALOGE("'%s' is not a valid %s", token, attrib_table[index].name);
+      ret = -EINVAL;
+      break;
+    }
+  }
+
+  free(list);
+  return ret;
+}
+
 static int make_byte_array(struct ctl *c, struct mixer_ctl *ctl)
 {
   const char *val_str = c->value.string;
@@ -1683,10 +3481,33 @@ static int parse_disable_start(struct parse_state *state)
   return parse_enable_disable_start(state, false);
 }
 
+static struct mixer_ctl *find_ctl_instance(struct mixer *mixer,
+                                           const char *name,
+                                           unsigned int instance)
+{
+  const unsigned int count = mixer_get_num_ctls(mixer);
+  struct mixer_ctl *ctl = NULL;
+  const char *ctl_name = NULL;
+  unsigned int i = 0;
+
+  for (i = 0; i < count; ++i) {
+    ctl = mixer_get_ctl(mixer, i);
+    ctl_name = (ctl != NULL) ? mixer_ctl_get_name(ctl) : NULL;
+    if ((ctl_name != NULL) && (0 == strcmp(ctl_name, name))) {
+      if (instance-- == 0) {
+        return ctl;
+      }
+    }
+  }
+
+  return NULL;
+}
+
 static int parse_stream_ctl_start(struct parse_state *state)
 {
   /* Parse a <ctl> element within a stream which defines
-   * mixer controls - currently only supports volume controls
+   * mixer controls - volume controls, and the ELD and channel map
+   * controls of an HDMI stream
    */
   const char *name = state->attribs.value[e_attrib_name];
   const char *function = state->attribs.value[e_attrib_function];
@@ -1701,18 +3522,59 @@ static int parse_stream_ctl_start(struct parse_state *state)
     return 0;
   }
 
-  ctl = mixer_get_ctl_by_name(state->cm->mixer, name);
-  if (!ctl) {
-    ALOGE("Control '%s' not found", name);
-    return -EINVAL;
-  }
-
   if (index != NULL) {
     if (attrib_to_uint(&idx_val, state, e_attrib_index) == -EINVAL) {
       return -EINVAL;
     }
   }
 
+  if ((0 == strcmp(function, "eld")) || (0 == strcmp(function, "chmap"))) {
+    /* There is one of these per PCM, all with the same name, so the
+     * index selects which of the controls belongs to this stream
+     */
+    ctl = find_ctl_instance(state->cm->mixer, name, idx_val);
+    if (!ctl) {
+      ALOGE("Control '%s' #%u not found", name, idx_val);
+      return -EINVAL;
+    }
+
+    if (function[0] == 'e') {
+      streamctl = &(state->current.stream->controls.eld);
+    } else {
+      streamctl = &(state->current.stream->controls.chmap);
+    }
+    ALOGE_IF(streamctl->handle != NULL, "'%s' control specified again",
+                function);
+    streamctl->handle = ctl;
+    streamctl->index = idx_val;
+    return 0;
+  }
+
+  if (0 == strcmp(function, "trigger")) {
+    /* Only checked here, it is watched on the event mixer */
+    if (!find_ctl_instance(state->cm->mixer, name, idx_val)) {
+      ALOGE("Control '%s' #%u not found", name, idx_val);
+      return -EINVAL;
+    }
+
+    ALOGE_IF(state->current.stream->trigger.name != NULL,
+                "'%s' control specified again", function);
+    free((void *)state->current.stream->trigger.name);
+    state->current.stream->trigger.name = strdup(name);
+    if (!state->current.stream->trigger.name) {
+      return -ENOMEM;
+    }
+    state->current.stream->trigger.index = idx_val;
+    state->cm->events.wanted = true;
+    return 0;
+  }
+
+  ctl = mixer_get_ctl_by_name(state->cm->mixer, name);
+  if (!ctl) {
+    ALOGE("Control '%s' not found", name);
+    return -EINVAL;
+  }
+
   if (0 == strcmp(function, "leftvol")) {
     ALOGE_IF(state->current.stream->controls.volume_left.handle != NULL,
                 "Left volume control specified again");
@@ -1875,15 +3737,46 @@ static int parse_stream_start(struct parse_state *state)
     return -EINVAL;
   }
 
+  if (attrib_to_uint(&s->route_debounce_ms, state,
+        e_attrib_route_debounce) == -EINVAL) {
+    return -EINVAL;
+  }
+  if (s->route_debounce_ms != 0) {
+    state->cm->worker.wanted = true;
+  }
+
+  if (attrib_to_uint(&s->info.keep_alive_ms, state,
+        e_attrib_keep_alive) == -EINVAL) {
+    return -EINVAL;
+  }
+  if ((s->info.keep_alive_ms != 0) && (s->info.type != e_stream_out_pcm)) {
+    ALOGE("keep_alive is only valid on PCM output streams");
+    return -EINVAL;
+  }
+
+  if ((attrib_to_flags(&s->sources, state, e_attrib_source, source_table,
+                       ARRAY_SIZE(source_table)) == -EINVAL) ||
+      (attrib_to_flags(&s->input_flags, state, e_attrib_flags,
+                       input_flag_table,
+                       ARRAY_SIZE(input_flag_table)) == -EINVAL)) {
+    return -EINVAL;
+  }
+  if (((s->sources != 0) || (s->input_flags != 0)) &&
+      ((name != NULL) || !stream_is_input(&s->info))) {
+    ALOGE("source and flags are only valid on anonymous input streams");
+    return -EINVAL;
+  }
+
   s->name = name;
   s->info.card_number = card;
   s->info.device_number = device;
   s->max_ref_count = maxref;
 
-  ALOGV("Added stream %s type=%u card=%u device=%u max_ref=%u",
+  ALOGV("Added stream %s type=%u card=%u device=%u max_ref=%u"
+            " sources=0x%x flags=0x%x",
             s->name ? s->name : "",
             s->info.type, s->info.card_number, s->info.device_number,
-            s->max_ref_count );
+            s->max_ref_count, s->sources, s->input_flags );
 
   state->current.stream = s;
 
@@ -1949,6 +3842,27 @@ static int parse_device_start(struct parse_state *state)
     device_flag |= AUDIO_DEVICE_BIT_DEFAULT;
   }
 
+  if ((state->attribs.value[e_attrib_idle_delay] != NULL) ||
+      (state->attribs.value[e_attrib_idle_delay_max] != NULL)) {
+    if (device_flag != 0) {
+      ALOGE("Idle delay is only valid on the global device");
+      return -EINVAL;
+    }
+
+    if ((attrib_to_uint(&state->cm->idle.base_delay_ms, state,
+                        e_attrib_idle_delay) == -EINVAL) ||
+        (attrib_to_uint(&state->cm->idle.max_delay_ms, state,
+                        e_attrib_idle_delay_max) == -EINVAL)) {
+      return -EINVAL;
+    }
+
+    if (state->cm->idle.max_delay_ms < state->cm->idle.base_delay_ms) {
+      state->cm->idle.max_delay_ms = state->cm->idle.base_delay_ms;
+    }
+    state->cm->idle.delay_ms = state->cm->idle.base_delay_ms;
+    state->cm->worker.wanted |= (state->cm->idle.base_delay_ms != 0);
+  }
+
   ALOGV("Add device '%s' = %x (%x)", dev_name, alsa_device, device_flag);
 
   d = new_device(array, device_flag, alsa_device);
@@ -1967,6 +3881,76 @@ static int parse_device_end(struct parse_state *state)
   return 0;
 }
 
+static int parse_jack_path(struct parse_state *state, int *id,
+                           enum attrib_index attrib)
+{
+  const char *name = state->attribs.value[attrib];
+
+  if (name == NULL) {
+    return 0;
+  }
+
+  *id = add_path_name(state, name);
+  if (*id < 0) {
+    return *id;
+  }
+
+  if (*id < e_path_id_custom_base) {
+    /* the on and off paths are reference-counted by the streams */
+    ALOGE("Jack cannot use path '%s'", name);
+    return -EINVAL;
+  }
+  return 0;
+}
+
+static int parse_jack_start(struct parse_state *state)
+{
+  const char *dev_name = state->attribs.value[e_attrib_device];
+  const char *fallback = state->attribs.value[e_attrib_fallback];
+  const char *name = NULL;
+  const struct parse_device *p = NULL;
+  struct jack *j = NULL;
+  int ret = 0;
+
+  p = parse_match_device(dev_name);
+  if ((p == NULL) || (p->device == 0)) {
+    ALOGE("'%s' is not a valid jack device", dev_name);
+    return -EINVAL;
+  }
+
+  name = strdup(state->attribs.value[e_attrib_name]);
+  if (!name) {
+    return -ENOMEM;
+  }
+
+  j = new_jack(&state->cm->jack_array, name);
+  if (j == NULL) {
+    free((void *)name);
+    return -ENOMEM;
+  }
+  j->device = p->device;
+  state->cm->events.wanted = true;
+
+  if (fallback != NULL) {
+    p = parse_match_device(fallback);
+    if ((p == NULL) || (p->device == 0) ||
+        !BIT_EQUAL(AUDIO_DEVICE_BIT_IN, p->device, j->device)) {
+      ALOGE("'%s' is not a valid fallback for jack '%s'", fallback, name);
+      return -EINVAL;
+    }
+    j->fallback = p->device;
+  }
+
+  ret = parse_jack_path(state, &j->removed_path, e_attrib_removed);
+  if (ret == 0) {
+    ret = parse_jack_path(state, &j->inserted_path, e_attrib_inserted);
+  }
+
+  ALOGV("Added jack '%s' device=0x%x fallback=0x%x", name, j->device,
+        j->fallback);
+  return ret;
+}
+
 static int parse_mixer_start(struct parse_state *state)
 {
   uint32_t card = MIXER_CARD_DEFAULT;
@@ -1992,11 +3976,21 @@ static int parse_mixer_start(struct parse_state *state)
       ALOGE("Failed to open mixer card %u", card);
       return -EINVAL;
     }
+
+    if (state->attribs.value[e_attrib_snapshot] != NULL) {
+      state->cm->snapshot.path = strdup(state->attribs.value[e_attrib_snapshot]);
+      if (!state->cm->snapshot.path) {
+        return -ENOMEM;
+      }
+      state->cm->worker.wanted = true;
+      load_snapshot(state->cm);
+    }
   }
 
   /* Now we can allow all other root elements but not another <mixer> */
   state->stack.entry[state->stack.index - 1].valid_subelem = BIT(e_elem_device)
-                                                           | BIT(e_elem_stream);
+                                                           | BIT(e_elem_stream)
+                                                           | BIT(e_elem_jack);
   return 0;
 }
 
@@ -2309,6 +4303,16 @@ struct config_mgr *init_audio_config()
 
   pthread_mutex_init(&mgr->lock, (const pthread_mutexattr_t *) NULL);
 
+  if (mgr->worker.wanted) {
+    pthread_mutex_lock(&mgr->lock);
+    start_worker_l(mgr);
+    pthread_mutex_unlock(&mgr->lock);
+  }
+
+  if (mgr->events.wanted && (mgr->mixer != NULL)) {
+    start_events(mgr);
+  }
+
   return mgr;
 }
 
@@ -2334,6 +4338,9 @@ void free_audio_config(struct config_mgr *cm)
   struct ctl *c = NULL;
 
   if (cm) {
+    stop_events(cm);
+    stop_worker(cm);
+
     /* Free all devices */
     for (dev_idx = cm->device_array.count - 1; dev_idx >= 0; --dev_idx) {
       /* Free all paths in device */
@@ -2381,9 +4388,22 @@ void free_audio_config(struct config_mgr *cm)
 
     for(stream_idx = stream_array->count - 1; stream_idx >= 0; --stream_idx) {
       free_usecases(&stream_array->streams[stream_idx]);
+      free((void *)stream_array->streams[stream_idx].trigger.name);
     }
     dyn_array_free(&cm->stream_array);
 
+    for (unsigned int i = 0; i < cm->jack_array.count; ++i) {
+      free((void *)cm->jack_array.jacks[i].name);
+    }
+    dyn_array_free(&cm->jack_array);
+
+    shadows_free(&cm->snapshot.shadow_array);
+    free((void *)cm->snapshot.path);
+
+    for (int i = 0; i < MAX_DYNAMIC_STREAMS; ++i) {
+      free(cm->dynamic_streams[i]);
+    }
+
     if (cm->mixer) {
       mixer_close(cm->mixer);
     }
@@ -49,6 +49,9 @@ struct hw_stream {
     unsigned int        rate;
     unsigned int        period_size;
     unsigned int        period_count;
+    unsigned int        channels;   /* 0 unless probed from hardware */
+    audio_format_t      format;     /* AUDIO_FORMAT_DEFAULT unless probed */
+    unsigned int        keep_alive_ms;  /* 0 lets a stalled client underrun */
 };
 
 /** Test whether a stream is an input */
@@ -110,6 +113,33 @@ struct config_mgr *init_audio_config();
 /** Delete audio config layer */
 void free_audio_config( struct config_mgr *cm );
 
+/** Write the state of the config layer to fd */
+void dump_audio_config( struct config_mgr *cm, int fd );
+
+/** Events reported by the config layer */
+enum config_event {
+  e_config_event_jack_inserted,   /* arg is the device of the jack */
+  e_config_event_jack_removed,
+  e_config_event_trigger,         /* arg is the new value of the control */
+};
+
+/** Receives config events, called from the event thread without any
+ * config lock held. timestamp_ns is CLOCK_MONOTONIC at event reception
+ */
+typedef void (*config_event_fn)(void *cookie, enum config_event event,
+                                uint32_t arg, int64_t timestamp_ns);
+
+/** Register the receiver of config events, NULL to stop them */
+void set_config_event_callback( struct config_mgr *cm,
+                                config_event_fn callback, void *cookie );
+
+/** Get the devices of all jacks that are currently inserted
+ *
+ * Streams on a jack that is removed have already been moved to its
+ * fallback devices when the event is reported
+ */
+uint32_t get_jack_devices( struct config_mgr *cm, bool input );
+
 /** Get list of all supported devices */
 uint32_t get_supported_devices( struct config_mgr *cm );
 
@@ -119,13 +149,55 @@ const struct hw_stream *get_stream(  struct config_mgr *cm,
                                         const audio_output_flags_t flags,
                                         const struct audio_config *config );
 
+/** Find the input stream declared for an audio source and input flags,
+ * or else a generic input stream, and return a pointer to it
+ */
+const struct hw_stream *get_input_stream( struct config_mgr *cm,
+                                          const audio_devices_t devices,
+                                          audio_source_t source,
+                                          audio_input_flags_t flags,
+                                          const struct audio_config *config );
+
+/** Copy the stream that get_input_stream() would choose, without opening
+ * it. Used to size buffers before the stream is opened. For an output
+ * pass AUDIO_SOURCE_DEFAULT and no flags
+ *
+ * @return      0 on success
+ * @return      -ENOENT if no stream matches
+ */
+int peek_stream( struct config_mgr *cm,
+                 const audio_devices_t devices,
+                 audio_source_t source,
+                 audio_input_flags_t flags,
+                 const struct audio_config *config,
+                 struct hw_stream *info );
+
 /** Find a named custom stream and return a pointer to it */
 const struct hw_stream *get_named_stream(struct config_mgr *cm,
                                    const char *name);
 
+/** Take another reference to an open stream so that a new user can
+ * take over its hardware as it is, without applying any paths.
+ * Release it with release_stream()
+ */
+const struct hw_stream *share_stream( const struct hw_stream *stream );
+
 /** Test whether a named custom stream is defined */
 bool is_named_stream_defined(struct config_mgr *cm, const char *name);
 
+/** Synthesize a stream for a hotplugged card from its capabilities
+ *
+ * @return      0 on success
+ * @return      -EEXIST if a stream already exists for this card device
+ * @return      -ENODEV if the card device could not be probed
+ */
+int add_dynamic_stream(struct config_mgr *cm, audio_devices_t devices,
+                       unsigned int card, unsigned int device);
+
+/** Remove the streams synthesized for a card */
+void remove_dynamic_streams(struct config_mgr *cm, audio_devices_t devices,
+                            unsigned int card);
+
 /** Release stream */
 void release_stream( const struct hw_stream *stream );
 
@@ -135,12 +207,53 @@ uint32_t get_current_routes( const struct hw_stream *stream );
 /** Apply new device routing to a stream */
 void apply_route( const struct hw_stream *stream, uint32_t devices );
 
-/** Get bitmask of devices currently connected to this stream */
+/** Get bitmask of devices currently connected to this stream
+ *
+ * While a debounced routing change is pending this is still the
+ * previous route
+ */
 uint32_t get_routed_devices( const struct hw_stream *stream );
 
+/** Apply new device routing to a stream from the config worker after
+ * delay_us, or after the route_debounce of the stream if that is longer.
+ * If a change is already pending only its devices are updated
+ */
+void schedule_route( const struct hw_stream *stream, uint32_t devices,
+                     uint32_t delay_us );
+
+/** Test whether a debounced or scheduled routing change is still pending */
+bool is_route_pending( const struct hw_stream *stream );
+
+/** Apply a pending routing change now */
+void settle_route( const struct hw_stream *stream );
+
 /** Apply hardware volume */
 int set_hw_volume( const struct hw_stream *stream, int left_pc, int right_pc);
 
+/** Read the ELD of the sink connected to a stream
+ *
+ * @return      number of bytes read
+ * @return      -ENOSYS if the stream has no ELD control
+ * @return      -ENODEV if no sink is connected
+ */
+int get_hw_eld( const struct hw_stream *stream, uint8_t *eld, size_t size );
+
+/** Set the channel map of a stream to a list of SNDRV_CHMAP_* positions
+ *
+ * @return      0 on success
+ * @return      -ENOSYS if the stream has no channel map control
+ */
+int set_hw_channel_map( const struct hw_stream *stream,
+                        const unsigned int *map, unsigned int count );
+
+/** Read the channel map of a running stream
+ *
+ * @return      number of positions read
+ * @return      -ENOSYS if the stream has no channel map control
+ */
+int get_hw_channel_map( const struct hw_stream *stream,
+                        unsigned int *map, unsigned int count );
+
 /** Apply a custom use-case
  *
  * @return      0 on success
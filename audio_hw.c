@@ -22,13 +22,19 @@
 // #define TEST_32BITS 0
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <math.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
 #include <sys/time.h>
+#include <unistd.h>
 
+#include <audio_utils/format.h>
 #include <audio_utils/resampler.h>
 #include <cutils/properties.h>
 #include <cutils/str_parms.h>
@@ -37,12 +43,17 @@
 #include <hardware/hardware.h>
 #include <log/log.h>
 #include <sound/compress_params.h>
+#include <sound/asound.h>
 #include <sound/compress_offload.h>
 #include <system/audio.h>
 #include <tinyalsa/asoundlib.h>
 #include <tinycompress/tinycompress.h>
 #include <utils/Timers.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 #include "audio_config.h"
 
 /* These values are defined in _frames_ (not bytes) to match the ALSA API */
@@ -59,16 +70,139 @@
 #define IN_CHANNEL_COUNT_DEFAULT 1
 #define IN_SAMPLE_RATE_DEFAULT 48000
 
+/* Capture rates that are an integer ratio up to this apart are converted
+ * with a polyphase FIR instead of the general resampler. The filter has
+ * IN_FIR_TAPS_PER_PHASE taps for each phase of the ratio and passes up to
+ * IN_FIR_PASSBAND of the Nyquist frequency of the lower rate
+ */
+#define IN_FIR_MAX_RATIO 6
+#define IN_FIR_TAPS_PER_PHASE 32
+#define IN_FIR_TAPS_PER_PHASE_REDUCED 24
+#define IN_FIR_TAPS_PER_PHASE_MINIMUM 16
+#define IN_FIR_PASSBAND 0.9
+
+/* The DSP quality governor measures the CPU time the audio threads spend
+ * in the HAL over windows of GOVERNOR_WINDOW_MS, collected from each
+ * stream by a thread of its own. Above GOVERNOR_HIGH_PCT of a core for
+ * GOVERNOR_DOWN_WINDOWS in a row it steps the quality down, below
+ * GOVERNOR_LOW_PCT for GOVERNOR_UP_WINDOWS in a row back up
+ */
+#define GOVERNOR_WINDOW_MS 500
+#define GOVERNOR_HIGH_PCT 50
+#define GOVERNOR_LOW_PCT 25
+#define GOVERNOR_DOWN_WINDOWS 2
+#define GOVERNOR_UP_WINDOWS 10
+
+/* Demo gain of the built-in microphone, as a 16-bit left shift */
+#define IN_BUILTIN_MIC_GAIN_SHIFT 6
+
 /* AudioFlinger does not re-read the buffer size after
  * issuing a routing or input_source change so the
- * default buffer size must be suitable for both PCM
- * and compressed inputs
+ * input buffer size is taken from the stream the config
+ * will most likely use. This is the size if there is none
  */
 #define IN_COMPRESS_BUFFER_SIZE_DEFAULT 1024
 
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#endif
+
+/* IEC 61937 bursts. The repetition period is in frames of the IEC link */
+#define IEC61937_PREAMBLE_WORDS     4
+#define IEC61937_PA                 0xF872
+#define IEC61937_PB                 0x4E1F
+#define IEC61937_TYPE_AC3           0x01
+#define IEC61937_TYPE_DTS1          0x0B
+#define IEC61937_TYPE_DTS2          0x0C
+#define IEC61937_TYPE_DTS3          0x0D
+#define IEC61937_TYPE_EAC3          0x15
+#define IEC61937_AC3_PERIOD         1536
+#define IEC61937_EAC3_PERIOD        6144
+#define IEC61937_DTS_MAX_PERIOD     2048
+#define IEC61937_EAC3_BURST_SAMPLES 1536
+#define IEC61937_MAX_FRAME_SIZE     16384
+
+/* Length of the fades around a routing change of a running stream */
+#define OUT_ROUTE_FADE_MS           5
+
+/* HDMI LPCM carries at most 8 channels */
+#define HDMI_MAX_CHANNELS           8
+#define HDMI_ELD_MAX_SIZE           128
+#define HDMI_MAX_LAYOUTS            4
+/* Largest block of whole frames reordered by one NEON table lookup */
+#define CHMAP_MAX_BLOCK             48
+
 /* Maximum time we'll wait for data from a compress_pcm input */
 #define MAX_COMPRESS_PCM_TIMEOUT_MS     2100
 
+/* Queue depth of an output stream in low latency mode, in periods */
+#define OUT_LOW_LATENCY_PERIODS     2
+
+/* Shortest interval at which the keep-alive thread checks the buffer */
+#define OUT_KEEP_ALIVE_MIN_POLL_MS  1
+
+/* Stream key selecting the latency mode, "low" or "power" */
+#define AUDIO_PARAMETER_STREAM_LATENCY_MODE "latency_mode"
+
+/* Longest wait for room in the DMA buffer of a mmap output */
+#define OUT_MMAP_WAIT_MS 1000
+
+/* Usecase of a stream switched to the profile of its tracks */
+#define STREAM_PROFILE_USECASE              "profile"
+
+/* Stream key enabling PCM dump taps, a '|' separated list of
+ * "client", "resampled" and "hw", or "off"
+ */
+#define AUDIO_PARAMETER_STREAM_DUMP_TAPS    "dump_taps"
+
+/* Dump taps are written to files in this directory by a background
+ * thread, which empties each tap ring every DUMP_TAP_PERIOD_MS
+ */
+#define DUMP_TAP_DIR                "/data/vendor/audiohal"
+#define DUMP_TAP_RING_SIZE          (1024 * 1024)   /* power of 2 */
+#define DUMP_TAP_PERIOD_MS          50
+#define DUMP_TAP_NICE               10  /* ANDROID_PRIORITY_BACKGROUND */
+
+/* Number of DSP worker threads helping the audio thread of a stream with
+ * the passes of a period, "auto" for one per additional core. A pass is
+ * shared when the measured cost of a chunk outweighs the measured time a
+ * worker takes to wake up, DSP_POOL_WAKE_NS stands for the latter until
+ * a shared pass measures it
+ */
+#define PROP_AUDIO_DSP_WORKERS      "vendor.audio.dsp_workers"
+#define DSP_POOL_MAX_WORKERS        4
+#define DSP_POOL_WAKE_NS            50000
+#define DSP_POOL_PRIORITY           2   /* SCHED_FIFO, as audio threads */
+
+/* Stream key enabling the level meter, "on" or "off" */
+#define AUDIO_PARAMETER_STREAM_METERS       "meters"
+
+/* Stream keys reporting the last meter window */
+#define AUDIO_PARAMETER_METER_PEAK          "meter_peak_db"
+#define AUDIO_PARAMETER_METER_RMS           "meter_rms_db"
+#define AUDIO_PARAMETER_METER_CLIPPED       "meter_clipped"
+#define AUDIO_PARAMETER_METER_SILENCE       "meter_silence_ms"
+
+/* Meter readings are published once per window. A buffer whose peak
+ * does not exceed METER_SILENCE_LEVEL (about -84 dBFS) counts as silence
+ */
+#define METER_WINDOW_MS             250
+#define METER_SILENCE_LEVEL         2
+#define METER_FLOOR_DB              -120.0f
+
+/* Keys reporting the devices of inserted jacks */
+#define AUDIO_PARAMETER_JACK_OUT_DEVICES    "jack_out_devices"
+#define AUDIO_PARAMETER_JACK_IN_DEVICES     "jack_in_devices"
+
+/* Properties the same masks are published to on every jack event, so
+ * that services watching them learn of plugs without polling
+ */
+#define PROP_AUDIO_JACK_OUT_DEVICES "vendor.audio.jack_out_devices"
+#define PROP_AUDIO_JACK_IN_DEVICES  "vendor.audio.jack_in_devices"
+
+/* Key reporting when the trigger hardware last fired */
+#define AUDIO_PARAMETER_VOICE_TRIGGER_TIME  "voice_trigger_time"
+
 /* Voice trigger and voice recognition stream names */
 const char kVoiceTriggerStreamName[] = "voice trigger";
 const char kVoiceRecogStreamName[] = "voice recognition";
@@ -86,6 +220,14 @@ enum voice_state {
   eVoiceRecogReArm        /* Re-arm after audio */
 };
 
+/* DSP quality, stepped down under sustained CPU load */
+enum dsp_quality {
+  e_quality_full,
+  e_quality_reduced,
+  e_quality_minimum,
+  e_quality_count
+};
+
 struct audio_device {
   struct audio_hw_device hw_device;
 
@@ -99,9 +241,41 @@ struct audio_device {
 
   enum voice_state voice_st;
   audio_devices_t voice_trig_mic;
+  int64_t voice_trig_time_ns;   /* CLOCK_MONOTONIC of the last hw trigger */
 
   const struct hw_stream* global_stream;
 
+  /* writes out the dump taps of all streams */
+  struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool started;
+    bool exit;
+    unsigned int sequence;
+    struct dump_tap *taps;
+  } dump;
+
+  struct dsp_pool *pool;        /* NULL unless PROP_AUDIO_DSP_WORKERS */
+
+  /* trades DSP quality for CPU time, see GOVERNOR_WINDOW_MS */
+  struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool started;
+    bool exit;
+    atomic_uint level;          /* enum dsp_quality */
+    struct governor_stream *streams;
+    int64_t retired_ns;         /* not collected from closed streams */
+    unsigned int over;          /* windows in a row above the high mark */
+    unsigned int under;         /* windows in a row below the low mark */
+    unsigned int load_pct;      /* of the last window */
+    unsigned int peak_pct;
+    unsigned int step_downs;
+    unsigned int step_ups;
+  } governor;
+
   union {
     /* config stream for trigger-only operation */
     const struct hw_stream* voice_trig_stream;
@@ -112,6 +286,68 @@ struct audio_device {
 };
 
 
+/* Points at which a stream can copy its audio to a dump file */
+enum dump_tap_point {
+  e_tap_client,       /* as exchanged with the client */
+  e_tap_resampled,    /* input after the resampler, before gain */
+  e_tap_hw,           /* as exchanged with the PCM */
+  e_tap_count
+};
+
+/* Ring between the audio thread of a stream and the dump writer. head
+ * is only written by the audio thread and tail by the writer, so the
+ * audio thread never blocks and drops the data if the ring is full
+ */
+struct dump_tap {
+  struct dump_tap *next;        /* list of the dump writer */
+  int fd;
+  bool closing;                 /* detached from its stream */
+  bool failed;                  /* the file could not be written */
+
+  uint8_t *ring;
+  size_t size;
+  atomic_size_t head;
+  atomic_size_t tail;
+  atomic_size_t dropped;        /* bytes lost to a full ring */
+  uint64_t written;             /* bytes written to the file */
+};
+
+struct meter_reading {
+  float peak_db;
+  float rms_db;
+  uint64_t clipped;             /* samples at full scale since enabled */
+  uint32_t silence_ms;          /* current run of silence */
+};
+
+/* Level meter of a 16-bit stream. The audio thread accumulates windows
+ * and publishes each one under a sequence count, so that readers never
+ * take the stream lock
+ */
+struct stream_meter {
+  bool enabled;                 /* changed with the stream mutex locked */
+  uint32_t sample_rate;
+  unsigned int channels;
+
+  /* window being accumulated by the audio thread */
+  int peak;
+  uint64_t sum_squares;
+  uint64_t samples;
+  uint64_t window_samples;
+  uint64_t silent_frames;
+  uint64_t clipped;
+
+  atomic_uint sequence;         /* odd while reading is being updated */
+  struct meter_reading reading;
+};
+
+/* CPU time of a stream for the DSP quality governor. The audio thread
+ * only adds to it, the governor collects it once per window
+ */
+struct governor_stream {
+  struct governor_stream *next; /* list of the governor */
+  atomic_llong cpu_ns;          /* not collected yet */
+};
+
 typedef void(*close_fn)(struct audio_stream *);
 
 /* Fields common to all types of output stream */
@@ -140,12 +376,167 @@ struct stream_out_common {
   uint32_t buffer_size;
 
   uint32_t latency;
+
+  struct stream_meter meter;
+  struct governor_stream governor;
+};
+
+/* IEC 61937 encapsulation state of a compressed passthrough stream */
+struct out_iec61937 {
+  audio_format_t format;
+  unsigned int rate_mult;       /* IEC link rate / bitstream sample rate */
+
+  /* bitstream frame being assembled */
+  uint8_t frame[IEC61937_MAX_FRAME_SIZE];
+  size_t frame_len;             /* bytes collected */
+  size_t frame_size;            /* size of current frame, 0 if not synced */
+  unsigned int frame_samples;   /* samples of current frame */
+  bool frame_swapped;           /* frame is in 16-bit little-endian words */
+
+  /* burst being assembled, in 16-bit words of the IEC link */
+  uint16_t *burst;
+  size_t burst_words;           /* size of burst buffer */
+  size_t payload_len;           /* payload bytes collected */
+  unsigned int burst_samples;   /* bitstream samples in payload */
+  uint16_t burst_info;          /* Pc of current burst */
+};
+
+/* Reordering of a multichannel stream to the channel layout of the HDMI
+ * link. Positions are SNDRV_CHMAP_* values
+ */
+struct out_chmap {
+  unsigned int channels;
+  unsigned int positions[HDMI_MAX_CHANNELS];  /* of the AudioFlinger data */
+  int reorder[HDMI_MAX_CHANNELS];   /* source of each slot, -1 if silent */
+  bool identity;
+
+  size_t sample_size;
+  size_t frame_size;
+
+  /* byte shuffle of a block of whole frames, 0 if frames don't tile */
+  size_t block_size;
+  uint8_t shuffle[CHMAP_MAX_BLOCK];
+
+  void *buffer;
+  size_t buffer_size;
+};
+
+/* Fade out, reroute and fade in of a running output stream */
+enum out_route_state {
+  e_route_idle,
+  e_route_fade_out,   /* ramping down to the requested route */
+  e_route_wait,       /* writing silence until the route is applied */
+  e_route_fade_in     /* ramping up on the new route */
+};
+
+struct out_route_fade {
+  enum out_route_state state;
+  uint32_t devices;             /* route requested */
+  unsigned int frames;          /* length of a fade, 0 disables fading */
+  unsigned int level;           /* gain in 1/frames steps */
+
+  void *buffer;
+  size_t buffer_size;
+};
+
+/* Silence written by a thread when the client stops writing, so that
+ * the PCM doesn't underrun. Silence is tracked in frames of the kernel
+ * buffer, which count both the client frames and the silence
+ */
+struct out_keep_alive {
+  pthread_t thread;
+  pthread_cond_t cond;          /* waits with the stream lock */
+  bool exit;
+
+  unsigned int guard_frames;    /* write silence if less than this queued */
+  int64_t write_ns;             /* CLOCK_MONOTONIC of the last client write */
+  void *silence;
+  size_t silence_size;
+
+  uint64_t injected;            /* silence frames written */
+  uint64_t block_start;         /* last run of silence in the buffer */
+  uint64_t block_end;
+  uint32_t events;
+};
+
+/* How much of the PCM buffer an output stream keeps queued */
+enum out_latency_mode {
+  e_latency_power,    /* the whole buffer, fewest wakeups */
+  e_latency_low       /* OUT_LOW_LATENCY_PERIODS */
+};
+
+/* Writes of a deep buffer stream collected into bursts for the PCM */
+struct out_stage {
+  uint8_t *buffer;
+  size_t frames;              /* staged */
+  size_t capacity;            /* frames of a burst */
+  size_t size;                /* bytes allocated */
+
+  /* writes a partial burst once it has waited a burst period */
+  pthread_t thread;
+  pthread_cond_t cond;        /* waits with the stream lock */
+  bool started;
+  bool exit;
+  int64_t deadline_ns;        /* CLOCK_MONOTONIC, 0 if nothing staged */
+};
+
+/* One fused pass over a buffer: channel selection, format conversion and
+ * gain are done while each sample is loaded, instead of one pass each.
+ * Built for the exact combination of a stream when it starts
+ */
+struct pcm_pipe;
+typedef void (*pcm_pipe_fn)(const struct pcm_pipe *pipe, void *dst,
+                            const void *src, size_t frames);
+
+/* Measured cost of a DSP pass, kept by its caller */
+struct dsp_cost {
+  int64_t frame_ps;             /* CPU time per frame, 0 until measured */
+};
+
+struct pcm_pipe {
+  audio_format_t src_format;
+  audio_format_t dst_format;
+  unsigned int src_channels;
+  unsigned int dst_channels;
+  int select[HDMI_MAX_CHANNELS];  /* source of each channel, -1 if silent */
+  bool remix;                     /* select is not the identity */
+  unsigned int gain_shift;        /* left shift of 16-bit output */
+  pcm_pipe_fn process;            /* NULL if data passes through */
+  struct dsp_cost cost;
+};
+
+/* Profile of the tracks of a stream, from their metadata. Ordered so
+ * that a mix of tracks takes the highest
+ */
+enum stream_profile {
+  e_profile_default,      /* no metadata, or nothing we recognize */
+  e_profile_power,        /* media and recording, most efficient */
+  e_profile_low_latency,  /* games and interactive capture */
+  e_profile_voice,        /* voice communication */
+  e_profile_count
 };
 
 struct stream_out_pcm {
   struct stream_out_common common;
 
   struct pcm *pcm;
+  bool mmap;                    /* pcm is written through its DMA buffer */
+  bool mmap_started;
+  struct out_iec61937 *iec;     /* non-NULL for compressed passthrough */
+  struct out_chmap *chmap;      /* non-NULL for multichannel HDMI */
+#ifdef TEST_32BITS
+  struct pcm_pipe pipe;         /* reorder and 16 to 32bits conversion */
+  void *pipe_buffer;
+  size_t pipe_buffer_size;
+#endif
+  struct out_route_fade fade;
+  enum out_latency_mode latency_mode;
+  enum out_latency_mode client_latency_mode;  /* set through latency_mode */
+  enum stream_profile profile;
+  enum stream_profile profile_pending;  /* applied at the next write */
+  struct out_keep_alive *keep_alive;  /* non-NULL if enabled */
+  struct out_stage *stage;      /* non-NULL for deep buffer */
+  struct dump_tap *taps[e_tap_count]; /* non-NULL if enabled */
 
   unsigned int hw_sample_rate;    /* actual sample rate of hardware */
   unsigned int hw_channel_count;  /* actual number of output channels */
@@ -156,14 +547,33 @@ struct stream_out_pcm {
   uint64_t hw_frames_rendered;  /* actual number of written frames */
 };
 
+/* Polyphase FIR for an integer ratio of sample rates */
+struct in_fir {
+  unsigned int phases;  /* interpolation factor, 1 to decimate */
+  unsigned int step;    /* decimation factor, 1 to interpolate */
+  unsigned int taps;    /* per phase */
+  int16_t *coefs;       /* Q15, phases * taps, each phase in time order */
+
+  int16_t *history;     /* taps - 1 frames of history then new input */
+  size_t capacity;      /* frames */
+  size_t frames;        /* valid frames */
+  size_t pos;           /* newest frame of the next output */
+  unsigned int phase;   /* of the next output */
+  struct dsp_cost cost;
+};
+
 struct in_resampler {
   struct resampler_itfe *resampler;
+  struct in_fir *fir;           /* in place of resampler for integer ratios */
   struct resampler_buffer_provider buf_provider;
-  int16_t *buffer;
+  int16_t *buffer;              /* a period of 16-bit samples */
   size_t in_buffer_size;
   int in_buffer_frames;
   size_t frames_in;
   int read_status;
+
+  void *raw;                    /* a period in hw format, if not 16-bit */
+  size_t raw_size;
 };
 
 /* Fields common to all types of input stream */
@@ -192,6 +602,10 @@ struct stream_in_common {
   size_t buffer_size;
 
   int input_source;
+  audio_input_flags_t flags;
+
+  struct stream_meter meter;
+  struct governor_stream governor;
 
   nsecs_t last_read_ns;
 };
@@ -208,8 +622,23 @@ struct stream_in_pcm {
   unsigned int hw_channel_count;  /* actual number of input channels */
   unsigned int hw_period_size;  /* actual number of input period size */
   unsigned int hw_period_count;  /* actual number of input period count */
+  audio_format_t hw_format;       /* actual format of hardware */
+
+  enum stream_profile profile;
+  enum stream_profile profile_pending;  /* applied at the next read */
 
   struct in_resampler resampler;
+  enum dsp_quality quality;           /* of the resampler */
+  struct dump_tap *taps[e_tap_count]; /* non-NULL if enabled */
+
+  /* From the hw to the client, or to the resampler if there is one */
+  struct pcm_pipe pipe;
+  /* From the resampler to the client */
+  struct pcm_pipe post_pipe;
+
+  /* scratch buffer for format conversion */
+  void *convert;
+  size_t convert_size;
 };
 
 static uint32_t out_get_sample_rate(const struct audio_stream *stream);
@@ -217,6 +646,35 @@ static uint32_t in_get_sample_rate(const struct audio_stream *stream);
 static void voice_trigger_audio_started_locked(struct audio_device *adev);
 static void voice_trigger_audio_ended_locked(struct audio_device *adev);
 static const char *voice_trigger_audio_stream_name(struct audio_device *adev);
+static int hdmi_get_sink_masks(const struct hw_stream *hw,
+                               audio_channel_mask_t *masks, size_t max);
+static void out_pcm_request_route(struct stream_out_pcm *out, uint32_t devices);
+static void out_pcm_set_latency_mode(struct stream_out_pcm *out,
+                                     const char *kvpairs);
+static uint64_t out_keep_alive_unplayed(const struct stream_out_pcm *out,
+                                        uint64_t played);
+static int out_chmap_init(struct stream_out_pcm *out);
+static void out_chmap_setup(struct stream_out_pcm *out);
+static int pcm_pipe_build(struct pcm_pipe *pipe,
+                          audio_format_t src_format, unsigned int src_channels,
+                          audio_format_t dst_format, unsigned int dst_channels,
+                          const int *select, unsigned int gain_shift);
+static void in_convert_samples(void *dst, audio_format_t dst_format,
+                               const void *src, audio_format_t src_format,
+                               size_t count);
+static int dump_parse_taps(const char *kvpairs, unsigned int *points);
+static void dump_tap_push(struct dump_tap *tap, const void *buf, size_t bytes);
+static void dump_update_taps_l(struct audio_device *adev,
+                               struct dump_tap **taps, unsigned int points,
+                               const void *stream, const char *kind);
+static void dump_print_taps(struct dump_tap **taps, int fd);
+static int meter_parse(const char *kvpairs, bool *enable);
+static void meter_enable_l(struct stream_meter *m, bool enable,
+                           audio_format_t format, uint32_t sample_rate,
+                           unsigned int channels);
+static void meter_get_parameter(const struct stream_meter *m, const char *key,
+                                char *buf, size_t size);
+static void meter_dump(const struct stream_meter *m, int fd);
 
 /*********************************************************************
  * Stream common functions
@@ -342,9 +800,17 @@ static audio_format_t out_get_format(const struct audio_stream *stream)
 
 static int out_dump(const struct audio_stream *stream, int fd)
 {
-  ALOGV("out_dump called but not implemented");
-  UNUSED(stream);
-  UNUSED(fd);
+  /* All output streams are PCM */
+  struct stream_out_pcm *out = (struct stream_out_pcm *)stream;
+
+  lock_output_stream(out);
+  if (out->keep_alive != NULL) {
+    dprintf(fd, "    keep-alive: stalls: %u silence frames: %" PRIu64 "\n",
+            out->keep_alive->events, out->keep_alive->injected);
+  }
+  dump_print_taps(out->taps, fd);
+  pthread_mutex_unlock(&out->common.lock);
+  meter_dump(&out->common.meter, fd);
   return 0;
 }
 
@@ -355,12 +821,32 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
   struct stream_out_common *out = (struct stream_out_common *)stream;
   struct audio_device *adev = out->dev;
   uint32_t v = 0;
+  unsigned int taps = 0;
+  bool meter = false;
   int ret = common_get_routing_param(&v, kvpairs);
 
+  /* All output streams are PCM */
+  out_pcm_set_latency_mode((struct stream_out_pcm *)out, kvpairs);
+
+  if (dump_parse_taps(kvpairs, &taps) == 0) {
+    lock_output_stream((struct stream_out_pcm *)out);
+    dump_update_taps_l(adev, ((struct stream_out_pcm *)out)->taps,
+                       taps & ~(1U << e_tap_resampled), out, "out");
+    pthread_mutex_unlock(&out->lock);
+  }
+
+  if (meter_parse(kvpairs, &meter) == 0) {
+    lock_output_stream((struct stream_out_pcm *)out);
+    meter_enable_l(&out->meter, meter, out->format,
+                   out_get_sample_rate(&out->stream.common),
+                   popcount(out_get_channels(&out->stream.common)));
+    pthread_mutex_unlock(&out->lock);
+  }
+
   pthread_mutex_lock(&adev->lock);
 
   if (ret >= 0) {
-    apply_route(out->hw, v);
+    out_pcm_request_route((struct stream_out_pcm *)out, v);
   }
 
   stream_invoke_usecases(out->hw, kvpairs);
@@ -375,6 +861,49 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
   return 0;
 }
 
+/* Append the channel masks the sink of an HDMI stream can play */
+static void out_get_supported_channels(const struct audio_stream *stream,
+                                       char *buf, size_t size)
+{
+  struct stream_out_common *out = (struct stream_out_common *)stream;
+  audio_channel_mask_t masks[HDMI_MAX_LAYOUTS];
+  int count = -ENOSYS;
+  int i = 0;
+
+  if (get_routed_devices(out->hw) & AUDIO_DEVICE_OUT_HDMI) {
+    count = hdmi_get_sink_masks(out->hw, masks, ARRAY_SIZE(masks));
+  }
+
+  if (count <= 0) {
+    masks[0] = out_get_channels(stream);
+    count = 1;
+  }
+
+  strlcat(buf, AUDIO_PARAMETER_STREAM_SUP_CHANNELS "=", size);
+  for (i = 0; i < count; ++i) {
+    if (i > 0) {
+      strlcat(buf, "|", size);
+    }
+    switch (masks[i]) {
+      case AUDIO_CHANNEL_OUT_7POINT1:
+        strlcat(buf, "AUDIO_CHANNEL_OUT_7POINT1", size);
+        break;
+      case AUDIO_CHANNEL_OUT_5POINT1:
+        strlcat(buf, "AUDIO_CHANNEL_OUT_5POINT1", size);
+        break;
+      case AUDIO_CHANNEL_OUT_QUAD:
+        strlcat(buf, "AUDIO_CHANNEL_OUT_QUAD", size);
+        break;
+      case AUDIO_CHANNEL_OUT_MONO:
+        strlcat(buf, "AUDIO_CHANNEL_OUT_MONO", size);
+        break;
+      default:
+        strlcat(buf, "AUDIO_CHANNEL_OUT_STEREO", size);
+        break;
+    }
+  }
+}
+
 static char * out_get_parameters(const struct audio_stream *stream,
                                  const char *keys)
 {
@@ -410,10 +939,24 @@ static char * out_get_parameters(const struct audio_stream *stream,
         case AUDIO_FORMAT_PCM_24_BIT_PACKED:
           strncat(outputBuffer, "=AUDIO_FORMAT_PCM_24_BIT_PACKED", 256);
           break;
+        case AUDIO_FORMAT_AC3:
+          strncat(outputBuffer, "=AUDIO_FORMAT_AC3", 256);
+          break;
+        case AUDIO_FORMAT_E_AC3:
+          strncat(outputBuffer, "=AUDIO_FORMAT_E_AC3", 256);
+          break;
+        case AUDIO_FORMAT_DTS:
+          strncat(outputBuffer, "=AUDIO_FORMAT_DTS", 256);
+          break;
         default:
           strncat(outputBuffer, "=AUDIO_FORMAT_INVALID", 256);
           break;
       }
+    } else if (strcmp(currentKey, AUDIO_PARAMETER_STREAM_SUP_CHANNELS) == 0) {
+      out_get_supported_channels(stream, outputBuffer, sizeof(outputBuffer));
+    } else {
+      meter_get_parameter(&((const struct stream_out_common *)stream)->meter,
+                          currentKey, outputBuffer, sizeof(outputBuffer));
     }
     currentKey = strtok_r(NULL, ";", &saveptr1);
   }
@@ -437,134 +980,1763 @@ static uint32_t out_get_latency(const struct audio_stream_out *stream)
   return ret;
 }
 
-static int volume_to_percent(float volume)
+/*********************************************************************
+ * Route change fades
+ *********************************************************************/
+
+/* Apply the gain ramp of the current fade to frames of buf. Frames after
+ * a fade out has reached silence are zeroed. Returns true when the fade
+ * is complete
+ */
+static bool out_fade_ramp(struct stream_out_pcm *out, void *buf,
+                          size_t frames)
 {
-  float decibels = 0;
-  float percent = 0;
+  struct out_route_fade *fade = &out->fade;
+  const unsigned int channels = out->common.channel_count;
+  const bool up = (fade->state == e_route_fade_in);
+  size_t i = 0;
+  unsigned int c = 0;
+
+  for (i = 0; i < frames; ++i) {
+    if (up ? (fade->level >= fade->frames) : (fade->level == 0)) {
+      break;
+    }
+    fade->level = up ? (fade->level + 1) : (fade->level - 1);
 
-  /* Converting back to a decibel scale */
-  if(volume > 0) {
-    decibels = log(volume) / 0.115129f;
-  } else {
-    /* Use the maximum attenuation value 58 */
-    decibels = -58;
+    switch (out->common.format) {
+      case AUDIO_FORMAT_PCM_16_BIT: {
+        int16_t *p = (int16_t *)buf + (i * channels);
+        for (c = 0; c < channels; ++c) {
+          p[c] = ((int32_t)p[c] * (int32_t)fade->level) / (int32_t)fade->frames;
+        }
+        break;
+      }
+      case AUDIO_FORMAT_PCM_32_BIT:
+      case AUDIO_FORMAT_PCM_8_24_BIT: {
+        int32_t *p = (int32_t *)buf + (i * channels);
+        for (c = 0; c < channels; ++c) {
+          p[c] = ((int64_t)p[c] * fade->level) / fade->frames;
+        }
+        break;
+      }
+      case AUDIO_FORMAT_PCM_FLOAT: {
+        float *p = (float *)buf + (i * channels);
+        const float g = (float)fade->level / fade->frames;
+        for (c = 0; c < channels; ++c) {
+          p[c] *= g;
+        }
+        break;
+      }
+      case AUDIO_FORMAT_PCM_24_BIT_PACKED: {
+        uint8_t *p = (uint8_t *)buf + (i * channels * 3);
+        int32_t v = 0;
+        for (c = 0; c < channels; ++c, p += 3) {
+          v = (int32_t)((p[0] << 8) | (p[1] << 16) | ((uint32_t)p[2] << 24)) >> 8;
+          v = ((int64_t)v * fade->level) / fade->frames;
+          p[0] = v;
+          p[1] = v >> 8;
+          p[2] = v >> 16;
+        }
+        break;
+      }
+      default:
+        /* unknown layout, can only cut */
+        fade->level = up ? fade->frames : 0;
+        break;
+    }
   }
 
-  /* decibels range is -58..0, rescale to range 0..100 */
-  percent = ((decibels + 58.0) * (100.0/58.0));
-  return (int)percent;
+  if (!up && (i < frames)) {
+    memset((uint8_t *)buf + (i * out->common.frame_size), 0,
+           (frames - i) * out->common.frame_size);
+  }
+
+  return up ? (fade->level >= fade->frames) : (fade->level == 0);
 }
 
-static int out_set_volume(struct audio_stream_out *stream,
-                          float left, float right)
+/* Frames queued in the kernel buffer, in microseconds */
+static uint32_t out_queued_us(struct stream_out_pcm *out)
 {
-  struct stream_out_common *out = (struct stream_out_common *)stream;
-  int l_pc = volume_to_percent(left);
-  int r_pc = volume_to_percent(right);
+  struct timespec ts;
+  unsigned int avail = 0;
+  size_t queued = 0;
 
-  ALOGV("out_set_volume (%f,%f) -> (%d%%,%d%%)", left, right, l_pc, r_pc);
+  if ((out->pcm == NULL) || (out->hw_sample_rate == 0) ||
+      (pcm_get_htimestamp(out->pcm, &avail, &ts) != 0)) {
+    return 0;
+  }
 
-  return set_hw_volume(out->hw, l_pc, r_pc);
+  queued = (out->hw_period_size * out->hw_period_count) - avail;
+  return (uint32_t)(((uint64_t)queued * 1000000) / out->hw_sample_rate);
 }
 
-static int out_add_audio_effect(const struct audio_stream *stream,
-                                effect_handle_t effect)
+/*
+ * Run a write buffer through the route change fades. Returns the buffer to
+ * write, which is a faded copy while a change is in progress, or NULL on
+ * error.
+ */
+static const void *out_fade_process(struct stream_out_pcm *out,
+                                    const void *buffer, size_t bytes)
 {
-  ALOGV("out_add_audio_effect called but not implemented");
-  UNUSED(stream);
-  UNUSED(effect);
-  return 0;
-}
+  struct out_route_fade *fade = &out->fade;
+  const size_t frames = bytes / out->common.frame_size;
+  void *buf = NULL;
 
-static int out_remove_audio_effect(const struct audio_stream *stream,
-                                   effect_handle_t effect)
-{
-  ALOGV("out_remove_audio_effect called but not implemented");
-  UNUSED(stream);
-  UNUSED(effect);
-  return 0;
-}
+  if (bytes > fade->buffer_size) {
+    buf = realloc(fade->buffer, bytes);
+    if (buf == NULL) {
+      return NULL;
+    }
+    fade->buffer = buf;
+    fade->buffer_size = bytes;
+  }
+  buf = fade->buffer;
+
+  switch (fade->state) {
+    case e_route_fade_out:
+      memcpy(buf, buffer, bytes);
+      if (out_fade_ramp(out, buf, frames)) {
+        /* Switch paths on the worker once the fade tail has played out,
+         * writing silence meanwhile
+         */
+        schedule_route(out->common.hw, fade->devices, out_queued_us(out) +
+                       ((frames * 1000000ULL) / out->common.sample_rate));
+        fade->state = e_route_wait;
+      }
+      break;
 
-static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
-                                        int64_t *timestamp)
-{
-  ALOGV("out_get_next_write_timestamp called but not implemented");
-  *timestamp = 0;
-  UNUSED(stream);
-  return -ENOSYS;
+    case e_route_wait:
+      if (is_route_pending(out->common.hw)) {
+        memset(buf, 0, bytes);
+        break;
+      }
+      fade->state = e_route_fade_in;
+      /* fall through */
+
+    case e_route_fade_in:
+      memcpy(buf, buffer, bytes);
+      if (out_fade_ramp(out, buf, frames)) {
+        fade->state = e_route_idle;
+      }
+      break;
+
+    default:
+      return buffer;
+  }
+
+  return buf;
 }
 
-static int out_get_presentation_position(const struct audio_stream_out *stream,
-                                         uint64_t *frames,
-                                         struct timespec *timestamp)
+/* must be called with hw device mutex locked */
+static void out_pcm_request_route(struct stream_out_pcm *out, uint32_t devices)
 {
-  struct stream_out_pcm *out = (struct stream_out_pcm *)stream;
-  int ret = -EINVAL;
+  struct out_route_fade *fade = &out->fade;
 
   lock_output_stream(out);
 
-  if (out->pcm) {
-    unsigned int avail;
-    if (pcm_get_htimestamp(out->pcm, &avail, timestamp) == 0) {
-      size_t kernel_buffer_size = out->hw_period_size * out->hw_period_count;
-      int64_t presented_frames = out->hw_frames_written - kernel_buffer_size +
-                                 avail;
-      if (presented_frames >= 0) {
-        *frames = presented_frames;
-        ret = 0;
-      }
-    }
+  if (out->common.standby || (out->iec != NULL) || (fade->frames == 0)) {
+    /* Nothing audible to protect, or nothing we can fade */
+    apply_route(out->common.hw, devices);
   } else {
-    size_t kernel_buffer_size = out->hw_period_size * out->hw_period_count;
-    int64_t presented_frames = out->hw_frames_written - kernel_buffer_size;
-    if (presented_frames >= 0) {
-      *frames = presented_frames;
-      ret = 0;
+    fade->devices = devices;
+    switch (fade->state) {
+      case e_route_idle:
+      case e_route_fade_in:
+        /* ramp down from wherever the gain is now */
+        fade->state = e_route_fade_out;
+        break;
+      case e_route_wait:
+        schedule_route(out->common.hw, devices, 0);
+        break;
+      default:
+        break;
     }
   }
 
   pthread_mutex_unlock(&out->common.lock);
+}
 
-  ALOGV("out_get_presentation_position returned %" PRIu64 " frames", *frames);
+/*********************************************************************
+ * Latency modes
+ *********************************************************************/
 
-  return ret;
+/* must be called with output stream mutex locked */
+static void out_update_latency(struct stream_out_pcm *out)
+{
+  unsigned int periods = out->hw_period_count;
+
+  if (out->hw_sample_rate == 0) {
+    return;
+  }
+
+  if ((out->latency_mode == e_latency_low) &&
+      (periods > OUT_LOW_LATENCY_PERIODS)) {
+    periods = OUT_LOW_LATENCY_PERIODS;
+  }
+  out->common.latency = (out->hw_period_size * periods * 1000) /
+                        out->hw_sample_rate;
+  if ((out->stage != NULL) && (out->latency_mode == e_latency_power)) {
+    out->common.latency += (out->stage->capacity * 1000) /
+                           out->hw_sample_rate;
+  }
 }
 
-static void do_close_out_common(struct audio_stream *stream)
+/*
+ * Hold back a write in low latency mode until the queue is shallow enough
+ * to take it. The PCM keeps its configuration in either mode so a switch
+ * takes effect at the next period: the queue fills up or drains while
+ * writes wait, with no gap in the output.
+ */
+static void out_limit_queue(struct stream_out_pcm *out, size_t frames)
 {
-  struct stream_out_common *out = (struct stream_out_common *)stream;
-  release_stream(out->hw);
-  free(stream);
+  const size_t target = out->hw_period_size * OUT_LOW_LATENCY_PERIODS;
+  struct timespec ts;
+  unsigned int avail = 0;
+  size_t queued = 0;
+
+  if ((out->pcm == NULL) || (out->hw_sample_rate == 0) ||
+      (pcm_get_htimestamp(out->pcm, &avail, &ts) != 0)) {
+    return;
+  }
+
+  queued = (out->hw_period_size * out->hw_period_count) - avail;
+  if (queued + frames > target) {
+    usleep(((uint64_t)(queued + frames - target) * 1000000) /
+           out->hw_sample_rate);
+  }
 }
 
-static int do_init_out_common(struct stream_out_common *out,
-                              const struct audio_config *config,
-                              audio_devices_t devices)
+static void out_pcm_set_latency_mode(struct stream_out_pcm *out,
+                                     const char *kvpairs)
 {
-  int ret = 0;
+  struct str_parms *parms = str_parms_create_str(kvpairs);
+  char value[16];
+  enum out_latency_mode mode = e_latency_power;
 
-  ALOGV("do_init_out_common rate=%u channels=%x",
-      config->sample_rate,
-      config->channel_mask);
+  if (!parms) {
+    return;
+  }
 
-  out->standby = true;
+  if (str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_LATENCY_MODE,
+                        value, sizeof(value)) >= 0) {
+    if (strcmp(value, "low") == 0) {
+      mode = e_latency_low;
+    } else if (strcmp(value, "power") != 0) {
+      ALOGW("Unknown latency mode '%s'", value);
+      str_parms_destroy(parms);
+      return;
+    }
 
-  out->stream.common.get_sample_rate = out_get_sample_rate;
-  out->stream.common.set_sample_rate = out_set_sample_rate;
-  out->stream.common.get_buffer_size = out_get_buffer_size;
-  out->stream.common.get_channels = out_get_channels;
-  out->stream.common.get_format = out_get_format;
-  out->stream.common.set_format = NULL;
-  out->stream.common.standby = NULL;
-  out->stream.common.dump = out_dump;
-  out->stream.common.get_device = NULL;
-  out->stream.common.set_device = NULL;
-  out->stream.common.set_parameters = out_set_parameters;
-  out->stream.common.get_parameters = out_get_parameters;
-  out->stream.common.add_audio_effect = out_add_audio_effect;
-  out->stream.common.remove_audio_effect = out_remove_audio_effect;
+    lock_output_stream(out);
+    out->client_latency_mode = mode;
+    if (out->latency_mode != mode) {
+      ALOGV("out_pcm_set_latency_mode(%p) %s", out, value);
+      out->latency_mode = mode;
+      out_update_latency(out);
+    }
+    pthread_mutex_unlock(&out->common.lock);
+  }
 
-  out->stream.get_latency = out_get_latency;
+  str_parms_destroy(parms);
+}
+
+/*********************************************************************
+ * Track metadata
+ *********************************************************************/
+
+static const char * const stream_profile_names[e_profile_count] = {
+  [e_profile_default] = "default",
+  [e_profile_power] = "power",
+  [e_profile_low_latency] = "low_latency",
+  [e_profile_voice] = "voice",
+};
+
+static enum stream_profile out_profile_from_metadata(
+    const struct source_metadata *metadata)
+{
+  enum stream_profile profile = e_profile_default;
+  enum stream_profile p = e_profile_default;
+  size_t i = 0;
+
+  for (i = 0; i < metadata->track_count; ++i) {
+    switch (metadata->tracks[i].usage) {
+      case AUDIO_USAGE_VOICE_COMMUNICATION:
+      case AUDIO_USAGE_VOICE_COMMUNICATION_SIGNALLING:
+        p = e_profile_voice;
+        break;
+      case AUDIO_USAGE_GAME:
+      case AUDIO_USAGE_ASSISTANCE_ACCESSIBILITY:
+        p = e_profile_low_latency;
+        break;
+      case AUDIO_USAGE_MEDIA:
+        p = e_profile_power;
+        break;
+      default:
+        p = ((metadata->tracks[i].content_type == AUDIO_CONTENT_TYPE_MUSIC) ||
+             (metadata->tracks[i].content_type == AUDIO_CONTENT_TYPE_MOVIE)) ?
+            e_profile_power : e_profile_default;
+        break;
+    }
+    if (p > profile) {
+      profile = p;
+    }
+  }
+
+  return profile;
+}
+
+static enum stream_profile in_profile_from_metadata(
+    const struct sink_metadata *metadata)
+{
+  enum stream_profile profile = e_profile_default;
+  enum stream_profile p = e_profile_default;
+  size_t i = 0;
+
+  for (i = 0; i < metadata->track_count; ++i) {
+    switch (metadata->tracks[i].source) {
+      case AUDIO_SOURCE_VOICE_COMMUNICATION:
+      case AUDIO_SOURCE_VOICE_CALL:
+        p = e_profile_voice;
+        break;
+      case AUDIO_SOURCE_VOICE_RECOGNITION:
+      case AUDIO_SOURCE_VOICE_PERFORMANCE:
+        p = e_profile_low_latency;
+        break;
+      case AUDIO_SOURCE_MIC:
+      case AUDIO_SOURCE_CAMCORDER:
+      case AUDIO_SOURCE_UNPROCESSED:
+        p = e_profile_power;
+        break;
+      default:
+        p = e_profile_default;
+        break;
+    }
+    if (p > profile) {
+      profile = p;
+    }
+  }
+
+  return profile;
+}
+
+/* must be called with hw device and output stream mutexes locked */
+static void out_apply_profile_l(struct stream_out_pcm *out)
+{
+  const enum stream_profile profile = out->profile_pending;
+  enum out_latency_mode mode = out->client_latency_mode;
+
+  ALOGV("out_apply_profile_l(%p) %s", out, stream_profile_names[profile]);
+  apply_use_case(out->common.hw, STREAM_PROFILE_USECASE,
+                 stream_profile_names[profile]);
+  out->profile = profile;
+
+  /* Without metadata go back to the mode set through latency_mode */
+  if (profile != e_profile_default) {
+    mode = (profile >= e_profile_low_latency) ?
+           e_latency_low : e_latency_power;
+  }
+
+  if (out->latency_mode != mode) {
+    out->latency_mode = mode;
+    out_update_latency(out);
+  }
+}
+
+/* must be called with input stream mutex locked */
+static void in_apply_profile_l(struct stream_in_pcm *in)
+{
+  const enum stream_profile profile = in->profile_pending;
+
+  ALOGV("in_apply_profile_l(%p) %s", in, stream_profile_names[profile]);
+  if (in->common.hw != NULL) {
+    apply_use_case(in->common.hw, STREAM_PROFILE_USECASE,
+                   stream_profile_names[profile]);
+  }
+  in->profile = profile;
+}
+
+static void out_update_source_metadata(struct audio_stream_out *stream,
+                               const struct source_metadata *source_metadata)
+{
+  struct stream_out_pcm *out = (struct stream_out_pcm *)stream;
+  const enum stream_profile profile =
+                      out_profile_from_metadata(source_metadata);
+
+  lock_output_stream(out);
+  out->profile_pending = profile;
+  pthread_mutex_unlock(&out->common.lock);
+}
+
+static void in_update_sink_metadata(struct audio_stream_in *stream,
+                                    const struct sink_metadata *sink_metadata)
+{
+  struct stream_in_pcm *in = (struct stream_in_pcm *)stream;
+  const enum stream_profile profile = in_profile_from_metadata(sink_metadata);
+
+  pthread_mutex_lock(&in->common.lock);
+  in->profile_pending = profile;
+  pthread_mutex_unlock(&in->common.lock);
+}
+
+/*********************************************************************
+ * Mmap writes
+ *********************************************************************/
+
+/* Produces frames at dst, in the DMA buffer, from src */
+typedef void (*out_fill_fn)(struct stream_out_pcm *out, void *dst,
+                            const void *src, size_t frames);
+
+static void out_fill_copy(struct stream_out_pcm *out, void *dst,
+                          const void *src, size_t frames)
+{
+  memcpy(dst, src, pcm_frames_to_bytes(out->pcm, frames));
+}
+
+static void out_fill_silence(struct stream_out_pcm *out, void *dst,
+                             const void *src, size_t frames)
+{
+  (void)src;
+  memset(dst, 0, pcm_frames_to_bytes(out->pcm, frames));
+}
+
+/* must be called with output stream mutex locked */
+static int out_mmap_start(struct stream_out_pcm *out)
+{
+  int ret = pcm_start(out->pcm);
+
+  if (ret < 0) {
+    ALOGE("out_mmap_start(%p) failed: %s", out, pcm_get_error(out->pcm));
+    return ret;
+  }
+  out->mmap_started = true;
+  return 0;
+}
+
+/* must be called with output stream mutex locked */
+static int out_mmap_recover(struct stream_out_pcm *out)
+{
+  ALOGW("out_mmap_recover(%p) underrun", out);
+  out->mmap_started = false;
+  return pcm_prepare(out->pcm);
+}
+
+/*
+ * Writes frames straight into the DMA buffer of an output opened in mmap
+ * mode, fill producing them in place so that a conversion doesn't need
+ * its own buffer and a plain copy doesn't need a copy by the kernel. The
+ * PCM starts once half of its buffer is queued, as it would with writes.
+ * Must be called with output stream mutex locked
+ */
+static int out_mmap_write(struct stream_out_pcm *out, out_fill_fn fill,
+                          const void *buffer, size_t frames)
+{
+  const unsigned int buffer_frames = out->hw_period_size *
+                                     out->hw_period_count;
+  const uint8_t *src = buffer;
+  void *areas = NULL;
+  uint8_t *dst = NULL;
+  unsigned int offset = 0;
+  unsigned int count = 0;
+  int avail = 0;
+  int ret = 0;
+
+  while (frames > 0) {
+    avail = pcm_avail_update(out->pcm);
+    if ((avail < 0) || ((unsigned int)avail > buffer_frames)) {
+      ret = out_mmap_recover(out);
+      if (ret < 0) {
+        return ret;
+      }
+      continue;
+    }
+
+    if (avail == 0) {
+      /* full, it has to play to make room */
+      if (!out->mmap_started) {
+        ret = out_mmap_start(out);
+        if (ret < 0) {
+          return ret;
+        }
+      }
+      ret = pcm_wait(out->pcm, OUT_MMAP_WAIT_MS);
+      if (ret == 0) {
+        return -ETIMEDOUT;
+      } else if (ret < 0) {
+        ret = out_mmap_recover(out);
+        if (ret < 0) {
+          return ret;
+        }
+      }
+      continue;
+    }
+
+    count = (frames < (size_t)avail) ? frames : (unsigned int)avail;
+    ret = pcm_mmap_begin(out->pcm, &areas, &offset, &count);
+    if (ret < 0) {
+      return ret;
+    }
+
+    dst = (uint8_t *)areas + pcm_frames_to_bytes(out->pcm, offset);
+    fill(out, dst, src, count);
+    if (out->taps[e_tap_hw] != NULL) {
+      dump_tap_push(out->taps[e_tap_hw], dst,
+                    pcm_frames_to_bytes(out->pcm, count));
+    }
+
+    ret = pcm_mmap_commit(out->pcm, offset, count);
+    if (ret < 0) {
+      return ret;
+    }
+
+    if (src != NULL) {
+      src += count * out->common.frame_size;
+    }
+    frames -= count;
+  }
+
+  if (!out->mmap_started) {
+    avail = pcm_avail_update(out->pcm);
+    if ((avail >= 0) && ((buffer_frames - avail) >= (buffer_frames / 2))) {
+      return out_mmap_start(out);
+    }
+  }
+  return 0;
+}
+
+static int64_t out_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}
+
+/*********************************************************************
+ * Deep buffer staging
+ *********************************************************************/
+
+/*
+ * A deep buffer stream takes the writes of AudioFlinger into a stage of
+ * half the PCM buffer and hands it to the PCM in one burst, with avail_min
+ * set to a burst. The PCM interrupt and the write wake the CPU once per
+ * burst instead of once per mixer buffer. Staged frames are not counted
+ * as written until they reach the PCM, so positions stay exact, and they
+ * are reported in the latency. A burst that doesn't fill within a burst
+ * period, because the client stopped writing, is written as it is by the
+ * stage thread
+ */
+
+static int out_stage_init(struct stream_out_pcm *out)
+{
+  pthread_condattr_t attr;
+
+  out->stage = calloc(1, sizeof(struct out_stage));
+  if (out->stage == NULL) {
+    return -ENOMEM;
+  }
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&out->stage->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  return 0;
+}
+
+static void out_stage_free(struct stream_out_pcm *out)
+{
+  struct out_stage *stage = out->stage;
+
+  if (stage == NULL) {
+    return;
+  }
+
+  if (stage->started) {
+    lock_output_stream(out);
+    stage->exit = true;
+    pthread_cond_signal(&stage->cond);
+    pthread_mutex_unlock(&out->common.lock);
+    pthread_join(stage->thread, NULL);
+  }
+
+  pthread_cond_destroy(&stage->cond);
+  free(stage->buffer);
+  free(stage);
+  out->stage = NULL;
+}
+
+/* Burst size for a PCM configuration */
+static unsigned int out_stage_burst(const struct pcm_config *config)
+{
+  return (config->period_size * config->period_count) / 2;
+}
+
+/* Low latency needs each write to reach the PCM, and so does a route
+ * change so that the faded tail is queued when the switch is scheduled
+ */
+static bool out_stage_active(const struct stream_out_pcm *out)
+{
+  return (out->stage != NULL) && (out->latency_mode == e_latency_power) &&
+         (out->fade.state == e_route_idle);
+}
+
+/* must be called with output stream mutex locked */
+static int out_stage_flush(struct stream_out_pcm *out)
+{
+  struct out_stage *stage = out->stage;
+  const size_t frames = stage->frames;
+  int ret = 0;
+
+  if (frames == 0) {
+    return 0;
+  }
+
+  if (out->mmap) {
+    ret = out_mmap_write(out, out_fill_copy, stage->buffer, frames);
+  } else {
+    if (out->taps[e_tap_hw] != NULL) {
+      dump_tap_push(out->taps[e_tap_hw], stage->buffer,
+                    frames * out->common.frame_size);
+    }
+    ret = pcm_write(out->pcm, stage->buffer, frames * out->common.frame_size);
+  }
+
+  stage->frames = 0;
+  stage->deadline_ns = 0;
+  if (ret < 0) {
+    return ret;
+  }
+
+  out->hw_frames_written += frames;
+  out->hw_frames_rendered += frames;
+  return 0;
+}
+
+static void *out_stage_thread(void *param)
+{
+  struct stream_out_pcm *out = (struct stream_out_pcm *)param;
+  struct out_stage *stage = out->stage;
+  struct timespec ts;
+
+  lock_output_stream(out);
+  while (!stage->exit) {
+    if (stage->deadline_ns == 0) {
+      pthread_cond_wait(&stage->cond, &out->common.lock);
+      continue;
+    }
+
+    if (out_now_ns() < stage->deadline_ns) {
+      ts.tv_sec = stage->deadline_ns / 1000000000LL;
+      ts.tv_nsec = stage->deadline_ns % 1000000000LL;
+      pthread_cond_timedwait(&stage->cond, &out->common.lock, &ts);
+      continue;
+    }
+
+    if (!out->common.standby && (out->pcm != NULL) &&
+        !out->common.dev->disable_audio) {
+      ALOGV("out_stage(%p) writing partial burst of %zu frames",
+            out, stage->frames);
+      out_stage_flush(out);
+    }
+    stage->deadline_ns = 0;
+  }
+  pthread_mutex_unlock(&out->common.lock);
+
+  return NULL;
+}
+
+/* must be called with output stream mutex locked */
+static void out_stage_arm(struct stream_out_pcm *out)
+{
+  struct out_stage *stage = out->stage;
+
+  if (!stage->started) {
+    if (pthread_create(&stage->thread, NULL, out_stage_thread, out) != 0) {
+      ALOGE("Failed to start stage thread, partial bursts wait for writes");
+      return;
+    }
+    stage->started = true;
+  }
+
+  stage->deadline_ns = out_now_ns() +
+                       (((int64_t)stage->capacity * 1000000000LL) /
+                        out->hw_sample_rate);
+  pthread_cond_signal(&stage->cond);
+}
+
+/*
+ * Stages frames, fill producing them from the client buffer, and writes
+ * each burst that fills up. Must be called with output stream mutex locked
+ */
+static int out_stage_write(struct stream_out_pcm *out, out_fill_fn fill,
+                           const void *buffer, size_t frames)
+{
+  struct out_stage *stage = out->stage;
+  const size_t frame_size = out->common.frame_size;
+  const uint8_t *src = buffer;
+  uint8_t *buf = NULL;
+  size_t count = 0;
+  int ret = 0;
+
+  if (stage->size < (stage->capacity * frame_size)) {
+    buf = realloc(stage->buffer, stage->capacity * frame_size);
+    if (buf == NULL) {
+      return -ENOMEM;
+    }
+    stage->buffer = buf;
+    stage->size = stage->capacity * frame_size;
+  }
+
+  while (frames > 0) {
+    count = stage->capacity - stage->frames;
+    if (count > frames) {
+      count = frames;
+    }
+    if ((stage->frames == 0) && (count != 0)) {
+      out_stage_arm(out);
+    }
+    fill(out, stage->buffer + (stage->frames * frame_size), src, count);
+    stage->frames += count;
+    src += count * frame_size;
+    frames -= count;
+
+    if (stage->frames == stage->capacity) {
+      ret = out_stage_flush(out);
+      if (ret < 0) {
+        return ret;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/*********************************************************************
+ * Keep-alive
+ *********************************************************************/
+
+/* Silence frames of the last run not yet played when the kernel buffer
+ * has played the given number of frames
+ */
+static uint64_t out_keep_alive_unplayed(const struct stream_out_pcm *out,
+                                        uint64_t played)
+{
+  const struct out_keep_alive *ka = out->keep_alive;
+
+  if (played >= ka->block_end) {
+    return 0;
+  } else if (played <= ka->block_start) {
+    return ka->block_end - ka->block_start;
+  }
+  return ka->block_end - played;
+}
+
+/* Guard time in frames of the kernel buffer, leaving room for a period */
+static unsigned int out_keep_alive_guard(const struct stream_out_pcm *out)
+{
+  const size_t limit = out->hw_period_size * (out->hw_period_count - 1);
+  size_t guard = ((size_t)out->common.hw->keep_alive_ms *
+                  out->hw_sample_rate) / 1000;
+
+  return (guard < limit) ? guard : limit;
+}
+
+/* must be called with output stream mutex locked */
+static void out_keep_alive_fill(struct stream_out_pcm *out)
+{
+  struct out_keep_alive *ka = out->keep_alive;
+  const uint64_t position = out->hw_frames_written + ka->injected;
+  const size_t frames = out->hw_period_size;
+  const int64_t period_ns = ((int64_t)frames * 1000000000LL) /
+                            out->hw_sample_rate;
+  struct timespec ts;
+  unsigned int avail = 0;
+  size_t queued = 0;
+  void *buf = NULL;
+
+  ka->guard_frames = out_keep_alive_guard(out);
+
+  /* A client that wrote within the last period is just running close to
+   * the edge of the buffer, not stalled
+   */
+  if ((out_now_ns() - ka->write_ns) < period_ns) {
+    return;
+  }
+
+  if (pcm_get_htimestamp(out->pcm, &avail, &ts) != 0) {
+    return;
+  }
+
+  queued = (out->hw_period_size * out->hw_period_count) - avail;
+  if ((queued >= ka->guard_frames) || (avail < frames)) {
+    return;
+  }
+
+  /* Audio held back by deep buffer staging goes out before any silence */
+  if ((out->stage != NULL) && (out->stage->frames != 0)) {
+    out_stage_flush(out);
+    return;
+  }
+
+  if (ka->silence_size < pcm_frames_to_bytes(out->pcm, frames)) {
+    ka->silence_size = pcm_frames_to_bytes(out->pcm, frames);
+    buf = realloc(ka->silence, ka->silence_size);
+    if (buf == NULL) {
+      ka->silence_size = 0;
+      return;
+    }
+    ka->silence = buf;
+    memset(ka->silence, 0, ka->silence_size);
+  }
+
+  if (out->mmap) {
+    if (out_mmap_write(out, out_fill_silence, NULL, frames) != 0) {
+      return;
+    }
+  } else if (pcm_write(out->pcm, ka->silence,
+                       pcm_frames_to_bytes(out->pcm, frames)) != 0) {
+    return;
+  }
+
+  if (ka->block_end == position) {
+    /* the client is still stalled, extend the run */
+    ka->block_end += frames;
+  } else {
+    ka->block_start = position;
+    ka->block_end = position + frames;
+    ++ka->events;
+    ALOGV("out_keep_alive(%p) client stalled with %zu frames queued",
+          out, queued);
+  }
+  ka->injected += frames;
+}
+
+static void *out_keep_alive_thread(void *param)
+{
+  struct stream_out_pcm *out = (struct stream_out_pcm *)param;
+  struct out_keep_alive *ka = out->keep_alive;
+  struct timespec ts;
+  int64_t poll_ns = 0;
+
+  lock_output_stream(out);
+  while (!ka->exit) {
+    if (out->common.standby || (out->pcm == NULL) ||
+        (out->hw_sample_rate == 0)) {
+      pthread_cond_wait(&ka->cond, &out->common.lock);
+      continue;
+    }
+
+    out_keep_alive_fill(out);
+
+    /* check twice within the guard time */
+    poll_ns = ((int64_t)ka->guard_frames * 500000000LL) / out->hw_sample_rate;
+    if (poll_ns < OUT_KEEP_ALIVE_MIN_POLL_MS * 1000000LL) {
+      poll_ns = OUT_KEEP_ALIVE_MIN_POLL_MS * 1000000LL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += poll_ns % 1000000000LL;
+    ts.tv_sec += (poll_ns / 1000000000LL) + (ts.tv_nsec / 1000000000LL);
+    ts.tv_nsec %= 1000000000LL;
+    pthread_cond_timedwait(&ka->cond, &out->common.lock, &ts);
+  }
+  pthread_mutex_unlock(&out->common.lock);
+
+  return NULL;
+}
+
+static int out_keep_alive_init(struct stream_out_pcm *out)
+{
+  struct out_keep_alive *ka = NULL;
+  pthread_condattr_t attr;
+
+  ka = calloc(1, sizeof(struct out_keep_alive));
+  if (ka == NULL) {
+    return -ENOMEM;
+  }
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&ka->cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  out->keep_alive = ka;
+  if (pthread_create(&ka->thread, NULL, out_keep_alive_thread, out) != 0) {
+    ALOGE("Failed to start keep-alive, stream may underrun");
+    pthread_cond_destroy(&ka->cond);
+    out->keep_alive = NULL;
+    free(ka);
+  }
+  return 0;
+}
+
+static void out_keep_alive_free(struct stream_out_pcm *out)
+{
+  struct out_keep_alive *ka = out->keep_alive;
+
+  if (ka == NULL) {
+    return;
+  }
+
+  lock_output_stream(out);
+  ka->exit = true;
+  pthread_cond_signal(&ka->cond);
+  pthread_mutex_unlock(&out->common.lock);
+
+  pthread_join(ka->thread, NULL);
+  pthread_cond_destroy(&ka->cond);
+  out->keep_alive = NULL;
+  free(ka->silence);
+  free(ka);
+}
+
+/*********************************************************************
+ * DSP quality governor
+ *********************************************************************/
+
+static const char * const dsp_quality_names[e_quality_count] = {
+  [e_quality_full] = "full",
+  [e_quality_reduced] = "reduced",
+  [e_quality_minimum] = "minimum",
+};
+
+static enum dsp_quality governor_level(struct audio_device *adev)
+{
+  return atomic_load_explicit(&adev->governor.level, memory_order_relaxed);
+}
+
+/* CPU time of the calling thread, which excludes time blocked in ALSA */
+static int64_t governor_cpu_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ((int64_t)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}
+
+/* Adds the CPU time of a read or write of a stream, from its audio thread */
+static void governor_account(struct governor_stream *gs, int64_t cpu_ns)
+{
+  atomic_fetch_add_explicit(&gs->cpu_ns, cpu_ns, memory_order_relaxed);
+}
+
+static void governor_add_stream(struct audio_device *adev,
+                                struct governor_stream *gs)
+{
+  atomic_init(&gs->cpu_ns, 0);
+  pthread_mutex_lock(&adev->governor.lock);
+  gs->next = adev->governor.streams;
+  adev->governor.streams = gs;
+  pthread_mutex_unlock(&adev->governor.lock);
+}
+
+static void governor_remove_stream(struct audio_device *adev,
+                                   struct governor_stream *gs)
+{
+  struct governor_stream **link = NULL;
+
+  pthread_mutex_lock(&adev->governor.lock);
+  for (link = &adev->governor.streams; *link != NULL; link = &(*link)->next) {
+    if (*link == gs) {
+      *link = gs->next;
+      adev->governor.retired_ns +=
+          atomic_exchange_explicit(&gs->cpu_ns, 0, memory_order_relaxed);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&adev->governor.lock);
+}
+
+/* Moves the level from the load of a window. Called with the governor
+ * mutex locked
+ */
+static void governor_update_l(struct audio_device *adev, int64_t cpu_ns,
+                              int64_t elapsed)
+{
+  unsigned int level = governor_level(adev);
+  unsigned int load = (cpu_ns * 100) / elapsed;
+
+  adev->governor.load_pct = load;
+  if (load > adev->governor.peak_pct) {
+    adev->governor.peak_pct = load;
+  }
+
+  if (load > GOVERNOR_HIGH_PCT) {
+    adev->governor.under = 0;
+    if ((++adev->governor.over >= GOVERNOR_DOWN_WINDOWS) &&
+        (level < e_quality_minimum)) {
+      ++level;
+      ++adev->governor.step_downs;
+      adev->governor.over = 0;
+      ALOGW("DSP load %u%%, quality down to %s", load,
+            dsp_quality_names[level]);
+    }
+  } else if (load < GOVERNOR_LOW_PCT) {
+    adev->governor.over = 0;
+    if ((++adev->governor.under >= GOVERNOR_UP_WINDOWS) &&
+        (level > e_quality_full)) {
+      --level;
+      ++adev->governor.step_ups;
+      adev->governor.under = 0;
+      ALOGV("DSP load %u%%, quality up to %s", load,
+            dsp_quality_names[level]);
+    }
+  } else {
+    adev->governor.over = 0;
+    adev->governor.under = 0;
+  }
+
+  atomic_store_explicit(&adev->governor.level, level, memory_order_relaxed);
+}
+
+/* Collects the CPU time of all streams at the end of each window */
+static void *governor_thread(void *param)
+{
+  struct audio_device *adev = (struct audio_device *)param;
+  struct governor_stream *gs = NULL;
+  struct timespec ts;
+  int64_t window_start = 0;
+  int64_t now = 0;
+  int64_t cpu_ns = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  window_start = ((int64_t)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+
+  pthread_mutex_lock(&adev->governor.lock);
+  while (!adev->governor.exit) {
+    now = window_start + (GOVERNOR_WINDOW_MS * 1000000LL);
+    ts.tv_sec = now / 1000000000LL;
+    ts.tv_nsec = now % 1000000000LL;
+    pthread_cond_timedwait(&adev->governor.cond, &adev->governor.lock, &ts);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ((int64_t)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+    if (adev->governor.exit ||
+        ((now - window_start) < (GOVERNOR_WINDOW_MS * 1000000LL))) {
+      continue;
+    }
+
+    cpu_ns = adev->governor.retired_ns;
+    adev->governor.retired_ns = 0;
+    for (gs = adev->governor.streams; gs != NULL; gs = gs->next) {
+      cpu_ns += atomic_exchange_explicit(&gs->cpu_ns, 0, memory_order_relaxed);
+    }
+
+    governor_update_l(adev, cpu_ns, now - window_start);
+    window_start = now;
+  }
+  pthread_mutex_unlock(&adev->governor.lock);
+
+  return NULL;
+}
+
+static void governor_init(struct audio_device *adev)
+{
+  pthread_condattr_t attr;
+
+  pthread_mutex_init(&adev->governor.lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&adev->governor.cond, &attr);
+  pthread_condattr_destroy(&attr);
+  atomic_init(&adev->governor.level, e_quality_full);
+
+  if (pthread_create(&adev->governor.thread, NULL, governor_thread,
+                     adev) != 0) {
+    ALOGE("Failed to start DSP governor, quality stays at full");
+  } else {
+    adev->governor.started = true;
+  }
+}
+
+static void governor_free(struct audio_device *adev)
+{
+  pthread_mutex_lock(&adev->governor.lock);
+  adev->governor.exit = true;
+  pthread_cond_signal(&adev->governor.cond);
+  pthread_mutex_unlock(&adev->governor.lock);
+
+  if (adev->governor.started) {
+    pthread_join(adev->governor.thread, NULL);
+  }
+  pthread_cond_destroy(&adev->governor.cond);
+  pthread_mutex_destroy(&adev->governor.lock);
+}
+
+static void governor_dump(struct audio_device *adev, int fd)
+{
+  pthread_mutex_lock(&adev->governor.lock);
+  dprintf(fd, "  DSP quality: %s load: %u%% peak: %u%% "
+          "steps down: %u up: %u\n",
+          dsp_quality_names[governor_level(adev)],
+          adev->governor.load_pct, adev->governor.peak_pct,
+          adev->governor.step_downs, adev->governor.step_ups);
+  pthread_mutex_unlock(&adev->governor.lock);
+}
+
+/*********************************************************************
+ * PCM dump taps
+ *********************************************************************/
+
+static const char * const dump_tap_names[e_tap_count] = {
+  [e_tap_client] = "client",
+  [e_tap_resampled] = "resampled",
+  [e_tap_hw] = "hw",
+};
+
+/* Called from the audio thread with the stream mutex locked */
+static void dump_tap_push(struct dump_tap *tap, const void *buf, size_t bytes)
+{
+  const size_t head = atomic_load_explicit(&tap->head, memory_order_relaxed);
+  const size_t tail = atomic_load_explicit(&tap->tail, memory_order_acquire);
+  const size_t pos = head & (tap->size - 1);
+  size_t first = tap->size - pos;
+
+  if (bytes > tap->size - (head - tail)) {
+    atomic_fetch_add_explicit(&tap->dropped, bytes, memory_order_relaxed);
+    return;
+  }
+
+  if (first > bytes) {
+    first = bytes;
+  }
+  memcpy(tap->ring + pos, buf, first);
+  memcpy(tap->ring, (const uint8_t *)buf + first, bytes - first);
+  atomic_store_explicit(&tap->head, head + bytes, memory_order_release);
+}
+
+/* Called from the dump writer */
+static void dump_tap_drain(struct dump_tap *tap)
+{
+  const size_t head = atomic_load_explicit(&tap->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&tap->tail, memory_order_relaxed);
+  size_t pos = 0;
+  size_t chunk = 0;
+  ssize_t n = 0;
+
+  while (tail != head) {
+    pos = tail & (tap->size - 1);
+    chunk = head - tail;
+    if (chunk > tap->size - pos) {
+      chunk = tap->size - pos;
+    }
+
+    n = tap->failed ? -1 : write(tap->fd, tap->ring + pos, chunk);
+    if (n <= 0) {
+      if (!tap->failed) {
+        ALOGE("Dump tap write failed (%d), discarding further data", errno);
+        tap->failed = true;
+      }
+      tail = head;
+      break;
+    }
+    tail += n;
+    tap->written += n;
+  }
+
+  atomic_store_explicit(&tap->tail, tail, memory_order_release);
+}
+
+/*
+ * The files are written without the dump lock, which streams take with
+ * their own mutex held to attach and detach taps. The writer takes the
+ * list while it drains it and hands back the taps still open.
+ */
+static void *dump_writer_thread(void *param)
+{
+  struct audio_device *adev = (struct audio_device *)param;
+  struct dump_tap **link = NULL;
+  struct dump_tap *taps = NULL;
+  struct dump_tap *closed = NULL;
+  struct dump_tap *tap = NULL;
+  struct timespec ts;
+  bool exiting = false;
+
+  setpriority(PRIO_PROCESS, 0, DUMP_TAP_NICE);
+
+  pthread_mutex_lock(&adev->dump.lock);
+  for (;;) {
+    taps = adev->dump.taps;
+    adev->dump.taps = NULL;
+    pthread_mutex_unlock(&adev->dump.lock);
+
+    for (tap = taps; tap != NULL; tap = tap->next) {
+      dump_tap_drain(tap);
+    }
+
+    pthread_mutex_lock(&adev->dump.lock);
+    exiting = adev->dump.exit;
+    closed = NULL;
+    link = &taps;
+    while ((tap = *link) != NULL) {
+      if (tap->closing || exiting) {
+        *link = tap->next;
+        tap->next = closed;
+        closed = tap;
+      } else {
+        link = &tap->next;
+      }
+    }
+    /* taps opened meanwhile go after the ones handed back */
+    *link = adev->dump.taps;
+    adev->dump.taps = taps;
+    pthread_mutex_unlock(&adev->dump.lock);
+
+    /* a detached tap gets no more data once its last drain is done */
+    while ((tap = closed) != NULL) {
+      closed = tap->next;
+      dump_tap_drain(tap);
+      ALOGV("Dump tap %p closed, %" PRIu64 " bytes", tap, tap->written);
+      close(tap->fd);
+      free(tap->ring);
+      free(tap);
+    }
+
+    pthread_mutex_lock(&adev->dump.lock);
+    if (exiting) {
+      break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += DUMP_TAP_PERIOD_MS * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&adev->dump.cond, &adev->dump.lock, &ts);
+  }
+  pthread_mutex_unlock(&adev->dump.lock);
+
+  return NULL;
+}
+
+static void dump_writer_init(struct audio_device *adev)
+{
+  pthread_condattr_t attr;
+
+  pthread_mutex_init(&adev->dump.lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&adev->dump.cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static void dump_writer_free(struct audio_device *adev)
+{
+  pthread_mutex_lock(&adev->dump.lock);
+  adev->dump.exit = true;
+  pthread_cond_signal(&adev->dump.cond);
+  pthread_mutex_unlock(&adev->dump.lock);
+
+  if (adev->dump.started) {
+    pthread_join(adev->dump.thread, NULL);
+  }
+  pthread_cond_destroy(&adev->dump.cond);
+  pthread_mutex_destroy(&adev->dump.lock);
+}
+
+static struct dump_tap *dump_tap_open(struct audio_device *adev,
+                                      const void *stream, const char *kind,
+                                      enum dump_tap_point point)
+{
+  struct dump_tap *tap = NULL;
+  char path[PATH_MAX];
+  unsigned int sequence = 0;
+
+  tap = calloc(1, sizeof(struct dump_tap));
+  if (tap == NULL) {
+    return NULL;
+  }
+
+  tap->size = DUMP_TAP_RING_SIZE;
+  tap->ring = malloc(tap->size);
+  if (tap->ring == NULL) {
+    free(tap);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&adev->dump.lock);
+  sequence = ++adev->dump.sequence;
+  pthread_mutex_unlock(&adev->dump.lock);
+
+  snprintf(path, sizeof(path), "%s/%s_%p_%u_%s.raw", DUMP_TAP_DIR, kind,
+           stream, sequence, dump_tap_names[point]);
+  tap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+  if (tap->fd < 0) {
+    ALOGE("Failed to create dump file '%s' (%d)", path, errno);
+    free(tap->ring);
+    free(tap);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&adev->dump.lock);
+  if (!adev->dump.started) {
+    adev->dump.exit = false;
+    if (pthread_create(&adev->dump.thread, NULL,
+                       dump_writer_thread, adev) != 0) {
+      ALOGE("Failed to start dump writer");
+      close(tap->fd);
+      goto fail;
+    }
+    adev->dump.started = true;
+  }
+
+  tap->next = adev->dump.taps;
+  adev->dump.taps = tap;
+  pthread_mutex_unlock(&adev->dump.lock);
+
+  ALOGI("Dumping %s %s of stream %p to '%s'", kind, dump_tap_names[point],
+        stream, path);
+  return tap;
+
+fail:
+  pthread_mutex_unlock(&adev->dump.lock);
+  free(tap->ring);
+  free(tap);
+  return NULL;
+}
+
+/* Returns 0 and a mask of tap points if kvpairs sets the dump taps */
+static int dump_parse_taps(const char *kvpairs, unsigned int *points)
+{
+  struct str_parms *parms = str_parms_create_str(kvpairs);
+  char value[64];
+  char *token = NULL;
+  char *save = NULL;
+  int i = 0;
+  int ret = -ENOENT;
+
+  if (parms == NULL) {
+    return -ENOMEM;
+  }
+
+  if (str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_DUMP_TAPS,
+                        value, sizeof(value)) >= 0) {
+    *points = 0;
+    for (token = strtok_r(value, "|", &save); token != NULL;
+         token = strtok_r(NULL, "|", &save)) {
+      for (i = 0; i < e_tap_count; ++i) {
+        if (strcmp(token, dump_tap_names[i]) == 0) {
+          *points |= 1U << i;
+          break;
+        }
+      }
+      if ((i == e_tap_count) && (strcmp(token, "off") != 0)) {
+        ALOGW("Unknown dump tap '%s'", token);
+      }
+    }
+    ret = 0;
+  }
+
+  str_parms_destroy(parms);
+  return ret;
+}
+
+/* Opens and closes the taps of a stream to match the points mask.
+ * Must be called with the stream mutex locked, so that the audio thread
+ * is not using a tap that is handed back to the writer
+ */
+static void dump_update_taps_l(struct audio_device *adev,
+                               struct dump_tap **taps, unsigned int points,
+                               const void *stream, const char *kind)
+{
+  int i;
+
+  for (i = 0; i < e_tap_count; ++i) {
+    if ((points & (1U << i)) && (taps[i] == NULL)) {
+      taps[i] = dump_tap_open(adev, stream, kind, i);
+    } else if (!(points & (1U << i)) && (taps[i] != NULL)) {
+      /* the writer empties the ring and frees it */
+      pthread_mutex_lock(&adev->dump.lock);
+      taps[i]->closing = true;
+      pthread_cond_signal(&adev->dump.cond);
+      pthread_mutex_unlock(&adev->dump.lock);
+      taps[i] = NULL;
+    }
+  }
+}
+
+static void dump_print_taps(struct dump_tap **taps, int fd)
+{
+  int i;
+
+  for (i = 0; i < e_tap_count; ++i) {
+    if (taps[i] != NULL) {
+      dprintf(fd, "    dump tap %s: dropped bytes: %zu\n", dump_tap_names[i],
+              atomic_load_explicit(&taps[i]->dropped, memory_order_relaxed));
+    }
+  }
+}
+
+/*********************************************************************
+ * Level meters
+ *********************************************************************/
+
+struct meter_block {
+  int peak;
+  uint64_t sum_squares;
+  uint32_t clipped;
+};
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+/* Scans whole vectors of 8 samples, returns the number of samples done */
+static size_t meter_scan_neon(const int16_t *src, size_t count,
+                              struct meter_block *blk)
+{
+  const size_t vectors = count / 8;
+  const int16x8_t full = vdupq_n_s16(INT16_MAX);
+  int16x8_t peak = vdupq_n_s16(0);
+  int64x2_t sum = vdupq_n_s64(0);
+  uint32x4_t clip = vdupq_n_u32(0);
+  int16_t peaks[8];
+  uint32_t clips[4];
+  size_t i = 0;
+
+  for (i = 0; i < vectors; ++i) {
+    const int16x8_t x = vld1q_s16(src);
+    const int16x8_t a = vqabsq_s16(x);
+
+    peak = vmaxq_s16(peak, a);
+    clip = vpadalq_u16(clip, vshrq_n_u16(vceqq_s16(a, full), 15));
+    sum = vpadalq_s32(sum, vmull_s16(vget_low_s16(x), vget_low_s16(x)));
+    sum = vpadalq_s32(sum, vmull_s16(vget_high_s16(x), vget_high_s16(x)));
+    src += 8;
+  }
+
+  vst1q_s16(peaks, peak);
+  vst1q_u32(clips, clip);
+  for (i = 0; i < 8; ++i) {
+    if (peaks[i] > blk->peak) {
+      blk->peak = peaks[i];
+    }
+  }
+  blk->clipped += clips[0] + clips[1] + clips[2] + clips[3];
+  blk->sum_squares += vgetq_lane_s64(sum, 0) + vgetq_lane_s64(sum, 1);
+
+  return vectors * 8;
+}
+#endif
+
+static void meter_scan_scalar(const int16_t *src, size_t count,
+                              struct meter_block *blk)
+{
+  int a = 0;
+
+  while (count--) {
+    a = abs(*src);
+    if (a >= INT16_MAX) {
+      a = INT16_MAX;
+      ++blk->clipped;
+    }
+    if (a > blk->peak) {
+      blk->peak = a;
+    }
+    blk->sum_squares += (int32_t)*src * *src;
+    ++src;
+  }
+}
+
+static float meter_to_db(double level)
+{
+  const float db = 20.0f * log10f(level / 32768.0);
+
+  return (db > METER_FLOOR_DB) ? db : METER_FLOOR_DB;
+}
+
+/* Called by the audio thread only */
+static void meter_publish(struct stream_meter *m)
+{
+  const unsigned int seq = atomic_load_explicit(&m->sequence,
+                                                memory_order_relaxed);
+
+  atomic_store_explicit(&m->sequence, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  m->reading.peak_db = meter_to_db(m->peak);
+  m->reading.rms_db = meter_to_db(sqrt((double)m->sum_squares / m->samples));
+  m->reading.clipped = m->clipped;
+  m->reading.silence_ms = (m->silent_frames * 1000) / m->sample_rate;
+
+  atomic_store_explicit(&m->sequence, seq + 2, memory_order_release);
+
+  m->peak = 0;
+  m->sum_squares = 0;
+  m->samples = 0;
+}
+
+static void meter_read(const struct stream_meter *m, struct meter_reading *r)
+{
+  unsigned int seq = 0;
+
+  do {
+    seq = atomic_load_explicit(&m->sequence, memory_order_acquire);
+    *r = m->reading;
+    atomic_thread_fence(memory_order_acquire);
+  } while ((seq & 1) ||
+           (seq != atomic_load_explicit(&m->sequence, memory_order_relaxed)));
+}
+
+/* Must be called with the stream mutex locked */
+static void meter_process(struct stream_meter *m, const void *buf,
+                          size_t bytes)
+{
+  struct meter_block blk = { 0, 0, 0 };
+  const int16_t *src = (const int16_t *)buf;
+  size_t count = bytes / sizeof(int16_t);
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  const size_t done = meter_scan_neon(src, count, &blk);
+
+  src += done;
+  count -= done;
+#endif
+  meter_scan_scalar(src, count, &blk);
+
+  if (blk.peak > m->peak) {
+    m->peak = blk.peak;
+  }
+  m->sum_squares += blk.sum_squares;
+  m->samples += bytes / sizeof(int16_t);
+  m->clipped += blk.clipped;
+
+  if (blk.peak <= METER_SILENCE_LEVEL) {
+    m->silent_frames += bytes / (sizeof(int16_t) * m->channels);
+  } else {
+    m->silent_frames = 0;
+  }
+
+  if (m->samples >= m->window_samples) {
+    meter_publish(m);
+  }
+}
+
+/* Returns 0 if kvpairs turns the meter on or off */
+static int meter_parse(const char *kvpairs, bool *enable)
+{
+  struct str_parms *parms = str_parms_create_str(kvpairs);
+  char value[8];
+  int ret = -ENOENT;
+
+  if (parms == NULL) {
+    return -ENOMEM;
+  }
+
+  if (str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_METERS,
+                        value, sizeof(value)) >= 0) {
+    *enable = (strcmp(value, "on") == 0);
+    ret = 0;
+  }
+
+  str_parms_destroy(parms);
+  return ret;
+}
+
+static void meter_enable_l(struct stream_meter *m, bool enable,
+                           audio_format_t format, uint32_t sample_rate,
+                           unsigned int channels)
+{
+  if (enable && (format != AUDIO_FORMAT_PCM_16_BIT)) {
+    ALOGW("Meter not supported for format 0x%x", format);
+    enable = false;
+  } else if (enable && ((sample_rate == 0) || (channels == 0))) {
+    ALOGW("Meter needs a known rate and channel count");
+    enable = false;
+  }
+
+  if (enable && !m->enabled) {
+    m->sample_rate = sample_rate;
+    m->channels = channels;
+    m->window_samples = ((uint64_t)sample_rate * channels *
+                         METER_WINDOW_MS) / 1000;
+    m->peak = 0;
+    m->sum_squares = 0;
+    m->samples = 0;
+    m->silent_frames = 0;
+    m->clipped = 0;
+  }
+  m->enabled = enable;
+}
+
+/* Appends "key=value" if key is a meter key. Doesn't need any lock */
+static void meter_get_parameter(const struct stream_meter *m, const char *key,
+                                char *buf, size_t size)
+{
+  struct meter_reading r;
+  char value[32];
+
+  if (strncmp(key, "meter_", 6) != 0) {
+    return;
+  }
+
+  meter_read(m, &r);
+  if (strcmp(key, AUDIO_PARAMETER_METER_PEAK) == 0) {
+    snprintf(value, sizeof(value), "%.1f", r.peak_db);
+  } else if (strcmp(key, AUDIO_PARAMETER_METER_RMS) == 0) {
+    snprintf(value, sizeof(value), "%.1f", r.rms_db);
+  } else if (strcmp(key, AUDIO_PARAMETER_METER_CLIPPED) == 0) {
+    snprintf(value, sizeof(value), "%" PRIu64, r.clipped);
+  } else if (strcmp(key, AUDIO_PARAMETER_METER_SILENCE) == 0) {
+    snprintf(value, sizeof(value), "%u", r.silence_ms);
+  } else {
+    return;
+  }
+
+  if (buf[0] != '\0') {
+    strlcat(buf, ";", size);
+  }
+  strlcat(buf, key, size);
+  strlcat(buf, "=", size);
+  strlcat(buf, value, size);
+}
+
+static void meter_dump(const struct stream_meter *m, int fd)
+{
+  struct meter_reading r;
+
+  if (atomic_load_explicit(&m->sequence, memory_order_relaxed) == 0) {
+    return;
+  }
+
+  meter_read(m, &r);
+  dprintf(fd, "    meter: peak: %.1f dB rms: %.1f dB clipped: %" PRIu64
+          " silence: %u ms\n", r.peak_db, r.rms_db, r.clipped, r.silence_ms);
+}
+
+static int volume_to_percent(float volume)
+{
+  float decibels = 0;
+  float percent = 0;
+
+  /* Converting back to a decibel scale */
+  if(volume > 0) {
+    decibels = log(volume) / 0.115129f;
+  } else {
+    /* Use the maximum attenuation value 58 */
+    decibels = -58;
+  }
+
+  /* decibels range is -58..0, rescale to range 0..100 */
+  percent = ((decibels + 58.0) * (100.0/58.0));
+  return (int)percent;
+}
+
+static int out_set_volume(struct audio_stream_out *stream,
+                          float left, float right)
+{
+  struct stream_out_common *out = (struct stream_out_common *)stream;
+  int l_pc = volume_to_percent(left);
+  int r_pc = volume_to_percent(right);
+
+  ALOGV("out_set_volume (%f,%f) -> (%d%%,%d%%)", left, right, l_pc, r_pc);
+
+  return set_hw_volume(out->hw, l_pc, r_pc);
+}
+
+static int out_add_audio_effect(const struct audio_stream *stream,
+                                effect_handle_t effect)
+{
+  ALOGV("out_add_audio_effect called but not implemented");
+  UNUSED(stream);
+  UNUSED(effect);
+  return 0;
+}
+
+static int out_remove_audio_effect(const struct audio_stream *stream,
+                                   effect_handle_t effect)
+{
+  ALOGV("out_remove_audio_effect called but not implemented");
+  UNUSED(stream);
+  UNUSED(effect);
+  return 0;
+}
+
+static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
+                                        int64_t *timestamp)
+{
+  ALOGV("out_get_next_write_timestamp called but not implemented");
+  *timestamp = 0;
+  UNUSED(stream);
+  return -ENOSYS;
+}
+
+static int out_get_presentation_position(const struct audio_stream_out *stream,
+                                         uint64_t *frames,
+                                         struct timespec *timestamp)
+{
+  struct stream_out_pcm *out = (struct stream_out_pcm *)stream;
+  int ret = -EINVAL;
+
+  lock_output_stream(out);
+
+  /* hw_frames_written counts frames of the stream, but the kernel buffer
+   * of a passthrough stream is in frames of the faster IEC link
+   */
+  const unsigned int rate_mult = (out->iec != NULL) ? out->iec->rate_mult : 1;
+
+  if (out->pcm) {
+    unsigned int avail;
+    if (pcm_get_htimestamp(out->pcm, &avail, timestamp) == 0) {
+      size_t kernel_buffer_size = out->hw_period_size * out->hw_period_count;
+      int64_t presented_frames = out->hw_frames_written -
+                            (int64_t)(kernel_buffer_size - avail) / rate_mult;
+      if (out->keep_alive != NULL) {
+        /* silence still queued is in the buffer but not of the stream */
+        presented_frames += out_keep_alive_unplayed(out,
+                                  presented_frames + out->keep_alive->injected);
+      }
+      if (presented_frames >= 0) {
+        *frames = presented_frames;
+        ret = 0;
+      }
+    }
+  } else {
+    size_t kernel_buffer_size = out->hw_period_size * out->hw_period_count;
+    int64_t presented_frames = out->hw_frames_written -
+                               kernel_buffer_size / rate_mult;
+    if (presented_frames >= 0) {
+      *frames = presented_frames;
+      ret = 0;
+    }
+  }
+
+  pthread_mutex_unlock(&out->common.lock);
+
+  ALOGV("out_get_presentation_position returned %" PRIu64 " frames", *frames);
+
+  return ret;
+}
+
+static void do_close_out_common(struct audio_stream *stream)
+{
+  struct stream_out_common *out = (struct stream_out_common *)stream;
+  release_stream(out->hw);
+  free(stream);
+}
+
+static int do_init_out_common(struct stream_out_common *out,
+                              const struct audio_config *config,
+                              audio_devices_t devices)
+{
+  int ret = 0;
+
+  ALOGV("do_init_out_common rate=%u channels=%x",
+      config->sample_rate,
+      config->channel_mask);
+
+  out->standby = true;
+
+  out->stream.common.get_sample_rate = out_get_sample_rate;
+  out->stream.common.set_sample_rate = out_set_sample_rate;
+  out->stream.common.get_buffer_size = out_get_buffer_size;
+  out->stream.common.get_channels = out_get_channels;
+  out->stream.common.get_format = out_get_format;
+  out->stream.common.set_format = NULL;
+  out->stream.common.standby = NULL;
+  out->stream.common.dump = out_dump;
+  out->stream.common.get_device = NULL;
+  out->stream.common.set_device = NULL;
+  out->stream.common.set_parameters = out_set_parameters;
+  out->stream.common.get_parameters = out_get_parameters;
+  out->stream.common.add_audio_effect = out_add_audio_effect;
+  out->stream.common.remove_audio_effect = out_remove_audio_effect;
+
+  out->stream.get_latency = out_get_latency;
   out->stream.set_volume = out_set_volume;
   out->stream.write = NULL;
   out->stream.get_render_position = NULL;
@@ -581,179 +2753,1555 @@ static int do_init_out_common(struct stream_out_common *out,
   out->stream.get_mmap_position = NULL;
   out->stream.update_source_metadata = NULL;
 
-  /* init requested stream config */
-  out->format = config->format;
-  out->sample_rate = config->sample_rate;
-  out->channel_mask = config->channel_mask;
-  out->channel_count = popcount(out->channel_mask);
+  /* init requested stream config */
+  out->format = config->format;
+  out->sample_rate = config->sample_rate;
+  out->channel_mask = config->channel_mask;
+  out->channel_count = popcount(out->channel_mask);
+
+  /* Default settings */
+  out->frame_size = audio_stream_out_frame_size(&out->stream);
+  ALOGV("frame_size initialize to %zu", out->frame_size);
+
+  /* Apply initial route */
+  apply_route(out->hw, devices);
+
+  return 0;
+}
+
+/*********************************************************************
+ * PCM output stream
+ *********************************************************************/
+
+static unsigned int out_pcm_cfg_period_count(struct stream_out_pcm *out)
+{
+  uint32_t ret = OUT_PERIOD_COUNT_DEFAULT;
+  if (out->common.hw->period_count != 0) {
+    ret = out->common.hw->period_count;
+  }
+  ALOGV("out_pcm_cfg_period_count = %d", ret);
+  return ret;
+}
+
+static unsigned int out_pcm_cfg_period_size(struct stream_out_pcm *out)
+{
+  uint32_t ret = OUT_PERIOD_SIZE_DEFAULT;
+  if (out->common.hw->period_size != 0) {
+    ret = out->common.hw->period_size;
+  }
+  ALOGV("out_pcm_cfg_period_size = %d", ret);
+  return ret;
+}
+
+static unsigned int out_pcm_cfg_rate(struct stream_out_pcm *out)
+{
+  uint32_t ret = OUT_SAMPLE_RATE_DEFAULT;
+  if (out->iec != NULL) {
+    /* The IEC link rate is set by the bitstream */
+    ret = out->common.sample_rate * out->iec->rate_mult;
+  } else if (out->common.hw->rate != 0) {
+    ret = out->common.hw->rate;
+  } else if (out->common.sample_rate) {
+    ret = out->common.sample_rate;
+  }
+  ALOGV("out_pcm_cfg_rate = %d", ret);
+  return ret;
+}
+
+static enum pcm_format out_pcm_cfg_format(struct stream_out_pcm *out)
+{
+  enum pcm_format ret = PCM_FORMAT_S16_LE;
+
+  /* A stream probed from hardware runs at its native format, which
+   * has been negotiated with AudioFlinger when the stream was opened
+   */
+  if (out->iec != NULL) {
+    ret = PCM_FORMAT_S16_LE;
+  } else if (out->common.hw->format != AUDIO_FORMAT_DEFAULT) {
+    ret = pcm_format_from_audio_format(out->common.format);
+  } else {
+#ifdef TEST_32BITS
+    ret = PCM_FORMAT_S32_LE;
+#endif
+  }
+  ALOGV("out_pcm_cfg_format = %d", ret);
+  return ret;
+}
+
+static unsigned int out_pcm_cfg_channel_count(struct stream_out_pcm *out)
+{
+  uint32_t ret = OUT_CHANNEL_COUNT_DEFAULT;
+  if (out->iec != NULL) {
+    ret = 2;  /* IEC 61937 is always carried on a stereo link */
+  } else if (out->common.channel_count != 0) {
+    ret = out->common.channel_count;
+  }
+  ALOGV("out_pcm_cfg_channel_count = %d", ret);
+  return ret;
+}
+
+/* must be called with hw device and output stream mutexes locked */
+static void do_out_pcm_standby(struct stream_out_pcm *out)
+{
+  struct audio_device *adev = out->common.dev;
+
+  ALOGV("+do_out_pcm_standby(%p)", out);
+
+  if ((!out->common.standby) && (out->pcm)){
+    /* Staged frames were accepted from the client, hand them to the PCM
+     * along with the rest of what it has queued
+     */
+    if ((out->stage != NULL) && !adev->disable_audio) {
+      out_stage_flush(out);
+    }
+
+    pthread_mutex_lock(&adev->lock);
+    out->common.standby = true;
+    pcm_close(out->pcm);
+    out->pcm = NULL;
+    pthread_mutex_unlock(&adev->lock);
+  }
+
+  if (out->stage != NULL) {
+    out->stage->frames = 0;
+    out->stage->deadline_ns = 0;
+  }
+
+  /* Stopped streams are silent, complete a route change without fades */
+  if (out->fade.state == e_route_fade_out) {
+    apply_route(out->common.hw, out->fade.devices);
+  } else if (out->fade.state == e_route_wait) {
+    settle_route(out->common.hw);
+  }
+  out->fade.state = e_route_idle;
+  out->fade.level = out->fade.frames;
+
+  if (out->iec != NULL) {
+    /* a partial frame or burst is dropped, resync on the next write */
+    out->iec->frame_len = 0;
+    out->iec->frame_size = 0;
+    out->iec->payload_len = 0;
+    out->iec->burst_samples = 0;
+  }
+  ALOGV("-do_out_pcm_standby(%p)", out);
+}
+
+static void out_pcm_fill_params(struct stream_out_pcm *out,
+                                const struct pcm_config *config,
+                                bool disable_audio)
+{
+  out->hw_sample_rate = config->rate;
+  out->hw_channel_count = config->channels;
+  out->hw_period_size = config->period_size;
+  out->hw_period_count = config->period_count;
+
+  if (out->stage != NULL) {
+    out->stage->capacity = out_stage_burst(config);
+  }
+
+  if (! disable_audio) {
+    out->common.buffer_size = pcm_frames_to_bytes(out->pcm, config->period_size);
+  } else {
+#ifdef TEST_32BITS
+  out->common.buffer_size = config->period_size * config->channels * (32 >> 3);
+#else
+  out->common.buffer_size = config->period_size * config->channels * (16 >> 3);
+#endif
+  }
+  if (out->iec != NULL) {
+    /* AudioFlinger writes bitstream, one burst is a natural chunk */
+    out->common.buffer_size = out->iec->burst_words * sizeof(uint16_t);
+  }
+  out_update_latency(out);
+}
+
+/* must be called with hw device and output stream mutexes locked */
+static int start_output_pcm(struct stream_out_pcm *out)
+{
+  struct audio_device *adev = out->common.dev;
+  int ret = 0;
+
+  struct pcm_config config = {
+    .channels = out_pcm_cfg_channel_count(out),
+    .rate = out_pcm_cfg_rate(out),
+    .period_size = out_pcm_cfg_period_size(out),
+    .period_count = out_pcm_cfg_period_count(out),
+    .format = out_pcm_cfg_format(out),
+    .start_threshold = 0,
+    .stop_threshold = 0,
+    .silence_threshold = 0
+  };
+
+  ALOGV("+start_output_pcm(%p)", out);
+
+  /* Wake up for a whole burst of a deep buffer stream */
+  if (out->stage != NULL) {
+    config.avail_min = out_stage_burst(&config);
+  }
+
+  ALOGV("Requested configuration : channels %d, rate %d, format %d",
+      config.channels, config.rate, pcm_format_to_bits(config.format));
+
+  ALOGV("Extended configuration : period_size %d, period_count %d, "
+        "start_threshold=%d", config.period_size, config.period_count,
+        config.start_threshold);
+
+  if (!adev->disable_audio) {
+
+    /* Write PCM data into the DMA buffer unless it is a bitstream, whose
+     * bursts are written whole. Not every driver can be mapped
+     */
+    out->mmap = (out->iec == NULL);
+    out->mmap_started = false;
+    if (out->mmap) {
+      out->pcm = pcm_open(out->common.hw->card_number,
+                          out->common.hw->device_number,
+                          PCM_OUT | PCM_MONOTONIC | PCM_MMAP, &config);
+      if (out->pcm && !pcm_is_ready(out->pcm)) {
+        ALOGW("pcm_open(out) mmap failed, using writes: %s",
+              pcm_get_error(out->pcm));
+        pcm_close(out->pcm);
+        out->pcm = NULL;
+        out->mmap = false;
+      }
+    }
+
+    if (!out->mmap) {
+      out->pcm = pcm_open(out->common.hw->card_number,
+                          out->common.hw->device_number,
+                          PCM_OUT | PCM_MONOTONIC, &config);
+    }
+
+    if (out->pcm && !pcm_is_ready(out->pcm)) {
+      ALOGE("pcm_open(out) failed: %s", pcm_get_error(out->pcm));
+      pcm_close(out->pcm);
+      return -ENOMEM;
+    }
+
+    /* The stream may have been rerouted to or from HDMI since it last
+     * started, the channel map follows the current route
+     */
+    if ((out->common.channel_count > 2) && (out->iec == NULL) &&
+        (get_routed_devices(out->common.hw) & AUDIO_DEVICE_OUT_HDMI)) {
+      if ((out->chmap == NULL) && (out_chmap_init(out) != 0)) {
+        ALOGW("No memory for HDMI channel map, channels not reordered");
+      }
+      if (out->chmap != NULL) {
+        out_chmap_setup(out);
+      }
+    } else if (out->chmap != NULL) {
+      out->chmap->identity = true;
+    }
+
+#ifdef TEST_32BITS
+    pcm_pipe_build(&out->pipe, AUDIO_FORMAT_PCM_16_BIT, config.channels,
+                   AUDIO_FORMAT_PCM_32_BIT, config.channels,
+                   ((out->chmap != NULL) && !out->chmap->identity) ?
+                   out->chmap->reorder : NULL, 0);
+#endif
+  }
+
+#ifdef TEST_32BITS
+  // Hide 16 to 32bits conversion
+  if ((out->common.hw->format == AUDIO_FORMAT_DEFAULT) && (out->iec == NULL)) {
+    config.format = PCM_FORMAT_S16_LE;
+  }
+#endif
+
+  out_pcm_fill_params(out, &config, adev->disable_audio);
+
+  ALOGV("-start_output_pcm(%p)", out);
+  return 0;
+}
+
+static int out_pcm_standby(struct audio_stream *stream)
+{
+  struct stream_out_pcm *out = (struct stream_out_pcm *)stream;
+
+  lock_output_stream(out);
+  do_out_pcm_standby(out);
+  pthread_mutex_unlock(&out->common.lock);
+
+  return 0;
+}
+
+/*********************************************************************
+ * IEC 61937 passthrough
+ *********************************************************************/
+
+/* AC3 bitrates in kbps, indexed by frmsizecod / 2 */
+static const uint16_t ac3_bitrates[] = {
+  32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448,
+  512, 576, 640
+};
+
+static bool iec61937_is_supported(audio_format_t format)
+{
+  switch (format & AUDIO_FORMAT_MAIN_MASK) {
+    case AUDIO_FORMAT_AC3:
+    case AUDIO_FORMAT_E_AC3:
+    case AUDIO_FORMAT_DTS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/*
+ * Parse the header of the frame at the start of iec->frame. Returns the
+ * frame size in bytes, 0 if there is no valid sync word there, or -EAGAIN
+ * if more data is needed
+ */
+static int iec61937_parse_header(struct out_iec61937 *iec)
+{
+  const uint8_t *p = iec->frame;
+  unsigned int fscod = 0;
+  unsigned int frmsizecod = 0;
+  unsigned int words = 0;
+  unsigned int nblks = 0;
+  unsigned int fsize = 0;
+
+  if (iec->frame_len < 8) {
+    return -EAGAIN;
+  }
+
+  switch (iec->format & AUDIO_FORMAT_MAIN_MASK) {
+    case AUDIO_FORMAT_AC3:
+    case AUDIO_FORMAT_E_AC3:
+      if ((p[0] != 0x0B) || (p[1] != 0x77)) {
+        return 0;
+      }
+
+      iec->frame_swapped = false;
+      if ((p[5] >> 3) > 10) {
+        /* E-AC3: frame size is given directly, samples by block count */
+        static const unsigned int eac3_blocks[] = { 1, 2, 3, 6 };
+
+        if (iec->format != AUDIO_FORMAT_E_AC3) {
+          return 0;
+        }
+        words = (((p[2] & 0x07) << 8) | p[3]) + 1;
+        fscod = p[4] >> 6;
+        /* dependent substreams belong to the preceding independent frame */
+        if (((p[2] >> 6) & 0x3) == 1) {
+          iec->frame_samples = 0;
+        } else {
+          iec->frame_samples = 256 * ((fscod == 3) ? 6 :
+                                      eac3_blocks[(p[4] >> 4) & 0x3]);
+        }
+      } else {
+        fscod = p[4] >> 6;
+        frmsizecod = p[4] & 0x3F;
+        if ((fscod == 3) || ((frmsizecod / 2) >= ARRAY_SIZE(ac3_bitrates))) {
+          return 0;
+        }
+
+        switch (fscod) {
+          case 0:   /* 48kHz */
+            words = 2 * ac3_bitrates[frmsizecod / 2];
+            break;
+          case 1:   /* 44.1kHz */
+            words = ((320 * ac3_bitrates[frmsizecod / 2]) / 147)
+                    + (frmsizecod & 1);
+            break;
+          default:  /* 32kHz */
+            words = 3 * ac3_bitrates[frmsizecod / 2];
+            break;
+        }
+        iec->frame_samples = 1536;
+        iec->burst_info = IEC61937_TYPE_AC3 | ((p[5] & 0x7) << 8); /* bsmod */
+      }
+      return words * 2;
+
+    case AUDIO_FORMAT_DTS:
+      if ((p[0] == 0x7F) && (p[1] == 0xFE) && (p[2] == 0x80) && (p[3] == 0x01)) {
+        iec->frame_swapped = false;
+        nblks = ((p[4] & 0x01) << 6) | (p[5] >> 2);
+        fsize = ((p[5] & 0x03) << 12) | (p[6] << 4) | (p[7] >> 4);
+      } else if ((p[0] == 0xFE) && (p[1] == 0x7F) && (p[2] == 0x01)
+                 && (p[3] == 0x80)) {
+        /* same header in 16-bit little-endian words */
+        iec->frame_swapped = true;
+        nblks = ((p[5] & 0x01) << 6) | (p[4] >> 2);
+        fsize = ((p[4] & 0x03) << 12) | (p[7] << 4) | (p[6] >> 4);
+      } else {
+        /* 14-bit DTS is not supported */
+        return 0;
+      }
+
+      iec->frame_samples = (nblks + 1) * 32;
+      switch (iec->frame_samples) {
+        case 512:
+          iec->burst_info = IEC61937_TYPE_DTS1;
+          break;
+        case 1024:
+          iec->burst_info = IEC61937_TYPE_DTS2;
+          break;
+        case 2048:
+          iec->burst_info = IEC61937_TYPE_DTS3;
+          break;
+        default:
+          return 0;
+      }
+      return fsize + 1;
+
+    default:
+      return 0;
+  }
+}
+
+/* Size of the repetition period of a burst of @samples, in 16-bit words */
+static size_t iec61937_period_words(const struct out_iec61937 *iec,
+                                    unsigned int samples)
+{
+  switch (iec->format & AUDIO_FORMAT_MAIN_MASK) {
+    case AUDIO_FORMAT_E_AC3:
+      return IEC61937_EAC3_PERIOD * 2;
+    case AUDIO_FORMAT_DTS:
+      return samples * 2;
+    default:
+      return IEC61937_AC3_PERIOD * 2;
+  }
+}
+
+/* Append the complete frame in iec->frame to the burst payload */
+static int iec61937_add_frame(struct out_iec61937 *iec)
+{
+  uint16_t *dst = iec->burst + IEC61937_PREAMBLE_WORDS;
+  const uint8_t *src = iec->frame;
+  size_t period_words;
+  size_t offset = iec->payload_len;
+  size_t len = iec->frame_size;
+
+  /* The payload must fit in the repetition period of the burst it ends
+   * up in, which for DTS depends on the samples it will carry.
+   */
+  period_words = iec61937_period_words(iec,
+                                       iec->burst_samples + iec->frame_samples);
+  if ((period_words > iec->burst_words)
+      || (period_words < IEC61937_PREAMBLE_WORDS)
+      || ((offset + len) > (period_words - IEC61937_PREAMBLE_WORDS) * 2)) {
+    ALOGE("IEC61937 frame of %zu bytes does not fit in burst", len);
+    return -EINVAL;
+  }
+
+  /* The payload is sent as 16-bit words, most significant byte first in
+   * the bitstream. Odd offsets only happen after an odd-sized frame which
+   * the bitstreams we handle do not have.
+   */
+  dst += offset / 2;
+  for (; len >= 2; len -= 2, src += 2) {
+    if (iec->frame_swapped) {
+      *dst++ = src[0] | (src[1] << 8);
+    } else {
+      *dst++ = (src[0] << 8) | src[1];
+    }
+  }
+  if (len != 0) {
+    *dst = iec->frame_swapped ? src[0] : (src[0] << 8);
+  }
+
+  iec->payload_len += iec->frame_size;
+  iec->burst_samples += iec->frame_samples;
+  return 0;
+}
+
+static bool iec61937_burst_complete(const struct out_iec61937 *iec)
+{
+  if (iec->format == AUDIO_FORMAT_E_AC3) {
+    /* an E-AC3 burst carries 6 blocks of 256 samples */
+    return iec->burst_samples >= IEC61937_EAC3_BURST_SAMPLES;
+  }
+  return iec->burst_samples != 0;
+}
+
+static int iec61937_write_burst(struct stream_out_pcm *out)
+{
+  struct out_iec61937 *iec = out->iec;
+  const size_t period_words = iec61937_period_words(iec, iec->burst_samples);
+  const unsigned int samples = iec->burst_samples;
+  int ret = 0;
+
+  iec->burst[0] = IEC61937_PA;
+  iec->burst[1] = IEC61937_PB;
+  if (iec->format == AUDIO_FORMAT_E_AC3) {
+    iec->burst[2] = IEC61937_TYPE_EAC3;
+    iec->burst[3] = iec->payload_len;          /* in bytes */
+  } else {
+    iec->burst[2] = iec->burst_info;
+    iec->burst[3] = iec->payload_len * 8;      /* in bits */
+  }
+
+  /* stuff the rest of the repetition period with zeros */
+  memset(iec->burst + IEC61937_PREAMBLE_WORDS + ((iec->payload_len + 1) / 2),
+         0, (period_words - IEC61937_PREAMBLE_WORDS
+             - ((iec->payload_len + 1) / 2)) * sizeof(uint16_t));
+
+  iec->payload_len = 0;
+  iec->burst_samples = 0;
+
+  if (!out->common.dev->disable_audio) {
+    ret = pcm_write(out->pcm, iec->burst, period_words * sizeof(uint16_t));
+    if (ret < 0) {
+      ALOGE("IEC61937 burst write failed: %s", pcm_get_error(out->pcm));
+      return ret;
+    }
+  }
+
+  out->hw_frames_written += samples;
+  out->hw_frames_rendered += samples;
+  return 0;
+}
+
+/*
+ * Consume a chunk of bitstream. Complete frames are packed into bursts
+ * that are written to the pcm as they complete.
+ */
+static ssize_t out_iec61937_write(struct stream_out_pcm *out,
+                                  const void *buffer, size_t bytes)
+{
+  struct out_iec61937 *iec = out->iec;
+  const uint8_t *src = buffer;
+  size_t remaining = bytes;
+  size_t n = 0;
+  int size = 0;
+  int ret = 0;
+
+  while (remaining > 0) {
+    if (iec->frame_size == 0) {
+      /* hunting for sync, take just enough to parse a header */
+      n = 8 - iec->frame_len;
+    } else {
+      n = iec->frame_size - iec->frame_len;
+    }
+    n = (n < remaining) ? n : remaining;
+    memcpy(iec->frame + iec->frame_len, src, n);
+    iec->frame_len += n;
+    src += n;
+    remaining -= n;
+
+    if (iec->frame_size == 0) {
+      size = iec61937_parse_header(iec);
+      if (size == -EAGAIN) {
+        continue;
+      } else if ((size <= 0) || (size > IEC61937_MAX_FRAME_SIZE)) {
+        /* no sync here, slide along by one byte */
+        memmove(iec->frame, iec->frame + 1, --iec->frame_len);
+        continue;
+      }
+      iec->frame_size = size;
+    }
+
+    if (iec->frame_len < iec->frame_size) {
+      continue;
+    }
+
+    ret = iec61937_add_frame(iec);
+    iec->frame_len = 0;
+    iec->frame_size = 0;
+
+    if ((ret == 0) && iec61937_burst_complete(iec)) {
+      ret = iec61937_write_burst(out);
+    }
+
+    if (ret < 0) {
+      /* drop the burst and resync on the next frame */
+      iec->payload_len = 0;
+      iec->burst_samples = 0;
+      if (ret != -EINVAL) {
+        return ret;
+      }
+      ret = 0;
+    }
+  }
+
+  return bytes;
+}
+
+static int out_iec61937_init(struct stream_out_pcm *out, audio_format_t format)
+{
+  struct out_iec61937 *iec = calloc(1, sizeof(struct out_iec61937));
+
+  if (iec == NULL) {
+    return -ENOMEM;
+  }
+
+  iec->format = format & AUDIO_FORMAT_MAIN_MASK;
+  switch (iec->format) {
+    case AUDIO_FORMAT_E_AC3:
+      /* E-AC3 is carried at 4x the audio rate */
+      iec->rate_mult = 4;
+      iec->burst_words = IEC61937_EAC3_PERIOD * 2;
+      break;
+    case AUDIO_FORMAT_DTS:
+      iec->rate_mult = 1;
+      iec->burst_words = IEC61937_DTS_MAX_PERIOD * 2;
+      break;
+    default:
+      iec->rate_mult = 1;
+      iec->burst_words = IEC61937_AC3_PERIOD * 2;
+      break;
+  }
+
+  iec->burst = calloc(iec->burst_words, sizeof(uint16_t));
+  if (iec->burst == NULL) {
+    free(iec);
+    return -ENOMEM;
+  }
+
+  out->iec = iec;
+  out->common.buffer_size = iec->burst_words * sizeof(uint16_t);
+
+  /* let the config switch the link to non-audio mode */
+  apply_use_case(out->common.hw, "passthrough", "on");
+
+  ALOGV("IEC61937 passthrough format=0x%x rate_mult=%u", iec->format,
+            iec->rate_mult);
+  return 0;
+}
+
+static void out_iec61937_free(struct stream_out_pcm *out)
+{
+  if (out->iec != NULL) {
+    apply_use_case(out->common.hw, "passthrough", "off");
+    free(out->iec->burst);
+    free(out->iec);
+    out->iec = NULL;
+  }
+}
+
+/*********************************************************************
+ * HDMI channel mapping
+ *********************************************************************/
+
+/* CEA-861 speaker allocation bits in the ELD */
+#define ELD_SPK_FL_FR   0x01
+#define ELD_SPK_LFE     0x02
+#define ELD_SPK_FC      0x04
+#define ELD_SPK_RL_RR   0x08
+#define ELD_SPK_RC      0x10
+#define ELD_SPK_FLC_FRC 0x20
+#define ELD_SPK_RLC_RRC 0x40
+
+#define ELD_SPK_ALLOC   7
+#define ELD_MNL         4
+#define ELD_SAD_COUNT   5
+#define ELD_BASELINE    20
+#define ELD_SAD_LPCM    1
+
+/* Layouts offered to AudioFlinger, in order of preference */
+static const audio_channel_mask_t hdmi_channel_masks[HDMI_MAX_LAYOUTS] = {
+  AUDIO_CHANNEL_OUT_7POINT1,
+  AUDIO_CHANNEL_OUT_5POINT1,
+  AUDIO_CHANNEL_OUT_QUAD,
+  AUDIO_CHANNEL_OUT_STEREO,
+};
+
+/*
+ * CEA-861 names the surround pair "rear" and the back pair "rear center".
+ * Android back channels are the surround pair unless side channels are
+ * also present.
+ */
+static unsigned int chmap_position(audio_channel_mask_t mask,
+                                   audio_channel_mask_t bit)
+{
+  const bool has_sides = (mask & AUDIO_CHANNEL_OUT_SIDE_LEFT) != 0;
+
+  switch (bit) {
+    case AUDIO_CHANNEL_OUT_FRONT_LEFT:
+      return SNDRV_CHMAP_FL;
+    case AUDIO_CHANNEL_OUT_FRONT_RIGHT:
+      return SNDRV_CHMAP_FR;
+    case AUDIO_CHANNEL_OUT_FRONT_CENTER:
+      return SNDRV_CHMAP_FC;
+    case AUDIO_CHANNEL_OUT_LOW_FREQUENCY:
+      return SNDRV_CHMAP_LFE;
+    case AUDIO_CHANNEL_OUT_BACK_LEFT:
+      return has_sides ? SNDRV_CHMAP_RLC : SNDRV_CHMAP_RL;
+    case AUDIO_CHANNEL_OUT_BACK_RIGHT:
+      return has_sides ? SNDRV_CHMAP_RRC : SNDRV_CHMAP_RR;
+    case AUDIO_CHANNEL_OUT_FRONT_LEFT_OF_CENTER:
+      return SNDRV_CHMAP_FLC;
+    case AUDIO_CHANNEL_OUT_FRONT_RIGHT_OF_CENTER:
+      return SNDRV_CHMAP_FRC;
+    case AUDIO_CHANNEL_OUT_BACK_CENTER:
+      return SNDRV_CHMAP_RC;
+    case AUDIO_CHANNEL_OUT_SIDE_LEFT:
+      return SNDRV_CHMAP_RL;
+    case AUDIO_CHANNEL_OUT_SIDE_RIGHT:
+      return SNDRV_CHMAP_RR;
+    default:
+      return SNDRV_CHMAP_UNKNOWN;
+  }
+}
+
+static uint8_t chmap_speaker_bit(unsigned int position)
+{
+  switch (position) {
+    case SNDRV_CHMAP_FL:
+    case SNDRV_CHMAP_FR:
+      return ELD_SPK_FL_FR;
+    case SNDRV_CHMAP_LFE:
+      return ELD_SPK_LFE;
+    case SNDRV_CHMAP_FC:
+      return ELD_SPK_FC;
+    case SNDRV_CHMAP_RL:
+    case SNDRV_CHMAP_RR:
+      return ELD_SPK_RL_RR;
+    case SNDRV_CHMAP_RC:
+      return ELD_SPK_RC;
+    case SNDRV_CHMAP_FLC:
+    case SNDRV_CHMAP_FRC:
+      return ELD_SPK_FLC_FRC;
+    case SNDRV_CHMAP_RLC:
+    case SNDRV_CHMAP_RRC:
+      return ELD_SPK_RLC_RRC;
+    default:
+      return 0;
+  }
+}
+
+/* Fill positions with the layout of mask, returns the channel count */
+static unsigned int chmap_from_mask(audio_channel_mask_t mask,
+                                    unsigned int *positions)
+{
+  unsigned int n = 0;
+  audio_channel_mask_t bit = 0;
+
+  for (bit = 1; (bit != 0) && (n < HDMI_MAX_CHANNELS); bit <<= 1) {
+    if (mask & bit) {
+      positions[n++] = chmap_position(mask, bit);
+    }
+  }
+  return n;
+}
+
+/*
+ * Get the layouts the sink connected to stream hw can play.
+ * Returns the number of masks, or a negative error if the sink is
+ * unknown
+ */
+static int hdmi_get_sink_masks(const struct hw_stream *hw,
+                               audio_channel_mask_t *masks, size_t max)
+{
+  uint8_t eld[HDMI_ELD_MAX_SIZE];
+  unsigned int positions[HDMI_MAX_CHANNELS];
+  unsigned int max_channels = 2;
+  unsigned int sad_count = 0;
+  unsigned int channels = 0;
+  const uint8_t *sad = NULL;
+  size_t n = 0;
+  size_t i = 0;
+  unsigned int c = 0;
+  int len = get_hw_eld(hw, eld, sizeof(eld));
+
+  if (len < ELD_BASELINE) {
+    return (len < 0) ? len : -ENODEV;
+  }
+
+  /* The SADs follow the monitor name in the baseline block */
+  sad = eld + ELD_BASELINE + (eld[ELD_MNL] & 0x1F);
+  sad_count = eld[ELD_SAD_COUNT] >> 4;
+  for (i = 0; (i < sad_count) && ((sad + 3) <= (eld + len)); ++i, sad += 3) {
+    if (((sad[0] >> 3) & 0xF) == ELD_SAD_LPCM) {
+      channels = (sad[0] & 0x7) + 1;
+      if (channels > max_channels) {
+        max_channels = channels;
+      }
+    }
+  }
+
+  for (i = 0; (i < ARRAY_SIZE(hdmi_channel_masks)) && (n < max); ++i) {
+    channels = chmap_from_mask(hdmi_channel_masks[i], positions);
+    if (channels > max_channels) {
+      continue;
+    }
+
+    for (c = 0; c < channels; ++c) {
+      if ((chmap_speaker_bit(positions[c]) & eld[ELD_SPK_ALLOC]) == 0) {
+        break;
+      }
+    }
+
+    /* Stereo is always playable, sinks may not set any allocation bits */
+    if ((c == channels) || (hdmi_channel_masks[i] == AUDIO_CHANNEL_OUT_STEREO)) {
+      masks[n++] = hdmi_channel_masks[i];
+    }
+  }
+
+  ALOGV("HDMI sink: speakers=0x%x max channels=%u, %zu layouts",
+        eld[ELD_SPK_ALLOC], max_channels, n);
+  return (int)n;
+}
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static void chmap_shuffle_neon(const struct out_chmap *chmap,
+                               const uint8_t *src, uint8_t *dst,
+                               size_t blocks)
+{
+  const size_t block_size = chmap->block_size;
+  const unsigned int regs = block_size / 16;
+
+#if defined(__aarch64__)
+  uint8x16_t idx[3];
+  uint8x16x3_t tbl;
+  unsigned int r = 0;
+
+  for (r = 0; r < regs; ++r) {
+    idx[r] = vld1q_u8(chmap->shuffle + (16 * r));
+  }
+
+  for (; blocks > 0; --blocks, src += block_size, dst += block_size) {
+    switch (regs) {
+      case 1:
+        tbl.val[0] = vld1q_u8(src);
+        vst1q_u8(dst, vqtbl1q_u8(tbl.val[0], idx[0]));
+        break;
+      case 2: {
+        uint8x16x2_t t2 = { { vld1q_u8(src), vld1q_u8(src + 16) } };
+        vst1q_u8(dst, vqtbl2q_u8(t2, idx[0]));
+        vst1q_u8(dst + 16, vqtbl2q_u8(t2, idx[1]));
+        break;
+      }
+      default:
+        tbl.val[0] = vld1q_u8(src);
+        tbl.val[1] = vld1q_u8(src + 16);
+        tbl.val[2] = vld1q_u8(src + 32);
+        vst1q_u8(dst, vqtbl3q_u8(tbl, idx[0]));
+        vst1q_u8(dst + 16, vqtbl3q_u8(tbl, idx[1]));
+        vst1q_u8(dst + 32, vqtbl3q_u8(tbl, idx[2]));
+        break;
+    }
+  }
+#else
+  /* ARMv7 looks up at most 32 bytes at once, the last 16 bytes of a
+   * 48-byte block come from a second lookup that leaves out-of-range
+   * lanes untouched
+   */
+  const uint8x8_t hi_base = vdup_n_u8(32);
+  uint8x8_t idx[6];
+  uint8x8x4_t lo;
+  uint8x8x2_t hi;
+  uint8x8_t v;
+  unsigned int d = 0;
+
+  for (d = 0; d < (regs * 2); ++d) {
+    idx[d] = vld1_u8(chmap->shuffle + (8 * d));
+  }
+  lo.val[2] = lo.val[3] = hi.val[0] = hi.val[1] = vdup_n_u8(0);
+
+  for (; blocks > 0; --blocks, src += block_size, dst += block_size) {
+    lo.val[0] = vld1_u8(src);
+    lo.val[1] = vld1_u8(src + 8);
+    if (regs > 1) {
+      lo.val[2] = vld1_u8(src + 16);
+      lo.val[3] = vld1_u8(src + 24);
+    }
+    if (regs > 2) {
+      hi.val[0] = vld1_u8(src + 32);
+      hi.val[1] = vld1_u8(src + 40);
+    }
+
+    for (d = 0; d < (regs * 2); ++d) {
+      v = vtbl4_u8(lo, idx[d]);
+      if (regs > 2) {
+        v = vtbx2_u8(v, hi, vsub_u8(idx[d], hi_base));
+      }
+      vst1_u8(dst + (8 * d), v);
+    }
+  }
+#endif
+}
+#endif
+
+static void chmap_shuffle_scalar(const struct out_chmap *chmap,
+                                 const uint8_t *src, uint8_t *dst,
+                                 size_t frames)
+{
+  const unsigned int channels = chmap->channels;
+  unsigned int c = 0;
+  int from = 0;
+
+  switch (chmap->sample_size) {
+    case 2: {
+      const int16_t *s16 = (const int16_t *)src;
+      int16_t *d16 = (int16_t *)dst;
+      for (; frames > 0; --frames, s16 += channels) {
+        for (c = 0; c < channels; ++c) {
+          from = chmap->reorder[c];
+          *d16++ = (from < 0) ? 0 : s16[from];
+        }
+      }
+      break;
+    }
+    case 4: {
+      const int32_t *s32 = (const int32_t *)src;
+      int32_t *d32 = (int32_t *)dst;
+      for (; frames > 0; --frames, s32 += channels) {
+        for (c = 0; c < channels; ++c) {
+          from = chmap->reorder[c];
+          *d32++ = (from < 0) ? 0 : s32[from];
+        }
+      }
+      break;
+    }
+    default:
+      for (; frames > 0; --frames, src += chmap->frame_size) {
+        for (c = 0; c < channels; ++c, dst += chmap->sample_size) {
+          from = chmap->reorder[c];
+          if (from < 0) {
+            memset(dst, 0, chmap->sample_size);
+          } else {
+            memcpy(dst, src + (from * chmap->sample_size), chmap->sample_size);
+          }
+        }
+      }
+      break;
+  }
+}
+
+/*
+ * Work out the reorder from the layout of the AudioFlinger data to the
+ * layout of the link. Must be called with the pcm opened but not yet
+ * started because the channel map control is only writable then.
+ */
+static void out_chmap_setup(struct stream_out_pcm *out)
+{
+  /* Default slot order of the CEA-861 allocations ALSA drivers use */
+  static const unsigned int cea_order[HDMI_MAX_CHANNELS] = {
+    SNDRV_CHMAP_FL, SNDRV_CHMAP_FR, SNDRV_CHMAP_LFE, SNDRV_CHMAP_FC,
+    SNDRV_CHMAP_RL, SNDRV_CHMAP_RR, SNDRV_CHMAP_RLC, SNDRV_CHMAP_RRC
+  };
+  struct out_chmap *chmap = out->chmap;
+  unsigned int slots[HDMI_MAX_CHANNELS];
+  unsigned int used = 0;
+  unsigned int i = 0;
+  unsigned int c = 0;
+  size_t k = 0;
+  size_t b = 0;
+  int ret = 0;
+
+  chmap->identity = true;
+  for (i = 0; i < chmap->channels; ++i) {
+    chmap->reorder[i] = i;
+  }
+
+  /* If the driver takes our layout it does the reordering itself */
+  ret = set_hw_channel_map(out->common.hw, chmap->positions, chmap->channels);
+  if (ret == 0) {
+    ALOGV("HDMI channel map set by driver");
+    return;
+  }
+
+  /* Otherwise follow the layout the driver chose for the channel count */
+  ret = get_hw_channel_map(out->common.hw, slots, chmap->channels);
+  if ((ret < (int)chmap->channels) || (slots[0] == SNDRV_CHMAP_UNKNOWN)) {
+    for (i = 0, c = 0; i < ARRAY_SIZE(cea_order); ++i) {
+      for (k = 0; k < chmap->channels; ++k) {
+        if (chmap->positions[k] == cea_order[i]) {
+          slots[c++] = cea_order[i];
+        }
+      }
+    }
+    /* anything CEA order doesn't cover goes last in AudioFlinger order */
+    for (k = 0; (k < chmap->channels) && (c < chmap->channels); ++k) {
+      for (i = 0; (i < ARRAY_SIZE(cea_order)) &&
+                  (chmap->positions[k] != cea_order[i]); ++i) {
+      }
+      if (i == ARRAY_SIZE(cea_order)) {
+        slots[c++] = chmap->positions[k];
+      }
+    }
+  }
+
+  for (i = 0; i < chmap->channels; ++i) {
+    chmap->reorder[i] = -1;
+    for (c = 0; c < chmap->channels; ++c) {
+      if (((used & (1u << c)) == 0) && (chmap->positions[c] == slots[i])) {
+        chmap->reorder[i] = c;
+        used |= 1u << c;
+        break;
+      }
+    }
+    if (chmap->reorder[i] != (int)i) {
+      chmap->identity = false;
+    }
+  }
+
+  /* Build the byte shuffle for the smallest block of frames that is a
+   * whole number of 16-byte vectors
+   */
+  chmap->block_size = 0;
+  for (k = 1; (k * chmap->frame_size) <= CHMAP_MAX_BLOCK; ++k) {
+    if (((k * chmap->frame_size) % 16) == 0) {
+      chmap->block_size = k * chmap->frame_size;
+      break;
+    }
+  }
+  for (b = 0; b < chmap->block_size; ++b) {
+    const size_t frame = b / chmap->frame_size;
+    const size_t slot = (b % chmap->frame_size) / chmap->sample_size;
+    const size_t byte = b % chmap->sample_size;
+
+    if (chmap->reorder[slot] < 0) {
+      chmap->shuffle[b] = 0xFF;   /* out of range, reads as zero */
+    } else {
+      chmap->shuffle[b] = (frame * chmap->frame_size)
+                          + (chmap->reorder[slot] * chmap->sample_size) + byte;
+    }
+  }
+
+  ALOGV("HDMI channel map %s, block %zu", chmap->identity ? "identity" :
+            "reordered", chmap->block_size);
+}
+
+/* Returns the reordered copy of buffer, or NULL on error */
+static void chmap_shuffle(const struct out_chmap *chmap,
+                          const uint8_t *src, uint8_t *dst, size_t frames)
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  if (chmap->block_size != 0) {
+    const size_t frames_per_block = chmap->block_size / chmap->frame_size;
+    const size_t blocks = frames / frames_per_block;
+
+    chmap_shuffle_neon(chmap, src, dst, blocks);
+    src += blocks * chmap->block_size;
+    dst += blocks * chmap->block_size;
+    frames -= blocks * frames_per_block;
+  }
+#endif
 
-  /* Default settings */
-  out->frame_size = audio_stream_out_frame_size(&out->stream);
-  ALOGV("frame_size initialize to %zu", out->frame_size);
+  chmap_shuffle_scalar(chmap, src, dst, frames);
+}
 
-  /* Apply initial route */
-  apply_route(out->hw, devices);
+static const void *out_chmap_reorder(struct out_chmap *chmap,
+                                     const void *buffer, size_t bytes)
+{
+  void *buf = NULL;
 
+  if (bytes > chmap->buffer_size) {
+    buf = realloc(chmap->buffer, bytes);
+    if (buf == NULL) {
+      return NULL;
+    }
+    chmap->buffer = buf;
+    chmap->buffer_size = bytes;
+  }
+
+  chmap_shuffle(chmap, buffer, chmap->buffer, bytes / chmap->frame_size);
+  return chmap->buffer;
+}
+
+static int out_chmap_init(struct stream_out_pcm *out)
+{
+  struct out_chmap *chmap = calloc(1, sizeof(struct out_chmap));
+
+  if (chmap == NULL) {
+    return -ENOMEM;
+  }
+
+  chmap->channels = chmap_from_mask(out->common.channel_mask,
+                                    chmap->positions);
+  chmap->frame_size = out->common.frame_size;
+  chmap->sample_size = chmap->frame_size / chmap->channels;
+  chmap->identity = true;
+  out->chmap = chmap;
   return 0;
 }
 
+static void out_chmap_free(struct stream_out_pcm *out)
+{
+  if (out->chmap != NULL) {
+    free(out->chmap->buffer);
+    free(out->chmap);
+    out->chmap = NULL;
+  }
+}
+
 /*********************************************************************
- * PCM output stream
+ * DSP worker pool
  *********************************************************************/
 
-static unsigned int out_pcm_cfg_period_count(struct stream_out_pcm *out)
+/*
+ * A pass over a period is split into chunks of frames, which the audio
+ * thread and the workers take in turn until none is left, so a thread
+ * that is held up simply takes fewer. Chunks write disjoint parts of the
+ * destination. One pass runs at a time, a stream that finds the pool
+ * busy does its pass alone rather than wait for another stream.
+ *
+ * Chunks are no smaller than what the caller's thread gets done in the
+ * time a worker takes to wake up, from the cost per frame measured on
+ * the caller's own chunks and the wake up latency measured by workers.
+ * A pass whose cost isn't known yet runs alone to measure it
+ */
+typedef void (*dsp_work_fn)(void *arg, size_t first, size_t count);
+
+struct dsp_pool {
+  pthread_mutex_t busy;         /* held by the thread running a pass */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  pthread_t threads[DSP_POOL_MAX_WORKERS];
+  unsigned int workers;
+  unsigned int generation;      /* of the posted pass */
+  unsigned int active;          /* workers in the posted pass */
+  bool exit;
+  int64_t posted_ns;            /* when the pass was posted */
+  atomic_llong wake_ns;         /* average latency of a worker */
+
+  dsp_work_fn fn;
+  void *arg;
+  size_t total;                 /* frames */
+  size_t chunk;
+  atomic_size_t next;           /* first frame not taken */
+  atomic_size_t finished;       /* frames done */
+};
+
+/* Returns the number of frames done by the calling thread */
+static size_t dsp_pool_work(struct dsp_pool *pool)
 {
-  uint32_t ret = OUT_PERIOD_COUNT_DEFAULT;
-  if (out->common.hw->period_count != 0) {
-    ret = out->common.hw->period_count;
+  size_t first = 0;
+  size_t count = 0;
+  size_t done = 0;
+
+  while ((first = atomic_fetch_add(&pool->next, pool->chunk)) < pool->total) {
+    count = pool->total - first;
+    if (count > pool->chunk) {
+      count = pool->chunk;
+    }
+    pool->fn(pool->arg, first, count);
+    done += count;
+
+    if ((atomic_fetch_add(&pool->finished, count) + count) == pool->total) {
+      pthread_mutex_lock(&pool->lock);
+      pthread_cond_signal(&pool->done);
+      pthread_mutex_unlock(&pool->lock);
+    }
   }
-  ALOGV("out_pcm_cfg_period_count = %d", ret);
-  return ret;
+  return done;
 }
 
-static unsigned int out_pcm_cfg_period_size(struct stream_out_pcm *out)
+static void *dsp_pool_thread(void *arg)
 {
-  uint32_t ret = OUT_PERIOD_SIZE_DEFAULT;
-  if (out->common.hw->period_size != 0) {
-    ret = out->common.hw->period_size;
+  struct dsp_pool *pool = arg;
+  struct sched_param param = { .sched_priority = DSP_POOL_PRIORITY };
+  unsigned int seen = 0;
+  int64_t wake_ns = 0;
+
+  if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+    ALOGW("DSP worker runs without real-time priority");
   }
-  ALOGV("out_pcm_cfg_period_size = %d", ret);
-  return ret;
-}
 
-static unsigned int out_pcm_cfg_rate(struct stream_out_pcm *out)
-{
-  uint32_t ret = OUT_SAMPLE_RATE_DEFAULT;
-  if (out->common.hw->rate != 0) {
-    ret = out->common.hw->rate;
-  } else if (out->common.sample_rate) {
-    ret = out->common.sample_rate;
+  pthread_mutex_lock(&pool->lock);
+  seen = pool->generation;
+  while (!pool->exit) {
+    if (pool->generation == seen) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+      continue;
+    }
+    seen = pool->generation;
+    ++pool->active;
+    wake_ns = atomic_load(&pool->wake_ns);
+    atomic_store(&pool->wake_ns,
+                 wake_ns + (((out_now_ns() - pool->posted_ns) - wake_ns) / 8));
+    pthread_mutex_unlock(&pool->lock);
+
+    dsp_pool_work(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->active == 0) {
+      pthread_cond_signal(&pool->done);
+    }
   }
-  ALOGV("out_pcm_cfg_rate = %d", ret);
-  return ret;
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
 }
 
-static unsigned int out_pcm_cfg_channel_count(struct stream_out_pcm *out)
+static void dsp_pool_free(struct dsp_pool *pool)
 {
-  uint32_t ret = OUT_CHANNEL_COUNT_DEFAULT;
-  if (out->common.channel_count != 0) {
-    ret = out->common.channel_count;
+  unsigned int i = 0;
+
+  if (pool == NULL) {
+    return;
   }
-  ALOGV("out_pcm_cfg_channel_count = %d", ret);
-  return ret;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->exit = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < pool->workers; ++i) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_mutex_destroy(&pool->busy);
+  free(pool);
 }
 
-/* must be called with hw device and output stream mutexes locked */
-static void do_out_pcm_standby(struct stream_out_pcm *out)
+/* Starts the workers set by PROP_AUDIO_DSP_WORKERS, NULL if none */
+static struct dsp_pool *dsp_pool_create(void)
 {
-  struct audio_device *adev = out->common.dev;
+  char value[PROPERTY_VALUE_MAX];
+  const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  struct dsp_pool *pool = NULL;
+  long workers = 0;
+
+  property_get(PROP_AUDIO_DSP_WORKERS, value, "0");
+  workers = (strcmp(value, "auto") == 0) ? (cores - 1) : atol(value);
+  if (workers > (cores - 1)) {
+    workers = cores - 1;
+  }
+  if (workers > DSP_POOL_MAX_WORKERS) {
+    workers = DSP_POOL_MAX_WORKERS;
+  }
+  if (workers <= 0) {
+    return NULL;
+  }
 
-  ALOGV("+do_out_pcm_standby(%p)", out);
+  pool = calloc(1, sizeof(struct dsp_pool));
+  if (pool == NULL) {
+    return NULL;
+  }
 
-  if ((!out->common.standby) && (out->pcm)){
-    pthread_mutex_lock(&adev->lock);
-    out->common.standby = true;
-    pcm_close(out->pcm);
-    out->pcm = NULL;
-    pthread_mutex_unlock(&adev->lock);
+  pthread_mutex_init(&pool->busy, NULL);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  atomic_init(&pool->wake_ns, DSP_POOL_WAKE_NS);
+
+  for (pool->workers = 0; pool->workers < workers; ++pool->workers) {
+    if (pthread_create(&pool->threads[pool->workers], NULL,
+                       dsp_pool_thread, pool) != 0) {
+      ALOGE("Cannot start DSP worker %u", pool->workers);
+      break;
+    }
   }
-  ALOGV("-do_out_pcm_standby(%p)", out);
+
+  if (pool->workers == 0) {
+    dsp_pool_free(pool);
+    return NULL;
+  }
+
+  ALOGV("dsp_pool_create %u workers", pool->workers);
+  return pool;
 }
 
-static void out_pcm_fill_params(struct stream_out_pcm *out,
-                                const struct pcm_config *config,
-                                bool disable_audio)
+/* Folds the CPU time the calling thread spent on frames into cost */
+static void dsp_cost_update(struct dsp_cost *cost, int64_t cpu_ns,
+                            size_t frames)
 {
-  out->hw_sample_rate = config->rate;
-  out->hw_channel_count = config->channels;
-  out->hw_period_size = config->period_size;
-  out->hw_period_count = config->period_count;
+  int64_t frame_ps = 0;
 
-  if (! disable_audio) {
-    out->common.buffer_size = pcm_frames_to_bytes(out->pcm, config->period_size);
+  if (frames == 0) {
+    return;
+  }
+  frame_ps = (cpu_ns * 1000) / (int64_t)frames;
+  if (cost->frame_ps == 0) {
+    cost->frame_ps = (frame_ps > 0) ? frame_ps : 1;
   } else {
-#ifdef TEST_32BITS
-  out->common.buffer_size = config->period_size * config->channels * (32 >> 3);
-#else
-  out->common.buffer_size = config->period_size * config->channels * (16 >> 3);
-#endif
+    cost->frame_ps += (frame_ps - cost->frame_ps) / 8;
   }
-  out->common.latency = (config->period_size * config->period_count * 1000);
-  out->common.latency /= config->rate;
 }
 
-/* must be called with hw device and output stream mutexes locked */
-static int start_output_pcm(struct stream_out_pcm *out)
+/*
+ * Runs fn over total frames, on the calling thread and the workers if
+ * the pass is worth sharing and the pool is free. cost belongs to the
+ * caller and tracks what a frame of fn costs
+ */
+static void dsp_pool_run(struct dsp_pool *pool, struct dsp_cost *cost,
+                         dsp_work_fn fn, void *arg, size_t total)
 {
-  struct audio_device *adev = out->common.dev;
-  int ret = 0;
+  int64_t start_ns = 0;
+  size_t chunk = total;
+  size_t min_chunk = 0;
+  size_t done = 0;
+
+  if ((pool != NULL) && (cost->frame_ps > 0)) {
+    chunk = (total + pool->workers) / (pool->workers + 1);
+    min_chunk = ((atomic_load(&pool->wake_ns) * 1000) / cost->frame_ps) + 1;
+    if (chunk < min_chunk) {
+      chunk = min_chunk;
+    }
+  }
 
-  struct pcm_config config = {
-    .channels = out_pcm_cfg_channel_count(out),
-    .rate = out_pcm_cfg_rate(out),
-    .period_size = out_pcm_cfg_period_size(out),
-    .period_count = out_pcm_cfg_period_count(out),
-#ifdef TEST_32BITS
-    .format =  PCM_FORMAT_S32_LE,
-#else
-    .format =  PCM_FORMAT_S16_LE,
-#endif
-    .start_threshold = 0,
-    .stop_threshold = 0,
-    .silence_threshold = 0
-  };
+  if ((pool == NULL) || (total <= chunk) ||
+      (pthread_mutex_trylock(&pool->busy) != 0)) {
+    start_ns = governor_cpu_ns();
+    fn(arg, 0, total);
+    if (pool != NULL) {
+      dsp_cost_update(cost, governor_cpu_ns() - start_ns, total);
+    }
+    return;
+  }
 
-  ALOGV("+start_output_pcm(%p)", out);
+  pthread_mutex_lock(&pool->lock);
+  /* a worker late for the previous pass must leave it first */
+  while (pool->active > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->total = total;
+  pool->chunk = chunk;
+  atomic_store(&pool->finished, 0);
+  atomic_store(&pool->next, 0);
+  ++pool->generation;
+  pool->posted_ns = out_now_ns();
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  start_ns = governor_cpu_ns();
+  done = dsp_pool_work(pool);
+  dsp_cost_update(cost, governor_cpu_ns() - start_ns, done);
+
+  pthread_mutex_lock(&pool->lock);
+  while ((atomic_load(&pool->finished) < total) || (pool->active > 0)) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  pthread_mutex_unlock(&pool->busy);
+}
 
-  ALOGV("Requested configuration : channels %d, rate %d, format %d",
-      config.channels, config.rate, pcm_format_to_bits(config.format));
+/*********************************************************************
+ * PCM conversion pipeline
+ *********************************************************************/
 
-  ALOGV("Extended configuration : period_size %d, period_count %d, "
-        "start_threshold=%d", config.period_size, config.period_count,
-        config.start_threshold);
+/* Format conversion alone, which has vector paths */
+static void pcm_pipe_convert(const struct pcm_pipe *pipe, void *dst,
+                             const void *src, size_t frames)
+{
+  in_convert_samples(dst, pipe->dst_format, src, pipe->src_format,
+                     frames * pipe->src_channels);
+}
 
-  if (!adev->disable_audio) {
+static inline int16_t pcm_pipe_clamp16(float sample)
+{
+  sample *= 32768.0f;
+  if (sample >= 32767.0f) {
+    return INT16_MAX;
+  } else if (sample <= -32768.0f) {
+    return INT16_MIN;
+  }
+  return (int16_t)lrintf(sample);
+}
 
-    out->pcm = pcm_open(out->common.hw->card_number,
-                        out->common.hw->device_number,
-                        PCM_OUT | PCM_MONOTONIC, &config);
+/* Selects channels of any PCM format to 16-bit samples with gain */
+static void pcm_pipe_to_i16(const struct pcm_pipe *pipe, void *dst,
+                            const void *src, size_t frames)
+{
+  const unsigned int src_channels = pipe->src_channels;
+  const unsigned int dst_channels = pipe->dst_channels;
+  const unsigned int shift = pipe->gain_shift;
+  int16_t *d = (int16_t *)dst;
+  unsigned int c = 0;
+  int from = 0;
+
+  /* The gain wraps like the 16-bit shift it replaces */
+  switch (pipe->src_format) {
+    case AUDIO_FORMAT_PCM_16_BIT: {
+      const int16_t *s = (const int16_t *)src;
+      for (; frames > 0; --frames, s += src_channels) {
+        for (c = 0; c < dst_channels; ++c) {
+          from = pipe->select[c];
+          *d++ = (from < 0) ? 0 : (int16_t)((uint16_t)s[from] << shift);
+        }
+      }
+      break;
+    }
+    case AUDIO_FORMAT_PCM_32_BIT: {
+      const int32_t *s = (const int32_t *)src;
+      for (; frames > 0; --frames, s += src_channels) {
+        for (c = 0; c < dst_channels; ++c) {
+          from = pipe->select[c];
+          *d++ = (from < 0) ? 0 :
+                 (int16_t)((uint16_t)(s[from] >> 16) << shift);
+        }
+      }
+      break;
+    }
+    case AUDIO_FORMAT_PCM_8_24_BIT: {
+      const int32_t *s = (const int32_t *)src;
+      for (; frames > 0; --frames, s += src_channels) {
+        for (c = 0; c < dst_channels; ++c) {
+          from = pipe->select[c];
+          *d++ = (from < 0) ? 0 :
+                 (int16_t)((uint16_t)(s[from] >> 8) << shift);
+        }
+      }
+      break;
+    }
+    case AUDIO_FORMAT_PCM_24_BIT_PACKED: {
+      const uint8_t *s = (const uint8_t *)src;
+      for (; frames > 0; --frames, s += src_channels * 3) {
+        for (c = 0; c < dst_channels; ++c) {
+          from = pipe->select[c];
+          *d++ = (from < 0) ? 0 :
+                 (int16_t)((uint16_t)(s[(from * 3) + 1] |
+                                      (s[(from * 3) + 2] << 8)) << shift);
+        }
+      }
+      break;
+    }
+    case AUDIO_FORMAT_PCM_FLOAT: {
+      const float *s = (const float *)src;
+      for (; frames > 0; --frames, s += src_channels) {
+        for (c = 0; c < dst_channels; ++c) {
+          from = pipe->select[c];
+          *d++ = (from < 0) ? 0 :
+                 (int16_t)((uint16_t)pcm_pipe_clamp16(s[from]) << shift);
+        }
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
 
-    if (out->pcm && !pcm_is_ready(out->pcm)) {
-      ALOGE("pcm_open(out) failed: %s", pcm_get_error(out->pcm));
-      pcm_close(out->pcm);
-      return -ENOMEM;
+/* Selects channels of 16-bit samples widening them to 32-bit */
+static void pcm_pipe_i16_to_i32(const struct pcm_pipe *pipe, void *dst,
+                                const void *src, size_t frames)
+{
+  const unsigned int src_channels = pipe->src_channels;
+  const unsigned int dst_channels = pipe->dst_channels;
+  const int16_t *s = (const int16_t *)src;
+  int32_t *d = (int32_t *)dst;
+  unsigned int c = 0;
+  int from = 0;
+
+  for (; frames > 0; --frames, s += src_channels) {
+    for (c = 0; c < dst_channels; ++c) {
+      from = pipe->select[c];
+      *d++ = (from < 0) ? 0 : ((int32_t)s[from] << 16);
     }
   }
+}
 
-#ifdef TEST_32BITS
-  // Hide 16 to 32bits conversion
-  config.format = PCM_FORMAT_S16_LE;
-#endif
+/*
+ * Composes the pass for a combination of formats, channels and gain.
+ * select gives the source of each destination channel, NULL keeps the
+ * channels in order and duplicates a mono source
+ */
+static int pcm_pipe_build(struct pcm_pipe *pipe,
+                          audio_format_t src_format, unsigned int src_channels,
+                          audio_format_t dst_format, unsigned int dst_channels,
+                          const int *select, unsigned int gain_shift)
+{
+  unsigned int c = 0;
 
-  out_pcm_fill_params(out, &config, adev->disable_audio);
+  if ((src_channels == 0) || (src_channels > HDMI_MAX_CHANNELS) ||
+      (dst_channels == 0) || (dst_channels > HDMI_MAX_CHANNELS) ||
+      ((gain_shift != 0) && (dst_format != AUDIO_FORMAT_PCM_16_BIT))) {
+    return -EINVAL;
+  }
 
-  ALOGV("-start_output_pcm(%p)", out);
+  pipe->src_format = src_format;
+  pipe->dst_format = dst_format;
+  pipe->src_channels = src_channels;
+  pipe->dst_channels = dst_channels;
+  pipe->gain_shift = gain_shift;
+  pipe->remix = (src_channels != dst_channels);
+
+  for (c = 0; c < dst_channels; ++c) {
+    if (select != NULL) {
+      pipe->select[c] = select[c];
+    } else if (c < src_channels) {
+      pipe->select[c] = c;
+    } else {
+      pipe->select[c] = (src_channels == 1) ? 0 : -1;
+    }
+    if (pipe->select[c] != (int)c) {
+      pipe->remix = true;
+    }
+  }
+
+  if (!pipe->remix && (gain_shift == 0)) {
+    pipe->process = (src_format == dst_format) ? NULL : pcm_pipe_convert;
+  } else if ((dst_format == AUDIO_FORMAT_PCM_16_BIT) &&
+             ((src_format == AUDIO_FORMAT_PCM_16_BIT) ||
+              (src_format == AUDIO_FORMAT_PCM_32_BIT) ||
+              (src_format == AUDIO_FORMAT_PCM_8_24_BIT) ||
+              (src_format == AUDIO_FORMAT_PCM_24_BIT_PACKED) ||
+              (src_format == AUDIO_FORMAT_PCM_FLOAT))) {
+    pipe->process = pcm_pipe_to_i16;
+  } else if ((src_format == AUDIO_FORMAT_PCM_16_BIT) &&
+             (dst_format == AUDIO_FORMAT_PCM_32_BIT)) {
+    pipe->process = pcm_pipe_i16_to_i32;
+  } else {
+    ALOGE("No pipeline from format 0x%x x%u to 0x%x x%u",
+          src_format, src_channels, dst_format, dst_channels);
+    pipe->process = NULL;
+    return -EINVAL;
+  }
+
+  ALOGV("pcm_pipe_build 0x%x x%u -> 0x%x x%u gain %u: %s",
+        src_format, src_channels, dst_format, dst_channels, gain_shift,
+        (pipe->process == NULL) ? "passthrough" :
+        (pipe->process == pcm_pipe_convert) ? "convert" : "fused");
   return 0;
 }
 
-static int out_pcm_standby(struct audio_stream *stream)
+struct pcm_pipe_work {
+  const struct pcm_pipe *pipe;
+  uint8_t *dst;
+  const uint8_t *src;
+  size_t dst_frame_size;
+  size_t src_frame_size;
+};
+
+static void pcm_pipe_chunk(void *arg, size_t first, size_t count)
 {
-  struct stream_out_pcm *out = (struct stream_out_pcm *)stream;
+  const struct pcm_pipe_work *work = arg;
 
-  lock_output_stream(out);
-  do_out_pcm_standby(out);
-  pthread_mutex_unlock(&out->common.lock);
+  work->pipe->process(work->pipe, work->dst + (first * work->dst_frame_size),
+                      work->src + (first * work->src_frame_size), count);
+}
 
-  return 0;
+/*
+ * Runs a pipeline, sharing it with the workers of pool if not NULL. It
+ * may work in place if its samples do not grow
+ */
+static void pcm_pipe_run(struct dsp_pool *pool, struct pcm_pipe *pipe,
+                         void *dst, const void *src, size_t frames)
+{
+  struct pcm_pipe_work work = {
+    .pipe = pipe,
+    .dst = dst,
+    .src = src,
+    .dst_frame_size = pipe->dst_channels *
+                      audio_bytes_per_sample(pipe->dst_format),
+    .src_frame_size = pipe->src_channels *
+                      audio_bytes_per_sample(pipe->src_format),
+  };
+
+  /* In place, a chunk that shrinks its frames would overwrite frames
+   * another chunk has yet to read
+   */
+  if ((pipe->process != NULL) &&
+      ((dst != src) || (work.dst_frame_size == work.src_frame_size))) {
+    dsp_pool_run(pool, &pipe->cost, pcm_pipe_chunk, &work, frames);
+  } else if (pipe->process != NULL) {
+    pipe->process(pipe, dst, src, frames);
+  } else if (dst != src) {
+    memcpy(dst, src,
+           frames * pipe->src_channels * audio_bytes_per_sample(pipe->src_format));
+  }
+}
+
+static void out_fill_chmap(struct stream_out_pcm *out, void *dst,
+                           const void *src, size_t frames)
+{
+  chmap_shuffle(out->chmap, src, dst, frames);
 }
 
 #ifdef TEST_32BITS
-void out_pcm_memcpy_to_i32_from_i16(int32_t *dst, const int16_t *src,
-                                    size_t count)
+static void out_fill_pipe(struct stream_out_pcm *out, void *dst,
+                          const void *src, size_t frames)
 {
-  while (count--) {
-    *dst++ = (int32_t)*src++ << 16;
-  }
+  pcm_pipe_run(out->common.dev->pool, &out->pipe, dst, src, frames);
 }
 #endif
 
@@ -766,12 +4314,13 @@ static ssize_t out_pcm_write(struct audio_stream_out *stream,
   int ret = 0;
   struct stream_out_pcm *out = (struct stream_out_pcm *)stream;
   struct audio_device *adev = out->common.dev;
+  const int64_t cpu_ns = governor_cpu_ns();
 
 #ifdef TEST_32BITS
   size_t outBufferSize = 0;
   void* outBuffer = NULL;
-  int16_t* tmp16Buffer = NULL;
-  int32_t* tmp32Buffer = NULL;
+#else
+  out_fill_fn fill = NULL;
 #endif
 
   /* Check that we are routed to something. Android can send routing
@@ -779,49 +4328,110 @@ static ssize_t out_pcm_write(struct audio_stream_out *stream,
    * state we shouldn't issue any write commands because we can't be
    * sure that the driver will accept a write to nowhere
    */
-  if (get_current_routes(out->common.hw) == 0) {
-    ALOGV("-out_pcm_write(%p) 0 (no routes)", stream);
-    return 0;
+  if (get_current_routes(out->common.hw) == 0) {
+    ALOGV("-out_pcm_write(%p) 0 (no routes)", stream);
+    return 0;
+  }
+
+  pthread_mutex_lock(&adev->lock);
+  lock_output_stream(out);
+  if (out->common.standby) {
+    ret = start_output_pcm(out);
+    if (ret != 0) {
+      pthread_mutex_unlock(&adev->lock);
+      goto exit;
+    }
+    out->common.standby = false;
+    out->hw_frames_rendered = 0;
+    if (out->keep_alive != NULL) {
+      pthread_cond_signal(&out->keep_alive->cond);
+    }
+  }
+  if (out->profile_pending != out->profile) {
+    out_apply_profile_l(out);
+  }
+  pthread_mutex_unlock(&adev->lock);
+
+  if (out->taps[e_tap_client] != NULL) {
+    dump_tap_push(out->taps[e_tap_client], buffer, bytes);
+  }
+
+  if (out->iec != NULL) {
+    ret = out_iec61937_write(out, buffer, bytes);
+    goto exit;
+  }
+
+  if (out->common.meter.enabled) {
+    meter_process(&out->common.meter, buffer, bytes);
+  }
+
+  /* Leaving deep buffering, whatever is staged goes first */
+  if (!adev->disable_audio && (out->stage != NULL) && !out_stage_active(out)) {
+    ret = out_stage_flush(out);
+    if (ret < 0) {
+      goto exit;
+    }
+  }
+
+  /* During a route change the queue is kept short too, so the switch
+   * waits for a couple of periods rather than the whole buffer
+   */
+  if ((out->latency_mode == e_latency_low) ||
+      (out->fade.state != e_route_idle)) {
+    out_limit_queue(out, bytes / out->common.frame_size);
   }
 
-  pthread_mutex_lock(&adev->lock);
-  lock_output_stream(out);
-  if (out->common.standby) {
-    ret = start_output_pcm(out);
-    if (ret != 0) {
-      pthread_mutex_unlock(&adev->lock);
+  if (out->fade.state != e_route_idle) {
+    buffer = out_fade_process(out, buffer, bytes);
+    if (buffer == NULL) {
+      ret = -ENOMEM;
       goto exit;
     }
-    out->common.standby = false;
-    out->hw_frames_rendered = 0;
   }
-  pthread_mutex_unlock(&adev->lock);
+
+#ifndef TEST_32BITS
+  /* With the 16 to 32bits conversion the reorder is part of its pass,
+   * with mmap or staging it is done into the DMA or staging buffer
+   */
+  if ((out->chmap != NULL) && !out->chmap->identity && !out->mmap &&
+      !out_stage_active(out)) {
+    buffer = out_chmap_reorder(out->chmap, buffer, bytes);
+    if (buffer == NULL) {
+      ret = -ENOMEM;
+      goto exit;
+    }
+  }
+#endif
 
 #ifdef TEST_32BITS
-  if (!adev->disable_audio) {
+  if (!adev->disable_audio && out->mmap) {
+    ret = out_mmap_write(out, out_fill_pipe, buffer,
+                         bytes / out->common.frame_size);
+    if (ret == 0) {
+      ret = bytes;
+      out->hw_frames_written += bytes / out->common.frame_size;
+    }
+  } else if (!adev->disable_audio) {
     outBufferSize = bytes * 2;
-    outBuffer = malloc(outBufferSize);
-    memset(outBuffer,0,outBufferSize);
-    out_pcm_memcpy_to_i32_from_i16((int32_t*)outBuffer,
-                                   (const int16_t*)buffer, bytes >> 1);
-
-    /*
-       ALOGV("NLO - buffer 16bits (size = %d): ", bytes);
-       tmp16Buffer = (int16_t*)buffer;
-       for (int i = 0; i<10; i++) {
-       ALOGV("sample %d: 0x%x",i,*tmp16Buffer++);
-       }
-
-       ALOGV("NLO - outBuffer 32bits (size = %d): ", outBufferSize);
-       tmp32Buffer = (int32_t*)outBuffer;
-       for (int i = 0; i<10; i++) {
-       ALOGV("outBuffer %d: Ox%x",i,*tmp32Buffer++);
-       }
-       */
+    if (out->pipe_buffer_size < outBufferSize) {
+      outBuffer = realloc(out->pipe_buffer, outBufferSize);
+      if (outBuffer == NULL) {
+        ret = -ENOMEM;
+        goto exit;
+      }
+      out->pipe_buffer = outBuffer;
+      out->pipe_buffer_size = outBufferSize;
+    }
+    outBuffer = out->pipe_buffer;
+    pcm_pipe_run(adev->pool, &out->pipe, outBuffer, buffer,
+                 bytes / out->common.frame_size);
 
     // case 32bits
     if (outBufferSize > 0) {
       ALOGV(" Write %d bytes (from buffer %p)", (int)outBufferSize, outBuffer);
+      if (out->taps[e_tap_hw] != NULL) {
+        dump_tap_push(out->taps[e_tap_hw], outBuffer, outBufferSize);
+      }
       ret = pcm_write(out->pcm, outBuffer, outBufferSize);
       if (ret >= 0) {
         ret = bytes;
@@ -829,8 +4439,6 @@ static ssize_t out_pcm_write(struct audio_stream_out *stream,
         ALOGV(" - Write OK (%llu frames)", out->hw_frames_written);
       }
     }
-
-    free(outBuffer);
   } else {
     int64_t sleep_time = (int64_t)bytes * 1000000;
     sleep_time /= out->common.frame_size / out->common.sample_rate;
@@ -840,9 +4448,29 @@ static ssize_t out_pcm_write(struct audio_stream_out *stream,
   }
 
 #else
-  if (!adev->disable_audio) {
+  /* Without mmap or staging the reorder has been done already */
+  fill = ((out->mmap || out_stage_active(out)) &&
+          (out->chmap != NULL) && !out->chmap->identity) ?
+         out_fill_chmap : out_fill_copy;
+
+  if (!adev->disable_audio && out_stage_active(out)) {
+    ret = out_stage_write(out, fill, buffer, bytes / out->common.frame_size);
+    if (ret == 0) {
+      ret = bytes;
+    }
+  } else if (!adev->disable_audio && out->mmap) {
+    ret = out_mmap_write(out, fill, buffer, bytes / out->common.frame_size);
+    if (ret == 0) {
+      ret = bytes;
+      out->hw_frames_written += bytes / out->common.frame_size;
+      out->hw_frames_rendered += bytes / out->common.frame_size;
+    }
+  } else if (!adev->disable_audio) {
     // case 16bits
     ALOGV(" Write %d bytes (from buffer %p)", (int)bytes, buffer);
+    if (out->taps[e_tap_hw] != NULL) {
+      dump_tap_push(out->taps[e_tap_hw], buffer, bytes);
+    }
     ret = pcm_write(out->pcm, buffer, bytes);
     if (ret >= 0) {
       ret = bytes;
@@ -860,8 +4488,13 @@ static ssize_t out_pcm_write(struct audio_stream_out *stream,
   }
 #endif
 
+  if ((out->keep_alive != NULL) && (ret > 0)) {
+    out->keep_alive->write_ns = out_now_ns();
+  }
+
 exit:
   pthread_mutex_unlock(&out->common.lock);
+  governor_account(&out->common.governor, governor_cpu_ns() - cpu_ns);
 
   ALOGV("-out_pcm_write(%p) r=%u", stream, ret);
 
@@ -884,18 +4517,34 @@ static int out_pcm_get_render_position(const struct audio_stream_out *stream,
 
 static void do_close_out_pcm(struct audio_stream *stream)
 {
+  struct stream_out_pcm *out = (struct stream_out_pcm *)stream;
+
   ALOGV("do_close_out_pcm (%p)", stream);
+  out_keep_alive_free(out);
+  lock_output_stream(out);
+  dump_update_taps_l(out->common.dev, out->taps, 0, out, "out");
+  pthread_mutex_unlock(&out->common.lock);
   out_pcm_standby(stream);
+  out_iec61937_free((struct stream_out_pcm *)stream);
+  out_chmap_free((struct stream_out_pcm *)stream);
+  out_stage_free((struct stream_out_pcm *)stream);
+#ifdef TEST_32BITS
+  free(((struct stream_out_pcm *)stream)->pipe_buffer);
+#endif
+  free(((struct stream_out_pcm *)stream)->fade.buffer);
   do_close_out_common(stream);
 }
 
 static int do_init_out_pcm(struct stream_out_pcm *out,
-                           const struct audio_config *config)
+                           const struct audio_config *config,
+                           audio_output_flags_t flags)
 {
-  UNUSED(config);
+  int ret = 0;
+
   out->common.close = do_close_out_pcm;
   out->common.stream.common.standby = out_pcm_standby;
   out->common.stream.write = out_pcm_write;
+  out->common.stream.update_source_metadata = out_update_source_metadata;
   out->common.stream.get_render_position = out_pcm_get_render_position;
   out->common.buffer_size = out_pcm_cfg_period_size(out) *
                             out->common.frame_size;
@@ -903,7 +4552,37 @@ static int do_init_out_pcm(struct stream_out_pcm *out,
   out->hw_frames_rendered = 0;
   out->hw_frames_written = 0;
 
-  return 0;
+  out->fade.state = e_route_idle;
+  out->fade.frames = (out->common.sample_rate * OUT_ROUTE_FADE_MS) / 1000;
+  out->fade.level = out->fade.frames;
+
+  if (!audio_is_linear_pcm(config->format)) {
+    return out_iec61937_init(out, config->format);
+  }
+
+#ifndef TEST_32BITS
+  if (flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
+    ret = out_stage_init(out);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+#else
+  /* The stage holds frames in the client format and the 16 to 32bits
+   * conversion writes straight from its own buffer, so deep buffer
+   * streams are not staged in this configuration
+   */
+  UNUSED(flags);
+#endif
+
+  /* Last, the thread uses the stream until it is stopped on close and
+   * nothing after this may fail the open
+   */
+  if (out->common.hw->keep_alive_ms != 0) {
+    ret = out_keep_alive_init(out);
+  }
+
+  return ret;
 }
 
 /*********************************************************************
@@ -964,8 +4643,13 @@ static size_t in_get_buffer_size(const struct audio_stream *stream)
 
 static int in_dump(const struct audio_stream *stream, int fd)
 {
-  UNUSED(stream);
-  UNUSED(fd);
+  /* All input streams are PCM */
+  struct stream_in_pcm *in = (struct stream_in_pcm *)stream;
+
+  pthread_mutex_lock(&in->common.lock);
+  dump_print_taps(in->taps, fd);
+  pthread_mutex_unlock(&in->common.lock);
+  meter_dump(&in->common.meter, fd);
   return 0;
 }
 
@@ -1015,6 +4699,9 @@ static char * in_get_parameters(const struct audio_stream *stream,
           strncat(outputBuffer, "=AUDIO_FORMAT_INVALID", 256);
           break;
       }
+    } else {
+      meter_get_parameter(&((const struct stream_in_common *)stream)->meter,
+                          currentKey, outputBuffer, sizeof(outputBuffer));
     }
     currentKey = strtok_r(NULL, ";", &saveptr1);
   }
@@ -1169,6 +4856,215 @@ static int do_init_in_common(struct stream_in_common *in,
   return 0;
 }
 
+/*********************************************************************
+ * PCM input format conversion
+ *********************************************************************/
+
+/* Hardware formats tried for high resolution capture, best first */
+static const enum pcm_format in_hires_formats[] = {
+  PCM_FORMAT_S32_LE,
+  PCM_FORMAT_S24_LE,
+  PCM_FORMAT_S24_3LE,
+  PCM_FORMAT_S16_LE
+};
+
+static bool in_format_supported(audio_format_t format)
+{
+  switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+    case AUDIO_FORMAT_PCM_24_BIT_PACKED:
+    case AUDIO_FORMAT_PCM_32_BIT:
+    case AUDIO_FORMAT_PCM_FLOAT:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/* Choose the hardware format closest to the client format */
+static audio_format_t in_pcm_cfg_format(struct stream_in_pcm *in)
+{
+  struct pcm_params *params = NULL;
+  audio_format_t ret = AUDIO_FORMAT_PCM_16_BIT;
+  size_t i = 0;
+
+  /* A stream probed from hardware has a single native format */
+  if (in->common.hw->format != AUDIO_FORMAT_DEFAULT) {
+    return in->common.hw->format;
+  }
+
+  if ((in->common.format == AUDIO_FORMAT_PCM_16_BIT) ||
+      in->common.dev->disable_audio) {
+    return in->common.format;
+  }
+
+  params = pcm_params_get(in->common.hw->card_number,
+                          in->common.hw->device_number, PCM_IN);
+  if (params == NULL) {
+    ALOGW("No hw params for capture, using 16-bit");
+    return ret;
+  }
+
+  /* ALSA has no float format, capture float from the best integer one */
+  if ((in->common.format != AUDIO_FORMAT_PCM_FLOAT) &&
+      pcm_params_format_test(params,
+                    pcm_format_from_audio_format(in->common.format))) {
+    ret = in->common.format;
+  } else {
+    for (i = 0; i < ARRAY_SIZE(in_hires_formats); ++i) {
+      if (pcm_params_format_test(params, in_hires_formats[i])) {
+        ret = audio_format_from_pcm_format(in_hires_formats[i]);
+        break;
+      }
+    }
+  }
+
+  pcm_params_free(params);
+  return ret;
+}
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+/* Converts whole vectors of 4 samples for the common format pairs,
+ * returns the number of samples done
+ */
+static size_t in_convert_neon(void *dst, audio_format_t dst_format,
+                              const void *src, audio_format_t src_format,
+                              size_t count)
+{
+  const size_t vectors = count / 4;
+  size_t i = 0;
+
+  if ((src_format == AUDIO_FORMAT_PCM_32_BIT) &&
+      (dst_format == AUDIO_FORMAT_PCM_FLOAT)) {
+    for (i = 0; i < vectors; ++i) {
+      vst1q_f32((float *)dst + (4 * i),
+                vcvtq_n_f32_s32(vld1q_s32((const int32_t *)src + (4 * i)), 31));
+    }
+  } else if ((src_format == AUDIO_FORMAT_PCM_8_24_BIT) &&
+             (dst_format == AUDIO_FORMAT_PCM_FLOAT)) {
+    for (i = 0; i < vectors; ++i) {
+      vst1q_f32((float *)dst + (4 * i),
+                vcvtq_n_f32_s32(vld1q_s32((const int32_t *)src + (4 * i)), 23));
+    }
+  } else if ((src_format == AUDIO_FORMAT_PCM_16_BIT) &&
+             (dst_format == AUDIO_FORMAT_PCM_32_BIT)) {
+    for (i = 0; i < vectors; ++i) {
+      vst1q_s32((int32_t *)dst + (4 * i),
+                vshll_n_s16(vld1_s16((const int16_t *)src + (4 * i)), 16));
+    }
+  } else if ((src_format == AUDIO_FORMAT_PCM_32_BIT) &&
+             (dst_format == AUDIO_FORMAT_PCM_16_BIT)) {
+    for (i = 0; i < vectors; ++i) {
+      vst1_s16((int16_t *)dst + (4 * i),
+               vshrn_n_s32(vld1q_s32((const int32_t *)src + (4 * i)), 16));
+    }
+  } else {
+    return 0;
+  }
+
+  return vectors * 4;
+}
+#endif
+
+/* Converts count samples from src_format to dst_format */
+static void in_convert_samples(void *dst, audio_format_t dst_format,
+                               const void *src, audio_format_t src_format,
+                               size_t count)
+{
+  size_t done = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  done = in_convert_neon(dst, dst_format, src, src_format, count);
+#endif
+
+  if (done < count) {
+    memcpy_by_audio_format(
+        (uint8_t *)dst + (done * audio_bytes_per_sample(dst_format)),
+        dst_format,
+        (const uint8_t *)src + (done * audio_bytes_per_sample(src_format)),
+        src_format, count - done);
+  }
+}
+
+static void *in_convert_buffer(struct stream_in_pcm *in, size_t bytes)
+{
+  void *buf = NULL;
+
+  if (in->convert_size < bytes) {
+    buf = realloc(in->convert, bytes);
+    if (buf == NULL) {
+      return NULL;
+    }
+    in->convert = buf;
+    in->convert_size = bytes;
+  }
+  return in->convert;
+}
+
+/* Reads frames in the hw format and converts them to the client format */
+static int read_converted_frames(struct stream_in_pcm *in, void *buffer,
+                                 size_t frames)
+{
+  const size_t samples = frames * in->hw_channel_count;
+  const size_t bytes = samples * audio_bytes_per_sample(in->hw_format);
+  void *raw = in_convert_buffer(in, bytes);
+  int ret = 0;
+
+  if (raw == NULL) {
+    return -ENOMEM;
+  }
+
+  ret = pcm_read(in->pcm, raw, bytes);
+  if (ret < 0) {
+    return ret;
+  }
+
+  if (in->taps[e_tap_hw] != NULL) {
+    dump_tap_push(in->taps[e_tap_hw], raw, bytes);
+  }
+
+  pcm_pipe_run(in->common.dev->pool, &in->pipe, buffer, raw, frames);
+  return 0;
+}
+
+static bool in_is_resampling(const struct stream_in_pcm *in)
+{
+  return (in->resampler.resampler != NULL) || (in->resampler.fir != NULL);
+}
+
+/* Gain on built-in microphone (only for demo purpose) */
+static unsigned int in_pcm_gain_shift(const struct stream_in_pcm *in)
+{
+  if ((in->common.frame_size == 2) &&
+      (in->common.devices == AUDIO_DEVICE_IN_BUILTIN_MIC)) {
+    return IN_BUILTIN_MIC_GAIN_SHIFT;
+  }
+  return 0;
+}
+
+/* must be called with input stream mutex locked */
+static int in_pcm_build_pipes(struct stream_in_pcm *in)
+{
+  const unsigned int channels = in->common.channel_count;
+  const unsigned int gain_shift = in_pcm_gain_shift(in);
+  int ret = 0;
+
+  if (in_is_resampling(in)) {
+    ret = pcm_pipe_build(&in->pipe, in->hw_format, in->hw_channel_count,
+                         AUDIO_FORMAT_PCM_16_BIT, channels, NULL, 0);
+    if (ret == 0) {
+      ret = pcm_pipe_build(&in->post_pipe, AUDIO_FORMAT_PCM_16_BIT, channels,
+                           in->common.format, channels, NULL, gain_shift);
+    }
+  } else {
+    ret = pcm_pipe_build(&in->pipe, in->hw_format, in->hw_channel_count,
+                         in->common.format, channels, NULL, gain_shift);
+  }
+
+  return ret;
+}
+
 /*********************************************************************
  * PCM input resampler handling
  *********************************************************************/
@@ -1195,61 +5091,361 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
   }
 
   if (rsp->frames_in == 0) {
-    rsp->read_status = pcm_read(in->pcm, (void*)rsp->buffer,
-                                rsp->in_buffer_size);
+    if (rsp->raw != NULL) {
+      rsp->read_status = pcm_read(in->pcm, rsp->raw, rsp->raw_size);
+    } else {
+      rsp->read_status = pcm_read(in->pcm, (void*)rsp->buffer,
+                                  rsp->in_buffer_size);
+    }
     if (rsp->read_status != 0) {
       ALOGE("get_next_buffer() pcm_read error %d", errno);
       buffer->raw = NULL;
       buffer->frame_count = 0;
       return rsp->read_status;
     }
-    rsp->frames_in = rsp->in_buffer_frames;
-    if ((in->common.channel_count == 1) && (in->hw_channel_count == 2)) {
-      unsigned int i;
-
-      /* Discard right channel */
-      for (i = 1; i < rsp->frames_in; i++) {
-        rsp->buffer[i] = rsp->buffer[i * 2];
-      }
+    if (in->taps[e_tap_hw] != NULL) {
+      dump_tap_push(in->taps[e_tap_hw],
+                    (rsp->raw != NULL) ? rsp->raw : (void *)rsp->buffer,
+                    (rsp->raw != NULL) ? rsp->raw_size : rsp->in_buffer_size);
     }
+    /* The resampler works on 16-bit samples of the stream channels,
+     * one pass converts and drops the right channel of a mono stream
+     */
+    pcm_pipe_run(in->common.dev->pool, &in->pipe, rsp->buffer,
+                 (rsp->raw != NULL) ? rsp->raw : (void *)rsp->buffer,
+                 rsp->in_buffer_frames);
+    rsp->frames_in = rsp->in_buffer_frames;
   }
 
   buffer->frame_count = (buffer->frame_count > rsp->frames_in) ?
                         rsp->frames_in : buffer->frame_count;
   buffer->i16 = (int16_t *)rsp->buffer;
-  buffer->i16 += (rsp->in_buffer_frames - rsp->frames_in);
+  buffer->i16 += (rsp->in_buffer_frames - rsp->frames_in) *
+                 in->common.channel_count;
+
+  return rsp->read_status;
+}
+
+static void release_buffer(struct resampler_buffer_provider *buffer_provider,
+                           struct resampler_buffer* buffer)
+{
+  struct in_resampler *rsp = NULL;
+  struct stream_in_pcm *in = NULL;
+
+  if (buffer_provider == NULL || buffer == NULL)
+    return;
+
+  rsp = (struct in_resampler *)((char *)buffer_provider -
+            offsetof(struct in_resampler, buf_provider));
+  in = (struct stream_in_pcm *)((char *)rsp -
+            offsetof(struct stream_in_pcm, resampler));
+
+  rsp->frames_in -= buffer->frame_count;
+}
+
+/* Filters for each DSP quality level */
+static const unsigned int in_fir_taps[e_quality_count] = {
+  [e_quality_full] = IN_FIR_TAPS_PER_PHASE,
+  [e_quality_reduced] = IN_FIR_TAPS_PER_PHASE_REDUCED,
+  [e_quality_minimum] = IN_FIR_TAPS_PER_PHASE_MINIMUM,
+};
+
+static const int in_resampler_quality[e_quality_count] = {
+  [e_quality_full] = RESAMPLER_QUALITY_DEFAULT,
+  [e_quality_reduced] = RESAMPLER_QUALITY_VOIP,
+  [e_quality_minimum] = RESAMPLER_QUALITY_MIN,
+};
+
+/* Picks a polyphase FIR if the rates are an integer ratio apart */
+static bool in_fir_ratio(unsigned int hw_rate, unsigned int rate,
+                         unsigned int *phases, unsigned int *step)
+{
+  if ((hw_rate > rate) && ((hw_rate % rate) == 0) &&
+      ((hw_rate / rate) <= IN_FIR_MAX_RATIO)) {
+    *phases = 1;
+    *step = hw_rate / rate;
+    return true;
+  } else if ((rate > hw_rate) && ((rate % hw_rate) == 0) &&
+             ((rate / hw_rate) <= IN_FIR_MAX_RATIO)) {
+    *phases = rate / hw_rate;
+    *step = 1;
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Designs a Blackman windowed sinc low-pass at the higher rate and splits
+ * it into phases. Each phase is stored in time order, oldest input first,
+ * and scaled to unity gain
+ */
+static int in_fir_init(struct in_resampler *rsp, unsigned int phases,
+                       unsigned int step, unsigned int channels,
+                       unsigned int taps_per_phase)
+{
+  const unsigned int ratio = phases * step;
+  const unsigned int length = taps_per_phase * ratio;
+  const double cutoff = IN_FIR_PASSBAND * 0.5 / ratio;
+  struct in_fir *fir = calloc(1, sizeof(struct in_fir));
+  double *proto = malloc(length * sizeof(double));
+  double sum = 0;
+  double t = 0;
+  long q = 0;
+  unsigned int k = 0;
+  unsigned int p = 0;
+  unsigned int j = 0;
+
+  if ((fir == NULL) || (proto == NULL)) {
+    goto fail;
+  }
+
+  fir->phases = phases;
+  fir->step = step;
+  fir->taps = taps_per_phase * step;
+  fir->capacity = fir->taps - 1 + rsp->in_buffer_frames;
+  fir->coefs = malloc(length * sizeof(int16_t));
+  fir->history = calloc(fir->capacity * channels, sizeof(int16_t));
+  if ((fir->coefs == NULL) || (fir->history == NULL)) {
+    goto fail;
+  }
+
+  for (k = 0; k < length; ++k) {
+    t = k - ((length - 1) / 2.0);
+    proto[k] = (t == 0) ? (2 * cutoff) :
+               (sin(2 * M_PI * cutoff * t) / (M_PI * t));
+    proto[k] *= 0.42 - (0.5 * cos((2 * M_PI * k) / (length - 1))) +
+                (0.08 * cos((4 * M_PI * k) / (length - 1)));
+    sum += proto[k];
+  }
+
+  for (p = 0; p < phases; ++p) {
+    for (j = 0; j < fir->taps; ++j) {
+      k = ((fir->taps - 1 - j) * phases) + p;
+      q = lrint((proto[k] * phases * 32768.0) / sum);
+      fir->coefs[(p * fir->taps) + j] = (q > INT16_MAX) ? INT16_MAX :
+                                        (q < INT16_MIN) ? INT16_MIN : q;
+    }
+  }
+
+  /* The filter starts on silence */
+  fir->frames = fir->taps - 1;
+  fir->pos = fir->frames;
+
+  free(proto);
+  rsp->fir = fir;
+  ALOGV("in_fir_init %u/%u, %u taps per phase", phases, step, fir->taps);
+  return 0;
+
+fail:
+  free(proto);
+  if (fir != NULL) {
+    free(fir->coefs);
+    free(fir->history);
+    free(fir);
+  }
+  return -ENOMEM;
+}
+
+/* Continues from the input an old filter holds, its unread frames and
+ * the history the new filter needs
+ */
+static void in_fir_carry(struct in_fir *fir, const struct in_fir *old,
+                         unsigned int channels)
+{
+  const size_t keep = fir->taps - 1;
+  const size_t anchor = (old->pos < old->frames) ? old->pos : old->frames;
+  const size_t first = (anchor > keep) ? (anchor - keep) : 0;
+  const size_t pad = keep - (anchor - first);
+
+  /* history before the old input is silence, as calloc'ed */
+  memcpy(fir->history + (pad * channels), old->history + (first * channels),
+         (old->frames - first) * channels * sizeof(int16_t));
+  fir->frames = pad + old->frames - first;
+  fir->pos = keep + (old->pos - anchor);
+  fir->phase = old->phase;
+}
+
+static void in_fir_free(struct in_resampler *rsp)
+{
+  if (rsp->fir != NULL) {
+    free(rsp->fir->coefs);
+    free(rsp->fir->history);
+    free(rsp->fir);
+    rsp->fir = NULL;
+  }
+}
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+/* Dot product of mono samples, taps is a multiple of 8 */
+static int32_t in_fir_dot_neon(const int16_t *x, const int16_t *c,
+                               unsigned int taps)
+{
+  int32x4_t acc = vdupq_n_s32(0);
+  int64x2_t sum = vdupq_n_s64(0);
+  int16x8_t vx;
+  int16x8_t vc;
+  unsigned int i = 0;
+
+  for (i = 0; i < taps; i += 8) {
+    vx = vld1q_s16(x + i);
+    vc = vld1q_s16(c + i);
+    acc = vmlal_s16(acc, vget_low_s16(vx), vget_low_s16(vc));
+    acc = vmlal_s16(acc, vget_high_s16(vx), vget_high_s16(vc));
+  }
+  sum = vpadalq_s32(sum, acc);
+  return (int32_t)(vgetq_lane_s64(sum, 0) + vgetq_lane_s64(sum, 1));
+}
+#endif
+
+/* Dot product of one channel of interleaved samples */
+static int32_t in_fir_dot(const int16_t *x, const int16_t *c,
+                          unsigned int taps, unsigned int channels)
+{
+  int32_t acc = 0;
+  unsigned int i = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  if (channels == 1) {
+    return in_fir_dot_neon(x, c, taps);
+  }
+#endif
+
+  for (i = 0; i < taps; ++i, x += channels) {
+    acc += (int32_t)*x * c[i];
+  }
+  return acc;
+}
+
+struct in_fir_work {
+  const struct in_fir *fir;
+  int16_t *out;
+  unsigned int channels;
+};
+
+/* Computes outputs first to first + count of a pass over the history,
+ * each from the phase and position it has counting from the first
+ */
+static void in_fir_chunk(void *arg, size_t first, size_t count)
+{
+  const struct in_fir_work *work = arg;
+  const struct in_fir *fir = work->fir;
+  const unsigned int channels = work->channels;
+  const size_t n = fir->phase + first;
+  unsigned int phase = n % fir->phases;
+  size_t pos = fir->pos + ((n / fir->phases) * fir->step);
+  int16_t *out = work->out + (first * channels);
+  const int16_t *x = NULL;
+  const int16_t *c = NULL;
+  unsigned int ch = 0;
+  int32_t acc = 0;
+
+  while (count > 0) {
+    x = fir->history + ((pos + 1 - fir->taps) * channels);
+    c = fir->coefs + (phase * fir->taps);
+    for (ch = 0; ch < channels; ++ch) {
+      acc = (in_fir_dot(x + ch, c, fir->taps, channels) + (1 << 14)) >> 15;
+      *out++ = (acc > INT16_MAX) ? INT16_MAX :
+               (acc < INT16_MIN) ? INT16_MIN : acc;
+    }
+
+    if (++phase == fir->phases) {
+      phase = 0;
+      pos += fir->step;
+    }
+    --count;
+  }
+}
+
+/*
+ * Produces frames at the stream rate from the buffer provider. Outputs
+ * only read the history, so those it holds input for are computed in
+ * one pass shared with the DSP workers
+ */
+static int in_fir_resample(struct stream_in_pcm *in, int16_t *out,
+                           size_t frames)
+{
+  struct in_resampler *rsp = &in->resampler;
+  struct in_fir *fir = rsp->fir;
+  const unsigned int channels = in->common.channel_count;
+  const size_t keep = fir->taps - 1;
+  struct resampler_buffer buf;
+  struct in_fir_work work = {
+    .fir = fir,
+    .channels = channels,
+  };
+  size_t avail = 0;
+  int ret = 0;
 
-  return rsp->read_status;
-}
+  while (frames > 0) {
+    if (fir->pos >= fir->frames) {
+      /* keep the history the filter needs and refill behind it */
+      memmove(fir->history,
+              fir->history + ((fir->frames - keep) * channels),
+              keep * channels * sizeof(int16_t));
+      fir->pos -= fir->frames - keep;
+      fir->frames = keep;
+
+      buf.frame_count = fir->capacity - keep;
+      ret = get_next_buffer(&rsp->buf_provider, &buf);
+      if (ret != 0) {
+        return ret;
+      }
+      memcpy(fir->history + (keep * channels), buf.i16,
+             buf.frame_count * channels * sizeof(int16_t));
+      fir->frames += buf.frame_count;
+      release_buffer(&rsp->buf_provider, &buf);
+      continue;
+    }
 
-static void release_buffer(struct resampler_buffer_provider *buffer_provider,
-                           struct resampler_buffer* buffer)
-{
-  struct in_resampler *rsp = NULL;
-  struct stream_in_pcm *in = NULL;
+    /* outputs until the position passes the valid frames */
+    avail = ((((fir->frames - fir->pos) + fir->step - 1) / fir->step) *
+             fir->phases) - fir->phase;
+    if (avail > frames) {
+      avail = frames;
+    }
 
-  if (buffer_provider == NULL || buffer == NULL)
-    return;
+    work.out = out;
+    dsp_pool_run(in->common.dev->pool, &fir->cost, in_fir_chunk, &work,
+                 avail);
 
-  rsp = (struct in_resampler *)((char *)buffer_provider -
-            offsetof(struct in_resampler, buf_provider));
-  in = (struct stream_in_pcm *)((char *)rsp -
-            offsetof(struct stream_in_pcm, resampler));
+    fir->pos += ((fir->phase + avail) / fir->phases) * fir->step;
+    fir->phase = (fir->phase + avail) % fir->phases;
+    out += avail * channels;
+    frames -= avail;
+  }
 
-  rsp->frames_in -= buffer->frame_count;
+  return 0;
 }
 
 static ssize_t read_resampled_frames(struct stream_in_pcm *in,
                                      void *buffer, ssize_t frames)
 {
   struct in_resampler *rsp = &in->resampler;
+  const unsigned int channels = in->common.channel_count;
+  int16_t *dst = (int16_t *)buffer;
   ssize_t frames_wr = 0;
+  int ret = 0;
+
+  /* The resampler works on 16-bit samples, convert its output */
+  if (in->post_pipe.process == pcm_pipe_convert) {
+    dst = in_convert_buffer(in, frames * channels * sizeof(int16_t));
+    if (dst == NULL) {
+      return -ENOMEM;
+    }
+  }
+
+  if (rsp->fir != NULL) {
+    ret = in_fir_resample(in, dst, frames);
+    if (ret != 0) {
+      return ret;
+    }
+    frames_wr = frames;
+  }
 
   while (frames_wr < frames) {
     size_t frames_rd = frames - frames_wr;
     rsp->resampler->resample_from_provider(rsp->resampler,
-        (int16_t *)((char *)buffer +
-          (frames_wr * in->common.frame_size)),
+        dst + (frames_wr * channels),
         &frames_rd);
     if (rsp->read_status != 0) {
       return rsp->read_status;
@@ -1257,51 +5453,120 @@ static ssize_t read_resampled_frames(struct stream_in_pcm *in,
 
     frames_wr += frames_rd;
   }
+
+  pcm_pipe_run(in->common.dev->pool, &in->post_pipe, buffer, dst, frames);
   return frames_wr;
 }
 
 static int in_resampler_init(struct stream_in_pcm *in, int hw_rate,
-                             int channels, size_t hw_fragment)
+                             int channels, size_t hw_period_frames)
 {
   struct in_resampler *rsp = &in->resampler;
+  unsigned int phases = 0;
+  unsigned int step = 0;
   int ret = 0;
 
-  rsp->in_buffer_size = hw_fragment * channels * in->common.frame_size;
-  rsp->in_buffer_frames = rsp->in_buffer_size /
-                          (channels * in->common.frame_size);
+  in->quality = governor_level(in->common.dev);
+
+  rsp->in_buffer_frames = hw_period_frames;
+  rsp->in_buffer_size = hw_period_frames * channels * sizeof(int16_t);
   rsp->buffer = malloc(rsp->in_buffer_size);
 
-  if (!rsp->buffer) {
+  if (in->hw_format != AUDIO_FORMAT_PCM_16_BIT) {
+    ALOGW_IF(in->common.format != AUDIO_FORMAT_PCM_16_BIT,
+             "Resampling limits capture to 16-bit resolution");
+    rsp->raw_size = hw_period_frames * channels *
+                    audio_bytes_per_sample(in->hw_format);
+    rsp->raw = malloc(rsp->raw_size);
+  }
+
+  if (!rsp->buffer || ((rsp->raw_size != 0) && !rsp->raw)) {
     ret = -ENOMEM;
   } else {
     rsp->buf_provider.get_next_buffer = get_next_buffer;
     rsp->buf_provider.release_buffer = release_buffer;
 
-    ret = create_resampler(hw_rate,
-                           in->common.sample_rate,
-                           in->common.channel_count,
-                           RESAMPLER_QUALITY_DEFAULT,
-                           &rsp->buf_provider,
-                           &rsp->resampler);
+    if (in_fir_ratio(hw_rate, in->common.sample_rate, &phases, &step)) {
+      ret = in_fir_init(rsp, phases, step, in->common.channel_count,
+                        in_fir_taps[in->quality]);
+    } else {
+      ret = create_resampler(hw_rate,
+                             in->common.sample_rate,
+                             in->common.channel_count,
+                             in_resampler_quality[in->quality],
+                             &rsp->buf_provider,
+                             &rsp->resampler);
+    }
   }
 
   if (ret < 0) {
     free(rsp->buffer);
     rsp->buffer = NULL;
+    free(rsp->raw);
+    rsp->raw = NULL;
+    rsp->raw_size = 0;
   }
 
   return ret;
 }
 
+/*
+ * Rebuilds the filter of a running capture for a quality level. The FIR
+ * carries its input over, the general resampler starts again from the
+ * next input it pulls. Must be called with input stream mutex locked
+ */
+static int in_resampler_requalify(struct stream_in_pcm *in,
+                                  enum dsp_quality quality)
+{
+  struct in_resampler *rsp = &in->resampler;
+  struct in_fir *old = rsp->fir;
+  struct resampler_itfe *resampler = NULL;
+  int ret = 0;
+
+  if (old != NULL) {
+    rsp->fir = NULL;
+    ret = in_fir_init(rsp, old->phases, old->step, in->common.channel_count,
+                      in_fir_taps[quality]);
+    if (ret != 0) {
+      rsp->fir = old;
+      return ret;
+    }
+    in_fir_carry(rsp->fir, old, in->common.channel_count);
+    free(old->coefs);
+    free(old->history);
+    free(old);
+  } else {
+    ret = create_resampler(in->hw_sample_rate,
+                           in->common.sample_rate,
+                           in->common.channel_count,
+                           in_resampler_quality[quality],
+                           &rsp->buf_provider,
+                           &resampler);
+    if (ret != 0) {
+      return ret;
+    }
+    release_resampler(rsp->resampler);
+    rsp->resampler = resampler;
+  }
+
+  ALOGV("in_resampler_requalify(%p) %s", in, dsp_quality_names[quality]);
+  in->quality = quality;
+  return 0;
+}
+
 static void in_resampler_free(struct stream_in_pcm *in)
 {
   if (in->resampler.resampler) {
     release_resampler(in->resampler.resampler);
     in->resampler.resampler = NULL;
   }
+  in_fir_free(&in->resampler);
 
   free(in->resampler.buffer);
   in->resampler.buffer = NULL;
+  free(in->resampler.raw);
+  in->resampler.raw = NULL;
+  in->resampler.raw_size = 0;
 }
 
 
@@ -1522,25 +5787,105 @@ static void do_in_pcm_standby(struct stream_in_pcm *in)
   ALOGV("-do_in_pcm_standby");
 }
 
-static void in_pcm_fill_params(struct stream_in_pcm *in,
-                               const struct pcm_config *config)
+/* Sources that don't need low latency read several periods at once */
+static bool in_source_is_batched(int source)
 {
-  size_t size = 0;
+  switch (source) {
+    case AUDIO_SOURCE_MIC:
+    case AUDIO_SOURCE_CAMCORDER:
+    case AUDIO_SOURCE_UNPROCESSED:
+      return true;
+    default:
+      return false;
+  }
+}
 
-  in->hw_sample_rate = config->rate;
-  in->hw_channel_count = config->channels;
-  in->hw_period_size = config->period_size;
-  in->hw_period_count = config->period_count;
+static size_t in_period_buffer_size(unsigned int period_size,
+                                    unsigned int period_count,
+                                    unsigned int hw_rate, uint32_t rate,
+                                    size_t frame_size, int source)
+{
+  size_t size = 0;
 
   /*
    * take resampling into account and return the closest majoring
    * multiple of 16 frames, as audioflinger expects audio buffers to
    * be a multiple of 16 frames
    */
-  size = (config->period_size * in->common.sample_rate) / config->rate;
+  size = ((size_t)period_size * rate) / hw_rate;
+
+  /* batch half the buffer so that a whole batch can queue up behind
+   * the one being read
+   */
+  if (in_source_is_batched(source) && (period_count >= 4)) {
+    size *= period_count / 2;
+  }
+
   size = ((size + 15) / 16) * 16;
-  in->common.buffer_size = size * in->common.frame_size;
+  return size * frame_size;
+}
+
+/* Buffer size of a capture from a stream that is not started yet */
+static size_t in_stream_buffer_size(const struct hw_stream *hw,
+                                    const struct audio_config *config,
+                                    int source)
+{
+  unsigned int hw_rate = 0;
+  size_t frame_size = 0;
+
+  if (hw->type != e_stream_in_pcm) {
+    return IN_COMPRESS_BUFFER_SIZE_DEFAULT;
+  }
+
+  hw_rate = (hw->rate != 0) ? hw->rate : IN_SAMPLE_RATE_DEFAULT;
+  frame_size = audio_bytes_per_sample(config->format) *
+               popcount(config->channel_mask);
+
+  return in_period_buffer_size(
+            (hw->period_size != 0) ? hw->period_size : IN_PERIOD_SIZE_DEFAULT,
+            (hw->period_count != 0) ? hw->period_count : IN_PERIOD_COUNT_DEFAULT,
+            hw_rate,
+            (config->sample_rate != 0) ? config->sample_rate : hw_rate,
+            frame_size, source);
+}
+
+/* Buffer size of a capture that has not chosen its stream yet, from the
+ * stream that the devices and config would get
+ */
+static size_t in_estimate_buffer_size(struct config_mgr *cm,
+                                      audio_devices_t devices,
+                                      const struct audio_config *config,
+                                      int source,
+                                      audio_input_flags_t flags)
+{
+  struct hw_stream info;
+
+  if ((devices & ~AUDIO_DEVICE_BIT_IN) == 0) {
+    devices = AUDIO_DEVICE_IN_DEFAULT;
+  }
+
+  if (peek_stream(cm, devices | AUDIO_DEVICE_BIT_IN, source, flags,
+                  config, &info) != 0) {
+    return IN_COMPRESS_BUFFER_SIZE_DEFAULT;
+  }
+
+  return in_stream_buffer_size(&info, config, source);
+}
+
+static void in_pcm_fill_params(struct stream_in_pcm *in,
+                               const struct pcm_config *config)
+{
+  in->hw_sample_rate = config->rate;
+  in->hw_channel_count = config->channels;
+  in->hw_period_size = config->period_size;
+  in->hw_period_count = config->period_count;
 
+  in->common.buffer_size = in_period_buffer_size(config->period_size,
+                                                 config->period_count,
+                                                 config->rate,
+                                                 in->common.sample_rate,
+                                                 in->common.frame_size,
+                                                 in->common.input_source);
 }
 
 /* must be called with hw device and input stream mutexes locked */
@@ -1563,7 +5908,8 @@ static int do_open_pcm_input(struct stream_in_pcm *in)
   config.rate = in_pcm_cfg_rate(in);
   config.period_size = in_pcm_cfg_period_size(in);
   config.period_count = in_pcm_cfg_period_count(in);
-  config.format = pcm_format_from_audio_format(in->common.format);
+  in->hw_format = in_pcm_cfg_format(in);
+  config.format = pcm_format_from_audio_format(in->hw_format);
   config.start_threshold = 0;
 
   ALOGV("do_open_pcm_input: open PCM config (card %d device %d): channels = %d, rate = %d, "
@@ -1595,11 +5941,16 @@ static int do_open_pcm_input(struct stream_in_pcm *in)
   if (!adev->disable_audio) {
     if (in_get_sample_rate(&in->common.stream.common) != config.rate) {
       ret = in_resampler_init(in, config.rate, config.channels,
-          pcm_frames_to_bytes(in->pcm, config.period_size));
+                              config.period_size);
       if (ret < 0) {
         goto fail;
       }
     }
+
+    ret = in_pcm_build_pipes(in);
+    if (ret < 0) {
+      goto fail;
+    }
   }
   ALOGV("-do_open_pcm_input");
   return 0;
@@ -1628,7 +5979,7 @@ static int start_pcm_input_stream(struct stream_in_pcm *in)
 }
 
 static int change_input_source_locked(struct stream_in_pcm *in,
-                                      const char *value,
+                                      int new_source,
                                       uint32_t devices, bool *was_changed)
 {
   struct audio_device *adev = in->common.dev;
@@ -1636,7 +5987,6 @@ static int change_input_source_locked(struct stream_in_pcm *in,
   const char *stream_name = NULL;
   const struct hw_stream *hw = NULL;
   bool voice_control = false;
-  const int new_source = atoi(value);
 
   *was_changed = false;
 
@@ -1662,7 +6012,18 @@ static int change_input_source_locked(struct stream_in_pcm *in,
       /* depends on voice recognition type and state whether we open
        * the voice recognition stream or generic PCM stream
        */
-      stream_name = voice_trigger_audio_stream_name(adev);
+      pthread_mutex_lock(&adev->lock);
+      if ((adev->voice_st == eVoiceRecogFired) &&
+          (adev->voice_recog_stream != NULL)) {
+        /* Hand over the stream that fired. Its paths are already applied
+         * and the hardware has kept the audio since the trigger
+         */
+        hw = share_stream(adev->voice_recog_stream);
+        ALOGV("Changing input source to armed %s", kVoiceRecogStreamName);
+      } else {
+        stream_name = voice_trigger_audio_stream_name(adev);
+      }
+      pthread_mutex_unlock(&adev->lock);
       voice_control = true;
       break;
 
@@ -1683,9 +6044,10 @@ static int change_input_source_locked(struct stream_in_pcm *in,
     config.sample_rate = in->common.sample_rate;
     config.channel_mask = in->common.channel_mask;
     config.format = in->common.format;
-    hw = get_stream(in->common.dev->cm, devices, 0, &config);
-    ALOGV_IF(hw != NULL, "Changing to default input source for devices 0x%x",
-             devices);
+    hw = get_input_stream(in->common.dev->cm, devices, new_source,
+                          in->common.flags, &config);
+    ALOGV_IF(hw != NULL, "Changing input source to %d for devices 0x%x",
+             new_source, devices);
   }
 
   if (hw != NULL) {
@@ -1698,6 +6060,9 @@ static int change_input_source_locked(struct stream_in_pcm *in,
 
     in->common.hw = hw;
 
+    /* The profile usecase was applied to the previous stream */
+    in_apply_profile_l(in);
+
     pthread_mutex_lock(&adev->lock);
     if (voice_control) {
       adev->active_voice_control = in;
@@ -1717,17 +6082,6 @@ static int change_input_source_locked(struct stream_in_pcm *in,
   }
 }
 
-static void do_in_pcm_gain(void* buffer, size_t bytes)
-{
-  uint16_t* buf = (uint16_t*)buffer;
-  uint16_t elem;
-
-  for (int i=0; i<bytes/2; i++) {
-    *buf=*buf << 6;
-    *buf++;
-  }
-}
-
 static ssize_t do_in_pcm_read(struct audio_stream_in *stream, void* buffer,
                               size_t bytes)
 {
@@ -1735,6 +6089,8 @@ static ssize_t do_in_pcm_read(struct audio_stream_in *stream, void* buffer,
   struct stream_in_pcm *in = (struct stream_in_pcm *)stream;
   struct audio_device *adev = in->common.dev;
   size_t frames_rq = bytes / in->common.frame_size;
+  const int64_t cpu_ns = governor_cpu_ns();
+  enum dsp_quality quality = e_quality_full;
 
   // ALOGV("+do_in_pcm_read %d", bytes);
 
@@ -1745,16 +6101,41 @@ static ssize_t do_in_pcm_read(struct audio_stream_in *stream, void* buffer,
     goto exit;
   }
 
+  if (in->profile_pending != in->profile) {
+    in_apply_profile_l(in);
+  }
+
+  quality = governor_level(adev);
+  if (in_is_resampling(in) && (in->quality != quality)) {
+    in_resampler_requalify(in, quality);
+  }
+
   if (!adev->disable_audio) {
-    if (in->resampler.resampler != NULL) {
+    if (in_is_resampling(in)) {
       ret = read_resampled_frames(in, buffer, frames_rq);
+      if ((ret >= 0) && (in->taps[e_tap_resampled] != NULL)) {
+        dump_tap_push(in->taps[e_tap_resampled], buffer, bytes);
+      }
+    } else if ((in->hw_format != in->common.format) ||
+               (in->hw_channel_count != in->common.channel_count)) {
+      ret = read_converted_frames(in, buffer, frames_rq);
     } else {
       ret = pcm_read(in->pcm, buffer, bytes);
+      if ((ret >= 0) && (in->taps[e_tap_hw] != NULL)) {
+        dump_tap_push(in->taps[e_tap_hw], buffer, bytes);
+      }
+      /* only gain is left to do, in place */
+      if ((ret >= 0) && (in->pipe.process != NULL)) {
+        pcm_pipe_run(adev->pool, &in->pipe, buffer, buffer, frames_rq);
+      }
+    }
+
+    if ((ret >= 0) && (in->taps[e_tap_client] != NULL)) {
+      dump_tap_push(in->taps[e_tap_client], buffer, bytes);
     }
 
-    /* add gain on built-in microphone (only for demo purpose) */
-    if ((in->common.frame_size == 2) && (in->common.devices == AUDIO_DEVICE_IN_BUILTIN_MIC)) {
-      do_in_pcm_gain(buffer, bytes);
+    if ((ret >= 0) && in->common.meter.enabled) {
+      meter_process(&in->common.meter, buffer, bytes);
     }
 
     /* Assume any non-negative return is a successful read */
@@ -1770,6 +6151,7 @@ static ssize_t do_in_pcm_read(struct audio_stream_in *stream, void* buffer,
 
 exit:
   pthread_mutex_unlock(&in->common.lock);
+  governor_account(&in->common.governor, governor_cpu_ns() - cpu_ns);
 
   // ALOGV("-do_in_pcm_read (%d)", ret);
   return ret;
@@ -1846,6 +6228,8 @@ static int in_pcm_set_parameters(struct audio_stream *stream, const char *kvpair
   bool routing_changed = false;
   uint32_t devices = 0;
   bool input_was_changed = false;
+  unsigned int taps = 0;
+  bool meter = false;
   int ret = 0;
 
   ALOGV("+in_pcm_set_parameters(%p) '%s'", stream, kvpairs);
@@ -1856,26 +6240,45 @@ static int in_pcm_set_parameters(struct audio_stream *stream, const char *kvpair
 
   pthread_mutex_lock(&in->common.lock);
 
+  if (dump_parse_taps(kvpairs, &taps) == 0) {
+    dump_update_taps_l(adev, in->taps, taps, in, "in");
+  }
+
+  if (meter_parse(kvpairs, &meter) == 0) {
+    meter_enable_l(&in->common.meter, meter, in->common.format,
+                   in_get_sample_rate(&in->common.stream.common),
+                   popcount(in_get_channels(&in->common.stream.common)));
+  }
+
   if(str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_INPUT_SOURCE,
                        value, sizeof(value)) >= 0) {
 
     if (routing_changed) {
       devices = new_routing;
     } else if (in->common.hw != NULL) {
-      /* Route new stream to same devices as current stream */
+      /* Route new stream to same devices as current stream, including
+       * a change that is still being debounced
+       */
+      settle_route(in->common.hw);
       devices = get_routed_devices(in->common.hw);
     } else {
       devices = 0;
     }
 
-    ret = change_input_source_locked(in, value, devices, &input_was_changed);
+    ret = change_input_source_locked(in, atoi(value), devices,
+                                     &input_was_changed);
     if (ret < 0) {
       goto out;
     }
 
-    /* We must apply any existing routing to the new stream */
-    new_routing = devices;
-    routing_changed = true;
+    /* We must apply any existing routing to the new stream. If the
+     * source was already selected when the stream was opened its
+     * routing is already applied
+     */
+    if (input_was_changed) {
+      new_routing = devices;
+      routing_changed = true;
+    }
   }
 
   if (routing_changed) {
@@ -1885,6 +6288,11 @@ static int in_pcm_set_parameters(struct audio_stream *stream, const char *kvpair
       ALOGV("Apply routing=0x%x to input stream", new_routing);
       apply_route(in->common.hw, new_routing);
     }
+
+    /* the built-in microphone gain depends on the routing */
+    if (!in->common.standby) {
+      in_pcm_build_pipes(in);
+    }
     ret = 0;
   }
 
@@ -1912,23 +6320,33 @@ static void do_close_in_pcm(struct audio_stream *stream)
     }
   }
 
+  pthread_mutex_lock(&in->common.lock);
+  dump_update_taps_l(in->common.dev, in->taps, 0, in, "in");
+  pthread_mutex_unlock(&in->common.lock);
+
+  free(in->convert);
+
   do_close_in_common(stream);
 }
 
 static int do_init_in_pcm(struct stream_in_pcm *in,
                           struct audio_config *config)
 {
-  UNUSED(config);
   in->common.close = do_close_in_pcm;
   in->common.stream.common.standby = in_pcm_standby;
   in->common.stream.common.set_parameters = in_pcm_set_parameters;
   in->common.stream.read = in_pcm_read;
+  in->common.stream.update_sink_metadata = in_update_sink_metadata;
 
   /* Although AudioFlinger has not yet told us the input_source for
    * this stream, it expects us to already know the buffer size.
-   * We just have to hardcode something that might work
+   * Size it from the stream these devices would get
    */
-  in->common.buffer_size = IN_COMPRESS_BUFFER_SIZE_DEFAULT;
+  in->common.buffer_size = in_estimate_buffer_size(in->common.dev->cm,
+                                                   in->common.devices,
+                                                   config,
+                                                   in->common.input_source,
+                                                   in->common.flags);
 
   return 0;
 }
@@ -1936,6 +6354,90 @@ static int do_init_in_pcm(struct stream_in_pcm *in,
 /*********************************************************************
  * Stream open and close
  *********************************************************************/
+
+/*
+ * A stream probed from a hotplugged card has a single native
+ * configuration. If AudioFlinger asked for something else, update config
+ * with the native settings so that it can retry the open with them.
+ *
+ * Returns true if config is usable as-is
+ */
+static bool check_native_config(const struct hw_stream *hw,
+                                struct audio_config *config)
+{
+  const audio_channel_mask_t native_mask = stream_is_input(hw) ?
+                        audio_channel_in_mask_from_count(hw->channels) :
+                        audio_channel_out_mask_from_count(hw->channels);
+  bool ok = true;
+
+  if (hw->format == AUDIO_FORMAT_DEFAULT) {
+    return true;
+  }
+
+  if (config->sample_rate == 0) {
+    config->sample_rate = hw->rate;
+  } else if (config->sample_rate != hw->rate) {
+    config->sample_rate = hw->rate;
+    ok = false;
+  }
+
+  if (config->format == AUDIO_FORMAT_DEFAULT) {
+    config->format = hw->format;
+  } else if (config->format != hw->format) {
+    config->format = hw->format;
+    ok = false;
+  }
+
+  if (config->channel_mask == 0) {
+    config->channel_mask = native_mask;
+  } else if ((uint32_t)popcount(config->channel_mask) != hw->channels) {
+    config->channel_mask = native_mask;
+    ok = false;
+  }
+
+  ALOGV_IF(!ok, "Native config is rate=%u format=0x%x channels=%u",
+               hw->rate, hw->format, hw->channels);
+  return ok;
+}
+
+/*
+ * A multichannel layout on HDMI must be one the connected sink has
+ * speakers for, otherwise suggest the best one it has so that AudioFlinger
+ * can retry the open with it.
+ *
+ * Returns true if config is usable as-is
+ */
+static bool check_hdmi_sink_config(const struct hw_stream *hw,
+                                   audio_devices_t devices,
+                                   struct audio_config *config)
+{
+  audio_channel_mask_t masks[HDMI_MAX_LAYOUTS];
+  int count = 0;
+  int i = 0;
+
+  if (((devices & AUDIO_DEVICE_OUT_HDMI) == 0) ||
+      (popcount(config->channel_mask) <= 2)) {
+    return true;
+  }
+
+  count = hdmi_get_sink_masks(hw, masks, ARRAY_SIZE(masks));
+  if (count <= 0) {
+    /* sink capabilities unknown, leave it to the driver */
+    return true;
+  }
+
+  for (i = 0; i < count; ++i) {
+    if (masks[i] == config->channel_mask) {
+      return true;
+    }
+  }
+
+  ALOGV("HDMI sink can't play channel mask 0x%x, suggesting 0x%x",
+            config->channel_mask, masks[0]);
+  config->channel_mask = masks[0];
+  return false;
+}
+
 static int adev_open_output_stream(struct audio_hw_device *dev,
                                    audio_io_handle_t handle,
                                    audio_devices_t devices,
@@ -1957,7 +6459,24 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
   ALOGV("+adev_open_output_stream");
 
   devices &= AUDIO_DEVICE_OUT_ALL;
-  const struct hw_stream *hw = get_stream(adev->cm, devices, flags, config);
+
+  struct audio_config hw_config = *config;
+  if (!audio_is_linear_pcm(config->format)) {
+    /* Compressed bitstreams are only supported as IEC 61937 passthrough
+     * to a digital link, which is a PCM stream to the hardware
+     */
+    if (!iec61937_is_supported(config->format) ||
+        ((devices & (AUDIO_DEVICE_OUT_HDMI | AUDIO_DEVICE_OUT_SPDIF)) == 0)) {
+      ALOGE("Format 0x%x not supported on devices 0x%x", config->format,
+                devices);
+      ret = -EINVAL;
+      goto err_fail;
+    }
+    hw_config.format = AUDIO_FORMAT_PCM_16_BIT;
+    hw_config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+  }
+
+  const struct hw_stream *hw = get_stream(adev->cm, devices, flags, &hw_config);
   if (!hw) {
     ALOGE("No suitable output stream for devices=0x%x flags=0x%x format=0x%x",
               devices, flags, config->format);
@@ -1965,8 +6484,17 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     goto err_fail;
   }
 
+  if (audio_is_linear_pcm(config->format) &&
+      (!check_native_config(hw, config) ||
+       !check_hdmi_sink_config(hw, devices, config))) {
+    release_stream(hw);
+    ret = -EINVAL;
+    goto err_fail;
+  }
+
   out.common = calloc(1, sizeof(struct stream_out_pcm));
   if (!out.common) {
+    release_stream(hw);
     ret = -ENOMEM;
     goto err_fail;
   }
@@ -1981,9 +6509,15 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
   pthread_mutex_init(&out.common->lock, (const pthread_mutexattr_t *) NULL);
   pthread_mutex_init(&out.common->pre_lock, (const pthread_mutexattr_t *) NULL);
 
-  ret = do_init_out_pcm( out.pcm, config );
+  ret = do_init_out_pcm( out.pcm, config, flags );
   if (ret < 0) {
-    goto err_open;
+    /* The close handler undoes whatever part of the init was done,
+     * releases the hw stream and frees the stream
+     */
+    (out.common->close)(&out.common->stream.common);
+    pthread_mutex_destroy(&out.common->pre_lock);
+    pthread_mutex_destroy(&out.common->lock);
+    goto err_close;
   }
 
 
@@ -1992,6 +6526,8 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
   config->channel_mask = out.common->channel_mask;
   config->sample_rate = out.common->sample_rate;
 
+  governor_add_stream(adev, &out.common->governor);
+
   *stream_out = &out.common->stream;
   ALOGV("-adev_open_output_stream(%p) with format = 0x%x, channel mask = 0x%x,"
         "sample rate = %d", *stream_out, config->format, config->channel_mask,
@@ -1999,7 +6535,9 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
   return 0;
 
 err_open:
+  release_stream(hw);
   free(out.common);
+err_close:
   *stream_out = NULL;
 err_fail:
   ALOGV("-adev_open_output_stream (%d)", ret);
@@ -2013,6 +6551,7 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
   struct stream_out_common *out = (struct stream_out_common *)stream;
   ALOGV("adev_close_output_stream(%p)", stream);
 
+  governor_remove_stream(out->dev, &out->governor);
   (out->close)(&stream->common);
 
   pthread_mutex_destroy(&out->pre_lock);
@@ -2030,21 +6569,24 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
 {
   struct audio_device *adev = (struct audio_device *)dev;
   struct stream_in_pcm *in = NULL;
+  bool changed = false;
   int ret = 0;
 
   UNUSED(handle);
-  UNUSED(flags);
   UNUSED(address);
-  UNUSED(source);
 
   ALOGV("+adev_open_input_stream");
 
   *stream_in = NULL;
 
-  /* We don't open a config manager stream here because we don't yet
-   * know what input_source to use. Defer until Android sends us an
-   * input_source set_parameter()
-   */
+  if (config->format == AUDIO_FORMAT_DEFAULT) {
+    config->format = AUDIO_FORMAT_PCM_16_BIT;
+  } else if (!in_format_supported(config->format)) {
+    /* suggest a format AudioFlinger can retry the open with */
+    ALOGV("-adev_open_input_stream format 0x%x unsupported", config->format);
+    config->format = AUDIO_FORMAT_PCM_16_BIT;
+    return -EINVAL;
+  }
 
   in = (struct stream_in_pcm *)calloc(1, sizeof(struct stream_in_pcm));
   if (!in) {
@@ -2059,13 +6601,38 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
   if (ret < 0) {
     goto fail;
   }
+  in->common.flags = flags;
+
+  /* A hotword capture reads the audio of the voice trigger */
+  if (flags & AUDIO_INPUT_FLAG_HW_HOTWORD) {
+    source = AUDIO_SOURCE_VOICE_RECOGNITION;
+  }
 
   ret = do_init_in_pcm(in, config);
   if (ret < 0) {
     goto fail;
   }
 
+  /* Open the config manager stream for the source now so that it doesn't
+   * wait for the input_source set_parameter(). An error is not fatal,
+   * the stream is chosen again when the input_source is set
+   */
+  pthread_mutex_init(&in->common.lock, NULL);
+  if (source != AUDIO_SOURCE_DEFAULT) {
+    pthread_mutex_lock(&in->common.lock);
+    if ((change_input_source_locked(in, source, devices, &changed) == 0) &&
+        changed) {
+      apply_route(in->common.hw, devices);
+      in->common.buffer_size = in_stream_buffer_size(in->common.hw, config,
+                                                     source);
+    }
+    pthread_mutex_unlock(&in->common.lock);
+  }
+
+  governor_add_stream(adev, &in->common.governor);
+
   *stream_in = &in->common.stream;
+  ALOGV("-adev_open_input_stream source=%d hw=%p", source, in->common.hw);
   return 0;
 
 fail:
@@ -2080,6 +6647,7 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
   UNUSED(dev);
   struct stream_in_common *in = (struct stream_in_common *)stream;
   ALOGV("adev_close_input_stream(%p)", stream);
+  governor_remove_stream(in->dev, &in->governor);
   (in->close)(&stream->common);
 }
 
@@ -2108,7 +6676,7 @@ static void do_voice_trigger_close_stream(struct audio_device *adev)
   if (adev->voice_trig_stream != NULL) {
     apply_route(adev->voice_trig_stream, 0);
     release_stream(adev->voice_trig_stream);
-    adev->voice_trig_stream == NULL;
+    adev->voice_trig_stream = NULL;
   }
 }
 
@@ -2133,6 +6701,9 @@ static void voice_trigger_enable(struct audio_device *adev)
 
     case eVoiceRecogIdle:
       do_voice_trigger_open_stream(adev, kVoiceRecogStreamName);
+      if (adev->voice_recog_stream != NULL) {
+        apply_use_case(adev->voice_recog_stream, "voice_mode", "trigger");
+      }
       adev->voice_st = eVoiceRecogArmed;
       break;
 
@@ -2195,12 +6766,17 @@ static void voice_trigger_disable(struct audio_device *adev)
   pthread_mutex_unlock(&adev->lock);
 }
 
-static void voice_trigger_triggered(struct audio_device *adev)
+static void voice_trigger_triggered(struct audio_device *adev,
+                                    int64_t timestamp_ns)
 {
   pthread_mutex_lock(&adev->lock);
 
   ALOGV("+voice_trigger_triggered (%u)", adev->voice_st);
 
+  if (timestamp_ns != 0) {
+    adev->voice_trig_time_ns = timestamp_ns;
+  }
+
   switch (adev->voice_st) {
     case eVoiceNone:
     case eVoiceTriggerIdle:
@@ -2243,6 +6819,12 @@ static void voice_trigger_audio_started_locked(struct audio_device *adev)
       break;
 
     case eVoiceRecogFired:
+      /* The capture has taken over the armed stream, switch the
+       * hardware from detecting to streaming without touching the paths
+       */
+      if (adev->voice_recog_stream != NULL) {
+        apply_use_case(adev->voice_recog_stream, "voice_mode", "stream");
+      }
       adev->voice_st = eVoiceRecogAudio;
       break;
 
@@ -2276,6 +6858,9 @@ static void voice_trigger_audio_ended_locked(struct audio_device *adev)
       break;
 
     case eVoiceRecogReArm:
+      if (adev->voice_recog_stream != NULL) {
+        apply_use_case(adev->voice_recog_stream, "voice_mode", "trigger");
+      }
       adev->voice_st = eVoiceRecogArmed;
       break;
   }
@@ -2296,7 +6881,7 @@ static void voice_trigger_set_params(struct audio_device *adev,
   ret = str_parms_get_str(parms, "voice_trigger", value, sizeof(value));
   if (ret >= 0) {
     if (strcmp(value, "2") == 0) {
-      voice_trigger_triggered(adev);
+      voice_trigger_triggered(adev, 0);
     } else if (strcmp(value, "1") == 0) {
       voice_trigger_enable(adev);
     } else if (strcmp(value, "0") == 0) {
@@ -2355,6 +6940,58 @@ static void voice_trigger_init(struct audio_device *adev)
   }
 }
 
+/*********************************************************************
+ * Card hotplug
+ *********************************************************************/
+
+static bool is_hotplug_device(audio_devices_t device)
+{
+  if (device & AUDIO_DEVICE_BIT_IN) {
+    return (device & AUDIO_DEVICE_IN_ALL_USB & ~AUDIO_DEVICE_BIT_IN) != 0;
+  } else {
+    return (device & AUDIO_DEVICE_OUT_ALL_USB) != 0;
+  }
+}
+
+static void hotplug_set_params(struct audio_device *adev,
+                               struct str_parms *parms)
+{
+  char value[32];
+  audio_devices_t device = 0;
+  bool connect = false;
+  int card = -1;
+  int pcm_device = 0;
+
+  if (str_parms_get_str(parms, AUDIO_PARAMETER_DEVICE_CONNECT,
+                        value, sizeof(value)) >= 0) {
+    connect = true;
+  } else if (str_parms_get_str(parms, AUDIO_PARAMETER_DEVICE_DISCONNECT,
+                               value, sizeof(value)) < 0) {
+    return;
+  }
+
+  device = (audio_devices_t)strtoul(value, NULL, 0);
+  if (!is_hotplug_device(device)) {
+    return;
+  }
+
+  /* AudioPolicy sends the card of a USB device as card=<n>;device=<n> */
+  if (str_parms_get_int(parms, "card", &card) < 0) {
+    ALOGW("hotplug of device 0x%x without card number", device);
+    return;
+  }
+  str_parms_get_int(parms, "device", &pcm_device);
+
+  if (connect) {
+    if (add_dynamic_stream(adev->cm, device, card, pcm_device) == 0) {
+      ALOGI("Card %d device %d added for 0x%x", card, pcm_device, device);
+    }
+  } else {
+    remove_dynamic_streams(adev->cm, device, card);
+    ALOGI("Card %d removed for 0x%x", card, device);
+  }
+}
+
 /*********************************************************************
  * Global API functions
  *********************************************************************/
@@ -2370,6 +7007,7 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
   parms = str_parms_create_str(kvpairs);
   if (parms) {
     voice_trigger_set_params(adev, parms);
+    hotplug_set_params(adev, parms);
     str_parms_destroy(parms);
   }
 
@@ -2382,9 +7020,39 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 static char * adev_get_parameters(const struct audio_hw_device *dev,
                                   const char *keys)
 {
-  UNUSED(dev);
-  UNUSED(keys);
-  return strdup("");
+  struct audio_device *adev = (struct audio_device *)dev;
+  struct str_parms *query = str_parms_create_str(keys);
+  struct str_parms *reply = NULL;
+  char *str = NULL;
+  char value[32];
+
+  if (!query) {
+    return strdup("");
+  }
+
+  reply = str_parms_create();
+  if (reply) {
+    if (str_parms_has_key(query, AUDIO_PARAMETER_JACK_OUT_DEVICES)) {
+      str_parms_add_int(reply, AUDIO_PARAMETER_JACK_OUT_DEVICES,
+                        get_jack_devices(adev->cm, false));
+    }
+    if (str_parms_has_key(query, AUDIO_PARAMETER_JACK_IN_DEVICES)) {
+      str_parms_add_int(reply, AUDIO_PARAMETER_JACK_IN_DEVICES,
+                        get_jack_devices(adev->cm, true));
+    }
+    if (str_parms_has_key(query, AUDIO_PARAMETER_VOICE_TRIGGER_TIME)) {
+      pthread_mutex_lock(&adev->lock);
+      snprintf(value, sizeof(value), "%lld",
+               (long long)adev->voice_trig_time_ns);
+      pthread_mutex_unlock(&adev->lock);
+      str_parms_add_str(reply, AUDIO_PARAMETER_VOICE_TRIGGER_TIME, value);
+    }
+    str = str_parms_to_str(reply);
+    str_parms_destroy(reply);
+  }
+  str_parms_destroy(query);
+
+  return str ? str : strdup("");
 }
 
 static int adev_init_check(const struct audio_hw_device *dev)
@@ -2456,22 +7124,59 @@ static int adev_set_master_mute(struct audio_hw_device *dev, bool mute)
 static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
     const struct audio_config *config)
 {
-  size_t s = IN_PERIOD_SIZE_DEFAULT *
-             audio_bytes_per_sample(config->format) *
-             popcount(config->channel_mask);
-  UNUSED(dev);
+  struct audio_device *adev = (struct audio_device *)dev;
 
-  if (s > IN_COMPRESS_BUFFER_SIZE_DEFAULT) {
-    s = IN_COMPRESS_BUFFER_SIZE_DEFAULT;
-  }
+  return in_estimate_buffer_size(adev->cm, AUDIO_DEVICE_IN_DEFAULT, config,
+                                 AUDIO_SOURCE_DEFAULT, AUDIO_INPUT_FLAG_NONE);
+}
+
+static void adev_publish_jacks(struct audio_device *adev)
+{
+  char value[16];
 
-  return s;
+  snprintf(value, sizeof(value), "0x%x", get_jack_devices(adev->cm, false));
+  property_set(PROP_AUDIO_JACK_OUT_DEVICES, value);
+  snprintf(value, sizeof(value), "0x%x", get_jack_devices(adev->cm, true));
+  property_set(PROP_AUDIO_JACK_IN_DEVICES, value);
+}
+
+static void adev_config_event(void *cookie, enum config_event event,
+                              uint32_t arg, int64_t timestamp_ns)
+{
+  struct audio_device *adev = (struct audio_device *)cookie;
+
+  switch (event) {
+    case e_config_event_jack_inserted:
+      ALOGI("Jack inserted: device 0x%x at %lld ns", arg,
+            (long long)timestamp_ns);
+      adev_publish_jacks(adev);
+      break;
+    case e_config_event_jack_removed:
+      ALOGI("Jack removed: device 0x%x at %lld ns, streams rerouted", arg,
+            (long long)timestamp_ns);
+      adev_publish_jacks(adev);
+      break;
+    case e_config_event_trigger:
+      ALOGV("Voice trigger fired (%u) at %lld ns", arg,
+            (long long)timestamp_ns);
+      voice_trigger_triggered(adev, timestamp_ns);
+      break;
+    default:
+      break;
+  }
 }
 
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
-  UNUSED(device);
-  UNUSED(fd);
+  struct audio_device *adev = (struct audio_device *)device;
+
+  dprintf(fd, "TinyHAL:\n");
+  pthread_mutex_lock(&adev->lock);
+  dprintf(fd, "  Voice trigger state: %u last hw trigger: %lld ns\n",
+          adev->voice_st, (long long)adev->voice_trig_time_ns);
+  pthread_mutex_unlock(&adev->lock);
+  governor_dump(adev, fd);
+  dump_audio_config(adev->cm, fd);
   return 0;
 }
 
@@ -2479,7 +7184,11 @@ static int adev_close(hw_device_t *device)
 {
   struct audio_device *adev = (struct audio_device *)device;
 
+  set_config_event_callback(adev->cm, NULL, NULL);
   free_audio_config(adev->cm);
+  dump_writer_free(adev);
+  dsp_pool_free(adev->pool);
+  governor_free(adev);
 
   free(device);
   return 0;
@@ -2576,6 +7285,9 @@ static int adev_open(const hw_module_t *module, const char *name,
   adev->hw_device.get_audio_port = adev_get_audio_port;
   adev->hw_device.set_audio_port_config = NULL;
 
+  dump_writer_init(adev);
+  governor_init(adev);
+
   adev->cm = init_audio_config();
   if (!adev->cm) {
     ret = -EINVAL;
@@ -2584,6 +7296,8 @@ static int adev_open(const hw_module_t *module, const char *name,
 
   adev->global_stream = get_named_stream(adev->cm, "global");
   voice_trigger_init(adev);
+  set_config_event_callback(adev->cm, adev_config_event, adev);
+  adev_publish_jacks(adev);
 
   property_get(PROP_AUDIO_CONFIG, prop_value, "false");
   if (strcmp(prop_value, "true") == 0) {
@@ -2593,6 +7307,8 @@ static int adev_open(const hw_module_t *module, const char *name,
     adev->disable_audio = false;
   }
 
+  adev->pool = dsp_pool_create();
+
   *device = &adev->hw_device.common;
   return 0;
 
@@ -2601,6 +7317,8 @@ fail:
     /*free_audio_config(adev->cm);*/ /* Currently broken */
   }
 
+  dump_writer_free(adev);
+  governor_free(adev);
   free(adev);
   return ret;
 }